@@ -0,0 +1,250 @@
+// checks of snapshots, the write-ahead log and the replica, run like
+// example.cc
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_replica.h"
+#include "virus_genealogy_snapshot.h"
+#include "virus_genealogy_wal.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Virus {
+public:
+    using id_type = std::string;
+    Virus(id_type const &_id) : id(_id) {
+    }
+    id_type get_id() const {
+        return id;
+    }
+private:
+    id_type id;
+};
+
+// A snapshot and the log after it bring back the same genealogy, creation
+// stamps included, and so do all log segments alone.
+void check_wal_recovery(std::string const &dir, genealogy_async_io &io) {
+    std::vector<std::string> order;
+    std::vector<std::uint64_t> stamps;
+    {
+        DurableVirusGenealogy<Virus> gen("stem", dir + "/wal0", io);
+        gen.create("z", "stem");
+        gen.create("m", "z");
+        gen.create("a", "stem");
+        gen.remove("m");
+        gen.create("m", "a");
+        gen.create("q", std::vector<std::string>{"z", "a"});
+        auto checkpoint = gen.checkpoint(dir + "/snapshot", dir + "/wal1");
+        gen.create("b", "q");
+        gen.connect("b", "m");
+        gen.create("c", "b");
+        checkpoint.get();
+        gen.sync().get();
+
+        order = gen.created_between(0, UINT64_MAX);
+        for (auto &id : order)
+            stamps.push_back(gen.created_at(id));
+    }
+    assert(order == (std::vector<std::string>{"stem", "z", "a", "m", "q", "b",
+                                              "c"}));
+
+    DurableVirusGenealogy<Virus> recovered(
+            load_snapshot<std::string>(dir + "/snapshot"), {dir + "/wal1"},
+            dir + "/wal2", io);
+    assert(recovered.size() == 7);
+    assert(recovered.get_parents("m") == std::vector<std::string>{"a"});
+    assert(recovered.get_parents("q") == (std::vector<std::string>{"a", "z"}));
+    assert(recovered.get_parents("b") == (std::vector<std::string>{"m", "q"}));
+    assert(recovered.get_children("b") == std::vector<std::string>{"c"});
+    assert(recovered.created_between(0, UINT64_MAX) == order);
+    for (std::size_t i = 0; i < order.size(); ++i)
+        assert(recovered.created_at(order[i]) == stamps[i]);
+    assert(recovered.newest(1) == std::vector<std::string>{"c"});
+    recovered.create("d", "c");
+    assert(recovered.created_at("d") > stamps.back());
+
+    VirusGenealogy<Virus> replayed("stem");
+    replay_wal(replayed, dir + "/wal0");
+    replay_wal(replayed, dir + "/wal1");
+    assert(replayed.size() == 7);
+    assert(replayed.get_parents("b") == recovered.get_parents("b"));
+    assert(replayed.get_parents("m") == recovered.get_parents("m"));
+    assert(replayed.created_between(0, UINT64_MAX) == order);
+    assert(replayed.created_at("m") == recovered.created_at("m"));
+}
+
+// A last record written only in half, as a crash may leave it, is waited
+// for by a replica and cut off on recovery.
+void check_torn_log(std::string const &dir, genealogy_async_io &io) {
+    auto path = dir + "/torn";
+    {
+        DurableVirusGenealogy<Virus> gen("stem", path, io);
+        gen.create("a", "stem");
+        gen.create("b", "a");
+        gen.sync().get();
+    }
+    auto complete = std::filesystem::file_size(path);
+
+    auto record = genealogy_wal_record<std::string>{
+            genealogy_mutation::create, {"c", "b"}, 3}.encode();
+    auto torn = record;
+    std::fill(torn.begin() + torn.size() / 2, torn.end(), '\0');
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out.write(torn.data(), torn.size());
+    }
+
+    ReplicaVirusGenealogy<Virus> replica("stem", path);
+    assert(replica.catch_up() == 2);
+    {
+        std::fstream out(path, std::ios::binary | std::ios::in |
+                               std::ios::out);
+        out.seekp(complete);
+        out.write(record.data(), record.size());
+    }
+    assert(replica.catch_up() == 1);
+    assert(replica.read([](auto const &gen) {
+        return gen.get_parents("c");
+    }) == std::vector<std::string>{"b"});
+
+    {
+        std::fstream out(path, std::ios::binary | std::ios::in |
+                               std::ios::out);
+        out.seekp(complete);
+        out.write(torn.data(), torn.size());
+    }
+    VirusGenealogy<Virus> replayed("stem");
+    assert(replay_wal(replayed, path) == complete);
+    assert(replayed.size() == 3);
+
+    DurableVirusGenealogy<Virus> recovered(genealogy_topology<std::string>{
+            genealogy_mode::dag, 0, {"stem"}, {0, 0}, {}, {}}, {path},
+            dir + "/after_torn", io);
+    assert(recovered.size() == 3);
+    assert(!recovered.exists("c"));
+    assert(std::filesystem::file_size(path) == complete);
+}
+
+// A replica following a log keeps up while it is written.
+void check_replica_tailing(std::string const &dir, genealogy_async_io &io) {
+    DurableVirusGenealogy<Virus> primary("stem", dir + "/tailed", io);
+    ReplicaVirusGenealogy<Virus> replica("stem", dir + "/tailed");
+    replica.follow(std::chrono::milliseconds(1));
+
+    std::size_t records = 0;
+    for (int i = 0; i < 2000; ++i) {
+        primary.create("v" + std::to_string(i),
+                       i == 0 ? "stem" : "v" + std::to_string(i / 2));
+        ++records;
+        if (i % 3 == 0 && i > 1) {
+            primary.connect("v" + std::to_string(i),
+                            "v" + std::to_string(i - 1));
+            ++records;
+        }
+        if (i % 100 == 99) {
+            primary.sync().get();
+            // Readers only ever see whole batches.
+            replica.read([](auto const &gen) {
+                assert(gen.exists("stem"));
+                return 0;
+            });
+        }
+    }
+    primary.sync().get();
+
+    for (int i = 0; i < 5000 && replica.applied_records() < records; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    replica.stop();
+    assert(!replica.error());
+    assert(replica.applied_records() == records);
+    replica.read([&](auto const &gen) {
+        assert(gen.size() == primary.size());
+        for (int i = 0; i < 2000; i += 7) {
+            auto id = "v" + std::to_string(i);
+            assert(gen.get_parents(id) == primary.get_parents(id));
+        }
+        return 0;
+    });
+}
+
+// Edge weights come back from the log, and from a checkpoint together with
+// the segment after it, although snapshots do not hold them.
+void check_weight_recovery(std::string const &dir, genealogy_async_io &io) {
+    {
+        DurableVirusGenealogy<Virus> gen("stem", dir + "/weighed0", io);
+        gen.create("a", "stem");
+        gen.create("b", std::vector<std::string>{"stem", "a"});
+        gen.set_edge_weight("b", "stem", 10);
+        gen.set_edge_weight("a", "stem", 0.5);
+        auto checkpoint = gen.checkpoint(dir + "/weighed_snapshot",
+                                         dir + "/weighed1");
+        gen.set_edge_weight("b", "a", 2);
+        checkpoint.get();
+        gen.sync().get();
+        assert(gen.weighted_lineage("b").second == 2.5);
+    }
+
+    DurableVirusGenealogy<Virus> recovered(
+            load_snapshot<std::string>(dir + "/weighed_snapshot"),
+            {dir + "/weighed1"}, dir + "/weighed2", io);
+    assert(recovered.edge_weight("b", "stem") == 10);
+    assert(recovered.edge_weight("a", "stem") == 0.5);
+    assert(recovered.weighted_lineage("b") ==
+           (std::pair<std::vector<std::string>, double>{{"stem", "a", "b"},
+                                                        2.5}));
+
+    VirusGenealogy<Virus> replayed("stem");
+    replay_wal(replayed, dir + "/weighed0");
+    assert(replayed.edge_weight("b", "stem") == 10);
+    assert(replayed.edge_weight("b", "a") == 1);
+}
+
+// Any flipped byte of a snapshot is caught, before or while decoding.
+void check_snapshot_corruption(std::string const &dir) {
+    VirusGenealogy<Virus> gen("stem");
+    for (int i = 0; i < 1000; ++i)
+        gen.create("v" + std::to_string(i),
+                   i < 10 ? "stem" : "v" + std::to_string(i / 10));
+    auto path = dir + "/checked";
+    save_snapshot(gen, path);
+    assert(verify_snapshot_file(path));
+
+    std::ifstream in(path, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+    for (auto at : {std::size_t(10), data.size() / 2, data.size() - 1}) {
+        auto corrupted = data;
+        corrupted[at] ^= 0x20;
+        assert(!verify_snapshot(corrupted));
+        try {
+            decode_snapshot<std::string>(corrupted);
+            assert(false);
+        }
+        catch (std::runtime_error &e) {
+            assert(std::string(e.what()) == "Corrupt genealogy snapshot");
+        }
+    }
+    assert(!verify_snapshot(data.substr(0, data.size() - 1)));
+}
+
+int main() {
+    char dir_template[] = "/tmp/virus_genealogy_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+    genealogy_async_io io;
+
+    check_wal_recovery(dir, io);
+    check_torn_log(dir, io);
+    check_replica_tailing(dir, io);
+    check_weight_recovery(dir, io);
+    check_snapshot_corruption(dir);
+
+    std::filesystem::remove_all(dir);
+}
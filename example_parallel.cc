@@ -0,0 +1,123 @@
+// checks of the algorithms run over the whole genealogy on many threads,
+// run like example.cc
+
+#include "virus_genealogy.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Virus {
+public:
+    using id_type = std::string;
+    Virus(id_type const &_id) : id(_id) {
+    }
+    id_type get_id() const {
+        return id;
+    }
+private:
+    id_type id;
+};
+
+// Every virus is visited once on many threads as on one, removed ones
+// never, and an exception thrown by one visit reaches the caller.
+void check_for_each() {
+    VirusGenealogy<Virus> gen("stem");
+    for (int i = 0; i < 10000; ++i)
+        gen.create("v" + std::to_string(i),
+                   i < 10 ? "stem" : "v" + std::to_string(i % 10));
+    gen.remove("v3");
+    auto size = gen.size();
+    assert(size == 1 + 10000 - 1000);
+
+    std::atomic<std::size_t> visited = 0;
+    gen.for_each_virus(genealogy_parallel_policy{4},
+                       [&](std::string const &id) {
+        assert(id != "v3" && id != "v13");
+        ++visited;
+    });
+    assert(visited == size);
+
+    auto length = [](std::string const &id) {
+        return id.size();
+    };
+    auto sum = [](std::size_t a, std::size_t b) {
+        return a + b;
+    };
+    auto letters = gen.transform_reduce(genealogy_seq, std::size_t(0), sum,
+                                        length);
+    assert(gen.transform_reduce(genealogy_par, std::size_t(0), sum, length) ==
+           letters);
+    assert(gen.transform_reduce(genealogy_parallel_policy{3}, std::size_t(7),
+                                sum, length) == letters + 7);
+
+    try {
+        gen.for_each_virus(genealogy_par, [](std::string const &id) {
+            if (id == "v9999")
+                throw std::out_of_range(id);
+        });
+        assert(false);
+    }
+    catch (std::out_of_range &e) {
+        assert(std::string(e.what()) == "v9999");
+    }
+}
+
+// Each virus gets the results of its parents (or children) when it runs,
+// so longest paths from the stem and counts of paths to the tips come out
+// the same on any number of threads. A cycle is refused.
+void check_dynamic_program() {
+    VirusGenealogy<Virus> gen("stem");
+    gen.create("A", "stem");
+    gen.create("B", "stem");
+    gen.create("AB", std::vector<std::string>{"A", "B"});
+    gen.create("A1", "A");
+    gen.create("AB1", std::vector<std::string>{"AB", "A1"});
+    gen.create("B1", "B");
+
+    auto depth = [](std::string const &, auto const &parents) {
+        int result = 0;
+        for (int parent : parents)
+            result = std::max(result, parent + 1);
+        return result;
+    };
+    auto depths = gen.dynamic_program<int>(genealogy_direction::top_down,
+                                           genealogy_seq, depth);
+    assert((std::map<std::string, int>(depths.begin(), depths.end()) ==
+            std::map<std::string, int>{{"A", 1}, {"A1", 2}, {"AB", 2},
+                                       {"AB1", 3}, {"B", 1}, {"B1", 2},
+                                       {"stem", 0}}));
+    assert(gen.dynamic_program<int>(genealogy_direction::top_down,
+                                    genealogy_parallel_policy{3}, depth) ==
+           depths);
+
+    auto paths = [](std::string const &, auto const &children) {
+        long result = children.empty() ? 1 : 0;
+        for (long child : children)
+            result += child;
+        return result;
+    };
+    auto to_tips = gen.dynamic_program<long>(genealogy_direction::bottom_up,
+                                             genealogy_par, paths);
+    assert(to_tips.front() == std::make_pair(std::string("A"), 2L));
+    assert(to_tips.back() == std::make_pair(std::string("stem"), 4L));
+
+    gen.connect("A", "AB1");
+    try {
+        gen.dynamic_program<int>(genealogy_direction::top_down,
+                                 genealogy_parallel_policy{2}, depth);
+        assert(false);
+    }
+    catch (std::invalid_argument &) {
+    }
+}
+
+int main() {
+    check_for_each();
+    check_dynamic_program();
+}
@@ -0,0 +1,434 @@
+// checks of the queries kept fast for large genealogies, run like example.cc
+
+#include "virus_genealogy.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class Virus {
+public:
+    using id_type = std::string;
+    Virus(id_type const &_id) : id(_id) {
+    }
+    id_type get_id() const {
+        return id;
+    }
+private:
+    id_type id;
+};
+
+// Pages of a hub's children follow each other without gaps or repeats,
+// also when children come and go between pages.
+void check_children_page() {
+    VirusGenealogy<Virus> gen("hub");
+    for (char letter = 'a'; letter <= 'j'; ++letter)
+        gen.create(std::string(1, letter), "hub");
+
+    auto first = gen.children_page("hub", std::nullopt, 4);
+    assert(first == (std::vector<std::string>{"a", "b", "c", "d"}));
+    gen.remove("e");
+    gen.create("da", "hub");
+    auto second = gen.children_page("hub", first.back(), 4);
+    assert(second == (std::vector<std::string>{"da", "f", "g", "h"}));
+    auto last = gen.children_page("hub", second.back(), 4);
+    assert(last == (std::vector<std::string>{"i", "j"}));
+    assert(gen.children_page("hub", last.back(), 4).empty());
+
+    //A cursor need not be a child any more.
+    gen.remove("h");
+    assert(gen.children_page("hub", "h", 1) == std::vector<std::string>{"i"});
+    assert(gen.children_page("a", std::nullopt, 10).empty());
+    try {
+        gen.children_page("nobody", std::nullopt, 10);
+        assert(false);
+    }
+    catch (VirusNotFound &) {
+    }
+}
+
+// Edges are found whether a virus has a few parents or many, and removing
+// viruses takes them out of the parents and children left behind.
+void check_has_edge() {
+    VirusGenealogy<Virus> gen("hub");
+    std::vector<std::string> strains;
+    for (int i = 0; i < 20; ++i) {
+        strains.push_back("strain" + std::to_string(i));
+        gen.create(strains.back(), "hub");
+    }
+    gen.create("few", std::vector<std::string>{"strain0", "strain1"});
+    gen.create("recombinant", strains);
+
+    assert(gen.has_edge("few", "strain1"));
+    assert(!gen.has_edge("few", "strain2"));
+    assert(!gen.has_edge("few", "nobody"));
+    for (auto &strain : strains)
+        assert(gen.has_edge("recombinant", strain));
+    assert(!gen.has_edge("recombinant", "hub"));
+    assert(!gen.has_edge("strain0", "recombinant"));
+    try {
+        gen.has_edge("nobody", "hub");
+        assert(false);
+    }
+    catch (VirusNotFound &) {
+    }
+
+    for (int i = 0; i < 15; ++i)
+        gen.remove(strains[i]);
+    assert(!gen.has_edge("recombinant", "strain3"));
+    assert(gen.has_edge("recombinant", "strain15"));
+    assert(gen.get_parents("recombinant").size() == 5);
+    assert(!gen.exists("few"));
+    assert(gen.get_children("hub").size() == 5);
+
+    gen.connect("recombinant", "hub");
+    assert(gen.has_edge("recombinant", "hub"));
+    gen.remove("strain15");
+    assert(gen.get_parents("recombinant").size() == 5);
+}
+
+// Sizes, edge counts and degrees follow every kind of change, including
+// connecting an edge twice and removals which take descendants along.
+void check_counts() {
+    VirusGenealogy<Virus> gen("stem");
+    assert(gen.size() == 1);
+    assert(gen.edge_count() == 0);
+
+    gen.create("A", "stem");
+    gen.create("B", "stem");
+    gen.create("AB", std::vector<std::string>{"A", "B"});
+    gen.create("A1", "A");
+    gen.connect("A1", "B");
+    gen.connect("A1", "B");
+    assert(gen.size() == 5);
+    assert(gen.edge_count() == 6);
+    assert(gen.child_count("stem") == 2);
+    assert(gen.child_count("B") == 2);
+    assert(gen.parent_count("A1") == 2);
+    assert(gen.parent_count("stem") == 0);
+
+    gen.remove("A");
+    assert(gen.size() == 4);
+    assert(gen.edge_count() == 3);
+    assert(gen.parent_count("AB") == 1);
+    assert(gen.child_count("B") == 2);
+    gen.remove("B");
+    assert(gen.size() == 1);
+    assert(gen.edge_count() == 0);
+    assert(gen.child_count("stem") == 0);
+    try {
+        gen.child_count("A");
+        assert(false);
+    }
+    catch (VirusNotFound &) {
+    }
+}
+
+// Sums and maxima over descendants stay right through every change, a
+// descendant reached by two paths counted once, and in tree mode an
+// invertible sum takes removed subtrees out of their ancestors.
+void check_aggregates() {
+    std::map<std::string, int> cases{{"stem", 1}, {"A", 10}, {"B", 20},
+                                     {"AB", 300}, {"B1", 4000}, {"C", 50000}};
+    auto sum = [](int a, int b) {
+        return a + b;
+    };
+    auto maximum = [](int a, int b) {
+        return std::max(a, b);
+    };
+    auto cases_of = [&](std::string const &id) {
+        return cases.at(id);
+    };
+
+    VirusGenealogy<Virus> gen("stem");
+    auto total = gen.register_aggregate(0, sum, cases_of);
+    gen.create("A", "stem");
+    gen.create("B", "stem");
+    gen.create("AB", std::vector<std::string>{"A", "B"});
+    auto worst = gen.register_aggregate(0, maximum, cases_of, true);
+    gen.create("B1", "B");
+    assert(gen.aggregate(total, "stem") == 4331);
+    assert(gen.aggregate(total, "B") == 4320);
+    assert(gen.aggregate(worst, "A") == 300);
+    assert(gen.aggregate(worst, "stem") == 4000);
+
+    gen.create("C", "A");
+    gen.connect("C", "B1");
+    assert(gen.aggregate(total, "stem") == 54331);
+    assert(gen.aggregate(total, "B") == 54320);
+    assert(gen.aggregate(worst, "B1") == 50000);
+    gen.remove("A");
+    assert(gen.aggregate(total, "stem") == 54321);
+    assert(gen.aggregate(worst, "B") == 50000);
+    gen.remove("B1");
+    assert(gen.aggregate(total, "stem") == 321);
+    assert(gen.aggregate(worst, "stem") == 300);
+
+    VirusGenealogy<Virus> tree("stem", genealogy_mode::tree);
+    auto tree_total = tree.register_invertible_aggregate(
+            0, sum, [](int x) {
+                return -x;
+            }, cases_of);
+    tree.create("A", "stem");
+    tree.create("AB", "A");
+    tree.create("B", "stem");
+    tree.create("B1", "B");
+    assert(tree.aggregate(tree_total, "stem") == 4331);
+    tree.remove("A");
+    assert(tree.aggregate(tree_total, "stem") == 4021);
+    assert(tree.aggregate(tree_total, "B") == 4020);
+}
+
+// Sketches count descendants reached by several paths once, exactly while
+// few and within a few percent when many, and forget removed ones.
+void check_descendant_sketches() {
+    VirusGenealogy<Virus> gen("stem");
+    try {
+        gen.estimated_descendants("stem");
+        assert(false);
+    }
+    catch (std::logic_error &) {
+    }
+
+    gen.create("left", "stem");
+    gen.create("right", "stem");
+    gen.enable_descendant_sketches();
+    gen.create("both", std::vector<std::string>{"left", "right"});
+    assert(gen.estimated_descendants("stem") == 4);
+    assert(gen.estimated_descendants("left") == 2);
+
+    for (int i = 0; i < 5000; ++i)
+        gen.create("v" + std::to_string(i),
+                   i < 50 ? "both" : "v" + std::to_string(i % 50));
+    auto estimate = gen.estimated_descendants("left");
+    assert(estimate > 5001 * 0.95 && estimate < 5001 * 1.05);
+
+    gen.connect("v7", "right");
+    gen.remove("both");
+    assert(gen.estimated_descendants("left") == 1);
+    assert(gen.estimated_descendants("right") == 1 + 100);
+    assert(gen.estimated_descendants("stem") == 3 + 100);
+    assert(gen.estimated_descendants("v7") == 100);
+}
+
+// Lineages sharing most ancestors come out similar and are found among
+// the most similar ones, unlike lineages meeting only at the stem, and
+// removed viruses are no longer found.
+void check_lineage_similarity() {
+    VirusGenealogy<Virus> gen("stem");
+    try {
+        gen.lineage_similarity("stem", "stem");
+        assert(false);
+    }
+    catch (std::logic_error &) {
+    }
+
+    gen.create("a0", "stem");
+    gen.create("b0", "stem");
+    gen.enable_lineage_signatures();
+    for (int i = 1; i < 40; ++i) {
+        gen.create("a" + std::to_string(i), "a" + std::to_string(i - 1));
+        gen.create("b" + std::to_string(i), "b" + std::to_string(i - 1));
+    }
+    assert(gen.lineage_similarity("a39", "a38") > 0.85);
+    assert(gen.lineage_similarity("a39", "b39") < 0.15);
+    assert(gen.lineage_similarity("a39", "a39") == 1);
+
+    auto similar = gen.most_similar_lineages("a39", 5);
+    assert(similar.size() == 5);
+    for (std::size_t i = 0; i < similar.size(); ++i) {
+        assert(similar[i].first[0] == 'a');
+        assert(i == 0 || similar[i - 1].second >= similar[i].second);
+    }
+
+    gen.remove("a30");
+    for (auto &[id, similarity] : gen.most_similar_lineages("a29", 100))
+        assert(gen.exists(id));
+    try {
+        gen.most_similar_lineages("a39", 5);
+        assert(false);
+    }
+    catch (VirusNotFound &) {
+    }
+}
+
+// The most prolific viruses come first and move up and down the ranking as
+// children are created, connected and removed.
+void check_top_by_children() {
+    VirusGenealogy<Virus> gen("stem");
+    for (auto name : {"big", "mid", "small"})
+        gen.create(name, "stem");
+    for (int i = 0; i < 6; ++i)
+        gen.create("big" + std::to_string(i), "big");
+    for (int i = 0; i < 4; ++i)
+        gen.create("mid" + std::to_string(i), "mid");
+    gen.create("small0", "small");
+
+    using ranking = std::vector<std::pair<std::string, std::size_t>>;
+    assert(gen.top_by_children(2) == (ranking{{"big", 6}, {"mid", 4}}));
+    assert(gen.top_by_children(3).back() == std::make_pair(std::string("stem"),
+                                                           std::size_t(3)));
+    assert(gen.top_by_children(100).size() == gen.size());
+    assert(gen.top_by_children(0).empty());
+
+    gen.connect("big0", "mid");
+    gen.connect("big1", "mid");
+    gen.connect("big2", "mid");
+    assert(gen.top_by_children(1) == (ranking{{"mid", 7}}));
+    gen.remove("mid");
+    assert(gen.top_by_children(1) == (ranking{{"big", 6}}));
+    assert(gen.top_by_children(2).back().second == 2);
+}
+
+// The tips are exactly the viruses without children: a parent stops being
+// one when it gets a child, by create or connect, and is one again when it
+// loses its last.
+void check_leaves() {
+    auto tips = [](VirusGenealogy<Virus> const &gen) {
+        auto leaves = gen.leaves();
+        std::vector<std::string> result(leaves.begin(), leaves.end());
+        assert(result.size() == leaves.size());
+        std::sort(result.begin(), result.end());
+        return result;
+    };
+
+    VirusGenealogy<Virus> gen("stem");
+    assert(tips(gen) == std::vector<std::string>{"stem"});
+    gen.create("A", "stem");
+    gen.create("B", "stem");
+    gen.create("A1", "A");
+    assert(tips(gen) == (std::vector<std::string>{"A1", "B"}));
+
+    gen.create("C", "stem");
+    gen.connect("A1", "C");
+    assert(tips(gen) == (std::vector<std::string>{"A1", "B"}));
+    gen.remove("A");
+    assert(tips(gen) == (std::vector<std::string>{"A1", "B"}));
+    gen.remove("C");
+    assert(tips(gen) == std::vector<std::string>{"B"});
+    gen.remove("B");
+    assert(tips(gen) == std::vector<std::string>{"stem"});
+    assert(!gen.leaves().empty());
+}
+
+// Samples are distinct live viruses, every one about equally often also
+// after removals moved others in the table, and walks follow edges.
+void check_sample() {
+    VirusGenealogy<Virus> gen("stem");
+    for (int i = 0; i < 10; ++i)
+        gen.create("v" + std::to_string(i), i < 5 ? "stem" : "v0");
+    gen.remove("v0");
+    gen.remove("v3");
+    std::mt19937 rng(2024);
+
+    std::map<std::string, int> drawn;
+    for (int round = 0; round < 4000; ++round) {
+        auto picked = gen.sample(2, rng);
+        assert(picked.size() == 2 && picked[0] != picked[1]);
+        for (auto &id : picked)
+            ++drawn[id];
+    }
+    assert(drawn.size() == 4);
+    for (auto &[id, count] : drawn) {
+        assert(gen.exists(id));
+        assert(count > 1700 && count < 2300);
+    }
+    assert(gen.sample(10, rng).size() == 4);
+    assert(gen.sample(0, rng).empty());
+
+    gen.create("v1a", "v1");
+    gen.create("v1b", "v1a");
+    auto walk = gen.random_walk("stem", 5, rng);
+    assert(walk.front() == "stem");
+    for (std::size_t i = 1; i < walk.size(); ++i)
+        assert(gen.has_edge(walk[i], walk[i - 1]));
+    assert(gen.get_children(walk.back()).empty() || walk.size() == 6);
+    assert(gen.random_walk("v1b", 5, rng, genealogy_direction::bottom_up) ==
+           (std::vector<std::string>{"v1b", "v1a", "v1", "stem"}));
+}
+
+// The lightest lineage takes the cheaper of two routes, even through a
+// negative weight, follows weights set later and forgets those of removed
+// edges.
+void check_weighted_lineage() {
+    VirusGenealogy<Virus> gen("stem");
+    gen.create("A", "stem");
+    gen.create("B", "stem");
+    gen.create("AB", std::vector<std::string>{"A", "B"});
+    gen.set_edge_weight("A", "stem", 5);
+    gen.set_edge_weight("AB", "B", 3);
+    assert(gen.edge_weight("AB", "A") ==
+           VirusGenealogy<Virus>::default_edge_weight);
+
+    using path = std::pair<std::vector<std::string>, double>;
+    assert(gen.weighted_lineage("AB") == (path{{"stem", "B", "AB"}, 4}));
+    gen.set_edge_weight("AB", "A", -3);
+    assert(gen.weighted_lineage("AB") == (path{{"stem", "A", "AB"}, 2}));
+    assert(gen.weighted_lineage("stem") == (path{{"stem"}, 0}));
+    try {
+        gen.set_edge_weight("B", "A", 1);
+        assert(false);
+    }
+    catch (std::invalid_argument &) {
+    }
+
+    gen.remove("A");
+    assert(gen.weighted_lineage("AB") == (path{{"stem", "B", "AB"}, 4}));
+    assert(gen.edge_weights().size() == 1);
+}
+
+// Windows of creation time list viruses in the order they were created,
+// also those sharing a stamp of a coarse clock or given an older one, and
+// keep that order through removals and a new layout.
+void check_created_between() {
+    std::uint64_t now = 100;
+    VirusGenealogy<Virus> gen("stem");
+    gen.set_creation_clock([&] {
+        return now;
+    });
+    for (auto name : {"a", "b", "c"})
+        gen.create(name, "stem");
+    now = 200;
+    for (auto name : {"d", "e"})
+        gen.create(name, "a");
+    gen.create("late", std::vector<std::string>{"stem"}, 100);
+
+    assert(gen.created_at("late") == 100);
+    assert(gen.created_between(100, 200) ==
+           (std::vector<std::string>{"a", "b", "c", "late"}));
+    assert(gen.created_between(101, 1000) ==
+           (std::vector<std::string>{"d", "e"}));
+    assert(gen.created_between(0, 100) == std::vector<std::string>{"stem"});
+    assert(gen.newest(3) == (std::vector<std::string>{"e", "d", "late"}));
+
+    gen.remove("b");
+    gen.remove("d");
+    gen.reorder(traversal_order::dfs);
+    assert(gen.created_between(100, 300) ==
+           (std::vector<std::string>{"a", "c", "late", "e"}));
+    gen.remove("late");
+    now = 150;
+    gen.create("f", "c");
+    assert(gen.created_at("f") == 200);
+    assert(gen.newest(10) == (std::vector<std::string>{"f", "e", "c", "a",
+                                                        "stem"}));
+}
+
+int main() {
+    check_children_page();
+    check_has_edge();
+    check_counts();
+    check_aggregates();
+    check_descendant_sketches();
+    check_lineage_similarity();
+    check_top_by_children();
+    check_leaves();
+    check_sample();
+    check_weighted_lineage();
+    check_created_between();
+}
@@ -0,0 +1,163 @@
+// checks of the ingestion queue and of the genealogy served over a socket,
+// run like example.cc
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_ingest.h"
+#include "virus_genealogy_rpc.h"
+#include "virus_genealogy_wal.h"
+#include <cassert>
+#include <cstdlib>
+#include <filesystem>
+#include <future>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Virus {
+public:
+    using id_type = std::string;
+    Virus(id_type const &_id) : id(_id) {
+    }
+    id_type get_id() const {
+        return id;
+    }
+private:
+    id_type id;
+};
+
+// Requests of many threads all get applied, each thread's in its own order,
+// a failing one only fails its own future, and with a log underneath every
+// answered request is durable.
+void check_ingest(std::string const &dir) {
+    genealogy_async_io io;
+    {
+        IngestingVirusGenealogy<Virus, DurableVirusGenealogy<Virus>> gen(
+                32, "stem", dir + "/ingested", io);
+
+        std::vector<std::thread> producers;
+        std::vector<std::vector<std::future<void>>> answers(4);
+        for (int t = 0; t < 4; ++t)
+            producers.emplace_back([&, t] {
+                auto lineage = "t" + std::to_string(t) + ".";
+                for (int i = 0; i < 500; ++i)
+                    //Each virus needs the one before, made by the same thread.
+                    answers[t].push_back(gen.create(
+                            lineage + std::to_string(i),
+                            i == 0 ? "stem" : lineage + std::to_string(i - 1)));
+            });
+        for (auto &producer : producers)
+            producer.join();
+        for (auto &thread_answers : answers)
+            for (auto &answer : thread_answers)
+                answer.get();
+
+        auto orphan = gen.create("orphan", "nobody");
+        auto again = gen.create("t0.0", "stem");
+        auto fine = gen.connect("t1.499", "t0.0");
+        try {
+            orphan.get();
+            assert(false);
+        }
+        catch (VirusNotFound &) {
+        }
+        try {
+            again.get();
+            assert(false);
+        }
+        catch (VirusAlreadyCreated &) {
+        }
+        fine.get();
+
+        gen.remove("t2.250").get();
+        assert(gen.read([](auto const &durable) {
+            return durable.size();
+        }) == 1 + 4 * 500 - 250);
+        assert(gen.batches() > 0);
+    }
+
+    VirusGenealogy<Virus> replayed("stem");
+    replay_wal(replayed, dir + "/ingested");
+    assert(replayed.size() == 1 + 4 * 500 - 250);
+    assert(replayed.get_parents("t1.499") ==
+           (std::vector<std::string>{"t0.0", "t1.498"}));
+    assert(!replayed.exists("t2.499"));
+}
+
+// Calls over the socket behave like calls on the genealogy, pipelined ones
+// come back in order, and a hub too big for one reply is read by pages.
+void check_rpc(std::string const &dir) {
+    VirusGenealogy<Virus> served("stem");
+    genealogy_rpc_server<Virus> server(served, dir + "/socket");
+    std::thread serving([&] {
+        server.run();
+    });
+
+    {
+        genealogy_rpc_client<std::string> client(dir + "/socket");
+        assert(client.get_stem_id() == "stem");
+        client.create("A", "stem");
+        client.create("B", std::vector<std::string>{"stem", "A"});
+        client.create("C", "A");
+        assert(client.get_parents("B") ==
+               (std::vector<std::string>{"A", "stem"}));
+        try {
+            client.create("A", "stem");
+            assert(false);
+        }
+        catch (VirusAlreadyCreated &) {
+        }
+        try {
+            client.remove("stem");
+            assert(false);
+        }
+        catch (TriedToRemoveStemVirus &) {
+        }
+
+        genealogy_rpc_client<std::string>::pipeline batch(client);
+        batch.exists("C").remove("A").exists("C").connect("B", "nobody");
+        auto replies = batch.run();
+        assert(replies.size() == 4);
+        assert(replies[0].exists);
+        assert(replies[1].status == genealogy_rpc_status::ok);
+        assert(!replies[2].exists);
+        assert(replies[3].status == genealogy_rpc_status::virus_not_found);
+
+        std::string long_name(250, 'x');
+        for (int i = 0; i < 70000; ++i)
+            batch.create(long_name + std::to_string(i), {"stem"});
+        batch.run();
+        try {
+            client.get_children("stem");
+            assert(false);
+        }
+        catch (std::length_error &) {
+        }
+        std::optional<std::string> cursor;
+        std::size_t children = 0;
+        for (;;) {
+            auto page = client.children_page("stem", cursor, 20000);
+            if (page.empty())
+                break;
+            children += page.size();
+            cursor = page.back();
+        }
+        assert(children == 70001);
+    }
+
+    server.stop();
+    serving.join();
+    assert(served.size() == 70002);
+    assert(served.get_parents("B") == std::vector<std::string>{"stem"});
+}
+
+int main() {
+    char dir_template[] = "/tmp/virus_genealogy_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+
+    check_ingest(dir);
+    check_rpc(dir);
+
+    std::filesystem::remove_all(dir);
+}
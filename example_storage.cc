@@ -0,0 +1,208 @@
+// checks of the arena and of the genealogies kept in files or sharing
+// storage, run like example.cc
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_arena.h"
+#include "virus_genealogy_paged.h"
+#include "virus_genealogy_pool.h"
+#include "virus_genealogy_tiered.h"
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//Clock of the tiered genealogy, moved by hand.
+struct manual_clock {
+    using duration = std::chrono::seconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<manual_clock>;
+    static constexpr bool is_steady = false;
+
+    static inline time_point current{};
+
+    static time_point now() {
+        return current;
+    }
+};
+
+class Virus {
+public:
+    using id_type = std::string;
+    Virus(id_type const &_id) : id(_id) {
+    }
+    id_type get_id() const {
+        return id;
+    }
+private:
+    id_type id;
+};
+
+using arena_genealogy = VirusGenealogy<Virus, arena_allocator<std::string>>;
+
+// Freed blocks are reused, big ones are given back to the system.
+void check_arena_reuse() {
+    genealogy_arena arena(page_backing::normal);
+    arena_genealogy gen("stem", arena_allocator<std::string>(arena));
+
+    auto round = [&] {
+        for (int i = 0; i < 20000; ++i)
+            gen.create("v" + std::to_string(i),
+                       i < 100 ? "stem" : "v" + std::to_string(i % 100));
+        for (int i = 0; i < 100; ++i)
+            gen.remove("v" + std::to_string(i));
+        assert(gen.size() == 1);
+    };
+    round();
+    round();
+    auto mapped = arena.mapped_bytes();
+    for (int i = 0; i < 5; ++i)
+        round();
+    assert(arena.mapped_bytes() == mapped);
+
+    auto big = arena.allocate(3 << 20, 64);
+    assert(arena.mapped_bytes() > mapped);
+    arena.deallocate(big, 3 << 20, 64);
+    assert(arena.mapped_bytes() == mapped);
+}
+
+// A genealogy many times the buffer pool is kept in the file, splitting the
+// B+tree and chaining a hub's children over many pages, and is found again
+// on reopening.
+void check_paged(std::string const &dir) {
+    auto path = dir + "/paged";
+    {
+        PagedVirusGenealogy<Virus> gen(path, "stem", 8);
+        for (int i = 0; i < 5000; ++i)
+            gen.create("hub" + std::to_string(i), "stem");
+        for (int i = 0; i < 5000; i += 50)
+            gen.create("tip" + std::to_string(i),
+                       std::vector<std::string>{"hub" + std::to_string(i),
+                                                "hub" + std::to_string(i + 1)});
+        gen.connect("tip0", "hub4999");
+        gen.connect("tip0", "hub4999");
+        assert(gen.get_parents("tip0") ==
+               (std::vector<std::string>{"hub0", "hub1", "hub4999"}));
+        assert(gen.get_children("stem").size() == 5000);
+
+        gen.remove("hub50");
+        assert(gen.exists("tip50"));
+        gen.remove("hub51");
+        assert(!gen.exists("tip50"));
+        assert(gen.get_children("stem").size() == 4998);
+        assert(gen.page_reads() > 0);
+    }
+
+    PagedVirusGenealogy<Virus> reopened(path, "stem", 8);
+    assert(reopened.exists("hub4999"));
+    assert(!reopened.exists("hub50"));
+    assert(reopened.get_children("hub4999") ==
+           std::vector<std::string>{"tip0"});
+    std::size_t children = 0;
+    for (auto it = reopened.get_children_begin("stem");
+         it != reopened.get_children_end("stem"); ++it)
+        ++children;
+    assert(children == 4998);
+    assert(reopened["tip100"].get_id() == "tip100");
+
+    try {
+        PagedVirusGenealogy<Virus> other(path, "other");
+        assert(false);
+    }
+    catch (std::runtime_error &) {
+    }
+}
+
+// Lineages left alone go to the cold file and come back whole, stamps
+// included, on the first access to any of their viruses.
+void check_tiered(std::string const &dir) {
+    TieredVirusGenealogy<Virus, manual_clock> gen(dir + "/cold", "stem");
+    gen.create("old", "stem");
+    gen.create("old.1", "old");
+    gen.create("old.1.1", "old.1");
+    gen.create("old.2", "old");
+    auto stamp = gen.created_at("old.1.1");
+
+    manual_clock::current += std::chrono::hours(48);
+    gen.create("new", "stem");
+    gen.create("shared", std::vector<std::string>{"new", "old.2"});
+    gen.create("lone", "stem");
+
+    manual_clock::current += std::chrono::hours(1);
+    //old.2 has a child with two parents, so only old.1 and its child go.
+    assert(gen.evict_unchanged_for(std::chrono::hours(24)) == 2);
+    assert(gen.cold_size() == 2);
+    assert(gen.hot_size() == 6);
+
+    assert(gen.get_children("old") ==
+           (std::vector<std::string>{"old.1", "old.2"}));
+    assert(gen.cold_size() == 0);
+    assert(gen.created_at("old.1.1") == stamp);
+
+    manual_clock::current += std::chrono::hours(48);
+    //A root may have many parents, so now shared goes too.
+    assert(gen.evict_unchanged_for(std::chrono::hours(24)) == 4);
+    gen.remove("old.1");
+    assert(!gen.exists("old.1.1"));
+    assert(gen.get_children("old") == std::vector<std::string>{"old.2"});
+    assert(gen.exists("lone"));
+    assert(gen.get_parents("shared") ==
+           (std::vector<std::string>{"new", "old.2"}));
+    assert(gen.cold_size() == 0);
+}
+
+// Handles of destroyed genealogies are reused, their memory goes to the
+// others, and clear() drops everything.
+void check_pool() {
+    VirusGenealogyPool<Virus> pool;
+    std::vector<VirusGenealogyPool<Virus>::handle> patients;
+    for (int i = 0; i < 1000; ++i) {
+        auto h = pool.create("index case");
+        pool[h].create("variant", "index case");
+        patients.push_back(h);
+    }
+    assert(pool.size() == 1000);
+    auto mapped = pool.mapped_bytes();
+
+    for (int i = 0; i < 1000; i += 2)
+        pool.destroy(patients[i]);
+    assert(!pool.contains(patients[0]));
+    assert(pool.contains(patients[1]));
+    try {
+        pool[patients[0]];
+        assert(false);
+    }
+    catch (std::out_of_range &) {
+    }
+
+    for (int i = 0; i < 500; ++i) {
+        auto h = pool.create("root", genealogy_mode::tree);
+        assert(h < 1000);
+        pool[h].create("leaf", "root");
+        assert(pool[h].subtree_size("root") == 2);
+    }
+    assert(pool.size() == 1000);
+    assert(pool.mapped_bytes() == mapped);
+    assert(pool[patients[1]].get_children("index case") ==
+           std::vector<std::string>{"variant"});
+
+    pool.clear();
+    assert(pool.size() == 0);
+    assert(pool.mapped_bytes() == 0);
+    assert(pool[pool.create("again")].exists("again"));
+}
+
+int main() {
+    char dir_template[] = "/tmp/virus_genealogy_XXXXXX";
+    std::string dir = mkdtemp(dir_template);
+
+    check_arena_reuse();
+    check_paged(dir);
+    check_tiered(dir);
+    check_pool();
+
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,96 @@
+// checks of the tree mode and of the node layout, run like example.cc
+
+#include "virus_genealogy.h"
+#include <cassert>
+#include <string>
+#include <vector>
+
+class Virus {
+public:
+    using id_type = std::string;
+    Virus(id_type const &_id) : id(_id) {
+    }
+    id_type get_id() const {
+        return id;
+    }
+private:
+    id_type id;
+};
+
+// The Euler tour answers subtree queries and follows removals, while a
+// second parent is refused.
+void check_euler_tour() {
+    VirusGenealogy<Virus> gen("stem", genealogy_mode::tree);
+    gen.create("A", "stem");
+    gen.create("B", "stem");
+    gen.create("A1", "A");
+    gen.create("A2", "A");
+    gen.create("A11", "A1");
+    gen.create("B1", "B");
+
+    assert(gen.subtree_size("stem") == 7);
+    assert(gen.subtree_size("A") == 4);
+    assert(gen.subtree_size("A11") == 1);
+    assert(gen.in_subtree("A11", "A"));
+    assert(gen.in_subtree("A", "A"));
+    assert(!gen.in_subtree("B1", "A"));
+    assert(!gen.in_subtree("A", "A1"));
+
+    try {
+        gen.connect("B1", "A");
+        assert(false);
+    }
+    catch (TriedToAddSecondParent &) {
+    }
+    try {
+        gen.create("C", std::vector<std::string>{"A", "B"});
+        assert(false);
+    }
+    catch (TriedToAddSecondParent &) {
+    }
+    assert(!gen.exists("C"));
+    assert(gen.subtree_size("B") == 2);
+
+    gen.remove("A1");
+    assert(!gen.exists("A11"));
+    assert(gen.subtree_size("A") == 2);
+    assert(gen.subtree_size("stem") == 5);
+    gen.create("A11", "B1");
+    assert(gen.in_subtree("A11", "B"));
+    assert(!gen.in_subtree("A11", "A"));
+}
+
+// Laying nodes out anew, in either order, changes neither the viruses nor
+// their edges, and the genealogy keeps working afterwards.
+void check_reorder() {
+    for (auto mode : {genealogy_mode::dag, genealogy_mode::tree}) {
+        VirusGenealogy<Virus> gen("stem", mode);
+        for (int i = 0; i < 300; ++i)
+            gen.create("v" + std::to_string(i),
+                       i < 3 ? "stem" : "v" + std::to_string(i / 3 - 1));
+        if (mode == genealogy_mode::dag)
+            gen.connect("v200", "v1");
+        auto parents = gen.get_parents("v200");
+        auto children = gen.get_children("v1");
+        auto size = gen.subtree_size("v1");
+
+        for (auto order : {traversal_order::bfs, traversal_order::dfs}) {
+            gen.reorder(order);
+            assert(gen.size() == 301);
+            assert(gen.get_parents("v200") == parents);
+            assert(gen.get_children("v1") == children);
+            assert(gen.subtree_size("v1") == size);
+        }
+
+        gen.remove("v2");
+        assert(!gen.exists("v9"));
+        gen.create("new", "v1");
+        assert(gen.in_subtree("new", "stem"));
+        assert(gen.subtree_size("v1") == size + 1);
+    }
+}
+
+int main() {
+    check_euler_tour();
+    check_reorder();
+}
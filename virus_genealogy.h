@@ -4,7 +4,28 @@
 #include <map>
 #include <vector>
 #include <set>
-#include <list>
+#include <deque>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <optional>
+#include <iterator>
+#include <tuple>
+#include <type_traits>
+#include <unordered_set>
+#include <unordered_map>
+#include <concepts>
+#include <mutex>
+#include <random>
+
+#include "virus_genealogy_sketch.h"
 
 class VirusNotFound : public std::exception {
 public:
@@ -27,265 +48,2739 @@ public:
     }
 };
 
-template<typename Virus>
+class TriedToAddSecondParent : public std::exception {
+public:
+    inline const char *what() const noexcept override {
+        return "TriedToAddSecondParent";
+    }
+};
+
+//In tree mode every virus except the stem has exactly one parent, which lets
+//the genealogy answer subtree queries in O(log n).
+enum class genealogy_mode {
+    dag,
+    tree
+};
+
+//Plain description of a genealogy - ids in increasing order and parents of
+//each virus as indexes into them - which genealogies are saved as and built
+//from. Parents of ids[i] are parent_indexes[parent_offsets[i]] up to
+//parent_indexes[parent_offsets[i + 1]], and it was created at created[i].
+//Without created viruses count as created in order of ids.
+template<typename Id>
+struct genealogy_topology {
+    genealogy_mode mode = genealogy_mode::dag;
+    std::size_t stem = 0;
+    std::vector<Id> ids;
+    std::vector<std::size_t> parent_offsets{0};
+    std::vector<std::size_t> parent_indexes;
+    std::vector<std::uint64_t> created;
+};
+
+//Runs task(i) for every i < tasks on up to threads threads and rethrows the
+//first exception after all of them have finished.
+template<typename Task>
+inline void genealogy_parallel_for(std::size_t tasks, unsigned threads,
+                                   Task const &task) {
+    threads = static_cast<unsigned>(
+            std::min<std::size_t>(std::max(threads, 1u), tasks));
+    if (threads <= 1) {
+        for (std::size_t i = 0; i < tasks; ++i)
+            task(i);
+        return;
+    }
+
+    std::atomic<std::size_t> next{0};
+    std::vector<std::exception_ptr> errors(threads);
+    auto work = [&](unsigned worker) {
+        try {
+            for (auto i = next++; i < tasks; i = next++)
+                task(i);
+        }
+        catch (...) {
+            errors[worker] = std::current_exception();
+            next = tasks;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    try {
+        for (unsigned worker = 1; worker < threads; ++worker)
+            workers.emplace_back(work, worker);
+    }
+    catch (...) {
+        next = tasks;
+        for (auto &worker : workers)
+            worker.join();
+        throw;
+    }
+    work(0);
+    for (auto &worker : workers)
+        worker.join();
+
+    for (auto &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+//Ids for which parents of hub viruses are kept hashed.
+template<typename Id>
+concept genealogy_hashable = requires(Id const &id) {
+    { std::hash<Id>{}(id) } -> std::convertible_to<std::size_t>;
+    { id == id } -> std::convertible_to<bool>;
+};
+
+//Execution policies of for_each_virus and transform_reduce. They stand in
+//for those of std::execution, which libstdc++ only provides on top of TBB.
+//threads = 0 means one per hardware thread.
+struct genealogy_sequenced_policy {
+};
+
+struct genealogy_parallel_policy {
+    unsigned threads = 0;
+};
+
+inline constexpr genealogy_sequenced_policy genealogy_seq{};
+inline constexpr genealogy_parallel_policy genealogy_par{};
+
+//Which way dynamic_program() runs - a virus after all of its parents, or
+//after all of its children.
+enum class genealogy_direction {
+    top_down,
+    bottom_up
+};
+
+//Order in which reorder() lays nodes out, starting from the stem.
+enum class traversal_order {
+    bfs,
+    dfs
+};
+
+//Allocator is used for the graph and adjacency sets, e.g. arena_allocator
+//from virus_genealogy_arena.h to put them on huge pages of a NUMA node.
+template<typename Virus,
+        typename Allocator = std::allocator<typename Virus::id_type>>
 class VirusGenealogy {
 private:
     struct set_compare {
         inline bool operator()(const Virus &a, const Virus &b) const {
             return a.get_id() > b.get_id();
         }
-    };
+    };
+
+    template<typename T>
+    using allocator_t =
+            typename std::allocator_traits<Allocator>::template rebind_alloc<T>;
+
+    using children_t = std::set<typename Virus::id_type,
+                                std::less<typename Virus::id_type>,
+                                allocator_t<typename Virus::id_type>>;
+
+    //Parents of a virus. Up to small_limit of them are kept in a small sorted
+    //array, which is scanned faster than a tree is searched; more move to a
+    //hashed set, so that membership stays O(1) however many there are. Ids
+    //without std::hash fall back to an ordered set there.
+    class parent_set {
+    private:
+        using id_t = typename Virus::id_type;
+        using small_t = std::vector<id_t, allocator_t<id_t>>;
+        using hashed_t = std::conditional_t<
+                genealogy_hashable<id_t>,
+                std::unordered_set<id_t, std::hash<id_t>, std::equal_to<id_t>,
+                                   allocator_t<id_t>>,
+                std::set<id_t, std::less<id_t>, allocator_t<id_t>>>;
+
+        static constexpr std::size_t small_limit = 8;
+
+        //At most one of them is not empty.
+        small_t small;
+        hashed_t hashed;
+
+        inline typename small_t::const_iterator
+        find_small(id_t const &id) const {
+            return std::lower_bound(small.begin(), small.end(), id);
+        }
+
+    public:
+        class const_iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+            using value_type = id_t;
+            using pointer = const id_t *;
+            using reference = const id_t &;
+
+            inline const_iterator() = default;
+
+            inline const id_t &operator*() const {
+                return in_small ? *small_it : *hashed_it;
+            }
+
+            inline const id_t *operator->() const {
+                return &**this;
+            }
+
+            inline const_iterator &operator++() {
+                if (in_small)
+                    ++small_it;
+                else
+                    ++hashed_it;
+                return *this;
+            }
+
+            inline const_iterator operator++(int) {
+                auto copy = *this;
+                ++*this;
+                return copy;
+            }
+
+            inline bool operator==(const const_iterator &other) const {
+                return in_small ? small_it == other.small_it
+                                : hashed_it == other.hashed_it;
+            }
+
+        private:
+            friend class parent_set;
+
+            bool in_small = true;
+            typename small_t::const_iterator small_it;
+            typename hashed_t::const_iterator hashed_it;
+        };
+
+        inline explicit parent_set(Allocator const &allocator)
+                : small(allocator_t<id_t>(allocator)),
+                  hashed(allocator_t<id_t>(allocator)) {}
+
+        inline std::size_t size() const noexcept {
+            return small.size() + hashed.size();
+        }
+
+        inline bool empty() const noexcept {
+            return size() == 0;
+        }
+
+        inline bool contains(id_t const &id) const {
+            if (!hashed.empty())
+                return hashed.find(id) != hashed.end();
+
+            auto it = find_small(id);
+            return it != small.end() && !(id < *it);
+        }
+
+        //Strong guarantee.
+        inline void insert(id_t const &id) {
+            if (!hashed.empty()) {
+                hashed.insert(id);
+                return;
+            }
+
+            auto it = find_small(id);
+            if (it != small.end() && !(id < *it))
+                return;
+
+            if (small.size() < small_limit) {
+                small.insert(it, id);
+                return;
+            }
+
+            hashed_t grown(hashed.get_allocator());
+            grown.insert(small.begin(), small.end());
+            grown.insert(id);
+            std::swap(hashed, grown);
+            small.clear();
+        }
+
+        //Nothrow as long as hashing and comparing ids is.
+        inline void erase(id_t const &id) noexcept {
+            if (!hashed.empty()) {
+                hashed.erase(id);
+                return;
+            }
+
+            auto it = find_small(id);
+            if (it != small.end() && !(id < *it))
+                small.erase(it);
+        }
+
+        inline const_iterator begin() const {
+            const_iterator result;
+            result.in_small = hashed.empty();
+            result.small_it = small.begin();
+            result.hashed_it = hashed.begin();
+            return result;
+        }
+
+        inline const_iterator end() const {
+            const_iterator result;
+            result.in_small = hashed.empty();
+            result.small_it = small.end();
+            result.hashed_it = hashed.end();
+            return result;
+        }
+
+        //Parents in increasing order.
+        inline std::vector<id_t> sorted() const {
+            std::vector<id_t> result(begin(), end());
+            if (!hashed.empty())
+                std::sort(result.begin(), result.end());
+            return result;
+        }
+    };
+
+    using parents_t = parent_set;
+    //Weights of edges from parents which have been given one, by parent.
+    using weights_t =
+            std::vector<std::pair<typename Virus::id_type, double>,
+                        allocator_t<std::pair<typename Virus::id_type,
+                                              double>>>;
+    using virus_set_t = std::set<Virus, set_compare>;
+
+    using tokens_t = std::pair<std::size_t, std::size_t>;
+
+    class Node {
+    public:
+        children_t children;
+        parents_t parents;
+        weights_t weights;
+        typename Virus::id_type virus;
+        //Enter and exit tokens in the Euler tour, both 0 in dag mode.
+        tokens_t tokens;
+        //Position in the node table.
+        std::size_t index = 0;
+        //When the virus was created, see next_stamp(), and the place of
+        //its creation among those with the same stamp.
+        std::uint64_t created = 0;
+        std::uint64_t sequence = 0;
+        //Neighbours among viruses with as many children, see degree_index.
+        Node *degree_prev = nullptr;
+        Node *degree_next = nullptr;
+
+        Node(children_t children, parents_t parents,
+             typename Virus::id_type virus, tokens_t tokens = {0, 0})
+                : children(children), parents(parents),
+                  weights(children.get_allocator()), virus(virus),
+                  tokens(tokens) {}
+    };
+
+    //Euler tour of the tree kept in an implicit treap - every virus owns an
+    //enter and an exit token and its subtree is exactly the range between
+    //them. Tokens refer to each other by index in one vector, so everything
+    //except acquire() is nothrow.
+    class euler_tour {
+    private:
+        struct token {
+            std::size_t left;
+            std::size_t right;
+            std::size_t parent;
+            std::size_t size;
+            std::uint32_t priority;
+        };
+
+        //Index 0 is a sentinel standing for an empty treap, it is added
+        //with the first tokens so that dag mode allocates nothing.
+        std::vector<token, allocator_t<token>> tokens;
+        //Released tokens are chained through their right field.
+        std::size_t free_list = 0;
+        std::size_t root = 0;
+        std::uint32_t seed = 2463534242u;
+
+        inline std::uint32_t next_priority() noexcept {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return seed;
+        }
+
+        inline void update(std::size_t t) noexcept {
+            auto &current = tokens[t];
+            current.size = 1 + tokens[current.left].size +
+                           tokens[current.right].size;
+            if (current.left)
+                tokens[current.left].parent = t;
+            if (current.right)
+                tokens[current.right].parent = t;
+        }
+
+        inline std::size_t merge(std::size_t a, std::size_t b) noexcept {
+            if (!a || !b)
+                return a ? a : b;
+
+            if (tokens[a].priority > tokens[b].priority) {
+                tokens[a].right = merge(tokens[a].right, b);
+                update(a);
+                return a;
+            }
+            tokens[b].left = merge(a, tokens[b].left);
+            update(b);
+            return b;
+        }
+
+        //Splits treap t into its first k tokens and the rest.
+        inline tokens_t split(std::size_t t, std::size_t k) noexcept {
+            if (!t)
+                return {0, 0};
+
+            auto left_size = tokens[tokens[t].left].size;
+            if (left_size >= k) {
+                auto [first, rest] = split(tokens[t].left, k);
+                tokens[t].left = rest;
+                update(t);
+                if (first)
+                    tokens[first].parent = 0;
+                return {first, t};
+            }
+            auto [first, rest] = split(tokens[t].right, k - left_size - 1);
+            tokens[t].right = first;
+            update(t);
+            if (rest)
+                tokens[rest].parent = 0;
+            return {t, rest};
+        }
+
+        inline std::size_t take_token() noexcept {
+            std::size_t t = free_list;
+            if (t)
+                free_list = tokens[t].right;
+            else {
+                t = tokens.size();
+                tokens.push_back(token());
+            }
+            tokens[t] = token{0, 0, 0, 1, next_priority()};
+            return t;
+        }
+
+        inline void free_token(std::size_t t) noexcept {
+            tokens[t].right = free_list;
+            free_list = t;
+        }
+
+        inline void free_treap(std::size_t t) noexcept {
+            if (!t)
+                return;
+            free_treap(tokens[t].left);
+            free_treap(tokens[t].right);
+            free_token(t);
+        }
+
+        inline std::size_t position(std::size_t t) const noexcept {
+            std::size_t result = tokens[tokens[t].left].size;
+            while (tokens[t].parent) {
+                auto p = tokens[t].parent;
+                if (tokens[p].right == t)
+                    result += tokens[tokens[p].left].size + 1;
+                t = p;
+            }
+            return result;
+        }
+
+        inline void set_root(std::size_t t) noexcept {
+            root = t;
+            tokens[root].parent = 0;
+        }
+
+    public:
+        inline explicit euler_tour(Allocator const &allocator)
+                : tokens(allocator_t<token>(allocator)) {}
+
+        //Strong guarantee - the only allocation happens before anything
+        //is modified.
+        inline tokens_t acquire() {
+            tokens.reserve(tokens.size() + (tokens.empty() ? 3 : 2));
+            if (tokens.empty())
+                tokens.push_back(token{0, 0, 0, 0, 0});
+            auto enter = take_token();
+            return {enter, take_token()};
+        }
+
+        //Gives back tokens which have not been linked.
+        inline void release(tokens_t const &pair) noexcept {
+            free_token(pair.second);
+            free_token(pair.first);
+        }
+
+        inline void link_root(tokens_t const &pair) noexcept {
+            set_root(merge(pair.first, pair.second));
+        }
+
+        //Places the pair right after the enter token of the parent, which
+        //makes it a child of that parent.
+        inline void link_after(std::size_t parent_enter,
+                               tokens_t const &pair) noexcept {
+            auto [first, rest] = split(root, position(parent_enter) + 1);
+            set_root(merge(merge(first, merge(pair.first, pair.second)), rest));
+        }
+
+        //Cuts out the whole subtree in O(log n) and releases its tokens in O(k),
+        //k being the number of tokens released.
+        inline void erase(tokens_t const &pair) noexcept {
+            auto from = position(pair.first);
+            auto to = position(pair.second);
+            auto [first, rest] = split(root, from);
+            auto [middle, last] = split(rest, to - from + 1);
+            set_root(merge(first, last));
+            free_treap(middle);
+        }
+
+        inline bool contains(tokens_t const &subtree,
+                             tokens_t const &pair) const noexcept {
+            auto at = position(pair.first);
+            return position(subtree.first) <= at &&
+                   at <= position(subtree.second);
+        }
+
+        inline std::size_t size(tokens_t const &subtree) const noexcept {
+            return (position(subtree.second) - position(subtree.first)) / 2 +
+                   1;
+        }
+    };
+
+    using graph_t = std::map<typename Virus::id_type, Node,
+                             std::less<typename Virus::id_type>,
+                             allocator_t<std::pair<const typename Virus::id_type,
+                                                   Node>>>;
+    //Every node once, densely, so that all of them can be split among
+    //threads. Removal moves the last node into the gap.
+    using table_t = std::vector<Node *, allocator_t<Node *>>;
+
+    //Viruses in order of creation: by stamp, then by sequence, which
+    //numbers creations as they happen, so that each entry has its own
+    //place. Entries of removed viruses are left without a node until they
+    //outnumber the others, then squeezed out in place.
+    struct creation_entry {
+        std::uint64_t stamp;
+        std::uint64_t sequence;
+        Node *node;
+
+        static inline bool before(creation_entry const &a,
+                                  creation_entry const &b) noexcept {
+            return a.stamp < b.stamp ||
+                   (a.stamp == b.stamp && a.sequence < b.sequence);
+        }
+    };
+
+    using creations_t =
+            std::vector<creation_entry, allocator_t<creation_entry>>;
+
+    //Viruses by number of children, the way LFU caches keep entries by
+    //frequency: the viruses with each count are linked through their nodes,
+    //and the counts which have any are linked in order. Changing a count by
+    //one is O(1) and nothrow once reserve() made room for the new one, and
+    //the viruses with most children are read off the top in O(k).
+    class degree_index {
+    public:
+        static constexpr std::size_t none = static_cast<std::size_t>(-1);
+
+        struct bucket {
+            Node *first = nullptr;
+            std::size_t size = 0;
+            //Nearest counts above and below which have any viruses.
+            std::size_t higher = none;
+            std::size_t lower = none;
+        };
+
+        inline explicit degree_index(Allocator const &allocator)
+                : buckets(allocator_t<bucket>(allocator)) {}
+
+        //Makes room for viruses with count children.
+        inline void reserve(std::size_t count) {
+            if (buckets.size() <= count)
+                buckets.resize(std::max(count + 1, 2 * buckets.size()));
+        }
+
+        //Links a new virus, without children.
+        inline void insert(Node &node) noexcept {
+            if (buckets[0].size == 0)
+                link_bucket(0, none, lowest);
+            link_node(node, 0);
+        }
+
+        inline void erase(Node &node) noexcept {
+            auto count = node.children.size();
+            unlink_node(node, count);
+            if (buckets[count].size == 0)
+                unlink_bucket(count);
+        }
+
+        //Moves a virus which had from children up by one.
+        inline void increment(Node &node, std::size_t from) noexcept {
+            auto stays = buckets[from].size > 1;
+            unlink_node(node, from);
+            if (!stays)
+                unlink_bucket(from);
+            if (buckets[from + 1].size == 0)
+                link_bucket(from + 1, stays ? from : buckets[from].lower,
+                            buckets[from].higher);
+            link_node(node, from + 1);
+        }
+
+        //Moves a virus which had from children down by one.
+        inline void decrement(Node &node, std::size_t from) noexcept {
+            auto stays = buckets[from].size > 1;
+            unlink_node(node, from);
+            if (!stays)
+                unlink_bucket(from);
+            if (buckets[from - 1].size == 0)
+                link_bucket(from - 1, buckets[from].lower,
+                            stays ? from : buckets[from].higher);
+            link_node(node, from - 1);
+        }
+
+        //Links all viruses of table from scratch.
+        inline void rebuild(table_t const &table) {
+            std::size_t most = 0;
+            for (auto node : table)
+                most = std::max(most, node->children.size());
+            std::vector<bucket, allocator_t<bucket>> rebuilt(
+                    most + 1, bucket(), buckets.get_allocator());
+
+            buckets.swap(rebuilt);
+            highest = lowest = none;
+            for (auto node : table)
+                link_node(*node, node->children.size());
+            for (std::size_t count = 0; count <= most; ++count)
+                if (buckets[count].size != 0)
+                    link_bucket(count, highest, none);
+        }
+
+        inline std::size_t top() const noexcept {
+            return highest;
+        }
+
+        inline bucket const &operator[](std::size_t count) const noexcept {
+            return buckets[count];
+        }
+
+    private:
+        std::vector<bucket, allocator_t<bucket>> buckets;
+        std::size_t highest = none;
+        std::size_t lowest = none;
+
+        inline void link_node(Node &node, std::size_t count) noexcept {
+            auto &to = buckets[count];
+            node.degree_prev = nullptr;
+            node.degree_next = to.first;
+            if (to.first)
+                to.first->degree_prev = &node;
+            to.first = &node;
+            ++to.size;
+        }
+
+        inline void unlink_node(Node &node, std::size_t count) noexcept {
+            auto &from = buckets[count];
+            if (node.degree_prev)
+                node.degree_prev->degree_next = node.degree_next;
+            else
+                from.first = node.degree_next;
+            if (node.degree_next)
+                node.degree_next->degree_prev = node.degree_prev;
+            --from.size;
+        }
+
+        inline void link_bucket(std::size_t count, std::size_t lower,
+                                std::size_t higher) noexcept {
+            buckets[count].lower = lower;
+            buckets[count].higher = higher;
+            (lower == none ? lowest : buckets[lower].higher) = count;
+            (higher == none ? highest : buckets[higher].lower) = count;
+        }
+
+        //Leaves the links of count as they were, its neighbours' now.
+        inline void unlink_bucket(std::size_t count) noexcept {
+            auto lower = buckets[count].lower;
+            auto higher = buckets[count].higher;
+            (lower == none ? lowest : buckets[lower].higher) = higher;
+            (higher == none ? highest : buckets[higher].lower) = lower;
+        }
+    };
+
+    //Values of one registered aggregate by node table index, type-erased.
+    //Changes are computed into a stage first, which may throw, and then
+    //committed without throwing.
+    class aggregate_base {
+    public:
+        virtual ~aggregate_base() = default;
+
+        virtual bool idempotent() const noexcept = 0;
+
+        virtual bool invertible() const noexcept = 0;
+
+        //Values of a new virus, which goes at the end of the table.
+        virtual void stage_new(typename Virus::id_type const &id) = 0;
+
+        //Combines totals of affected with the value of the new virus, or
+        //with the total of from.
+        virtual void stage_combine(std::vector<std::size_t> const &affected,
+                                   std::optional<std::size_t> from) = 0;
+
+        //Takes the total of from, all of whose descendants affected lose,
+        //out of their totals.
+        virtual void stage_subtract(std::vector<std::size_t> const &affected,
+                                    std::size_t from) = 0;
+
+        //Sets the total of index to the values of descendants folded.
+        virtual void stage_fold(std::size_t index,
+                                std::vector<std::size_t> const &descendants) = 0;
+
+        //Sets the total of index to its own value combined with the totals
+        //of children. Indexes are gathered in the order staged_at gives
+        //them, and a child gathered before contributes its staged total.
+        virtual void stage_gather(std::size_t index,
+                                  std::vector<std::size_t> const &children,
+                                  std::vector<std::size_t> const &staged_at) = 0;
+
+        virtual void commit() noexcept = 0;
+
+        virtual void discard() noexcept = 0;
+
+        //Moves the last values into index, as the table does.
+        virtual void erase(std::size_t index) noexcept = 0;
+
+        //Values in the order of old_indexes.
+        virtual std::unique_ptr<aggregate_base>
+        permuted(std::vector<std::size_t> const &old_indexes) const = 0;
+    };
+
+    //Values of T require a nothrow move.
+    template<typename T>
+    class aggregate_storage : public aggregate_base {
+    public:
+        T identity;
+        std::function<T(T const &, T const &)> combine;
+        std::function<T(typename Virus::id_type const &)> value;
+        bool is_idempotent;
+        //Empty unless the monoid is a group.
+        std::function<T(T const &)> inverse;
+        //Own value of each virus and the value folded over its descendants,
+        //itself included.
+        std::vector<T> own;
+        std::vector<T> total;
+
+        std::optional<T> staged_own;
+        std::optional<T> staged_total;
+        std::vector<std::pair<std::size_t, T>> staged;
+
+        inline aggregate_storage(
+                T identity, std::function<T(T const &, T const &)> combine,
+                std::function<T(typename Virus::id_type const &)> value,
+                bool idempotent, std::function<T(T const &)> inverse)
+                : identity(std::move(identity)), combine(std::move(combine)),
+                  value(std::move(value)), is_idempotent(idempotent),
+                  inverse(std::move(inverse)) {}
+
+        inline bool idempotent() const noexcept override {
+            return is_idempotent;
+        }
+
+        inline bool invertible() const noexcept override {
+            return static_cast<bool>(inverse);
+        }
+
+        inline void stage_new(typename Virus::id_type const &id) override {
+            if (own.size() == own.capacity()) {
+                own.reserve(2 * own.size() + 1);
+                total.reserve(own.capacity());
+            }
+            staged_own = value(id);
+            staged_total = *staged_own;
+        }
+
+        inline void stage_combine(std::vector<std::size_t> const &affected,
+                                  std::optional<std::size_t> from) override {
+            auto const &with = from ? total[*from] : *staged_own;
+            for (auto index : affected)
+                staged.emplace_back(index, combine(total[index], with));
+        }
+
+        inline void stage_subtract(std::vector<std::size_t> const &affected,
+                                   std::size_t from) override {
+            auto lost = inverse(total[from]);
+            for (auto index : affected)
+                staged.emplace_back(index, combine(total[index], lost));
+        }
+
+        inline void stage_fold(
+                std::size_t index,
+                std::vector<std::size_t> const &descendants) override {
+            T result = identity;
+            for (auto descendant : descendants)
+                result = combine(result, own[descendant]);
+            staged.emplace_back(index, std::move(result));
+        }
+
+        inline void stage_gather(
+                std::size_t index, std::vector<std::size_t> const &children,
+                std::vector<std::size_t> const &staged_at) override {
+            constexpr auto none = static_cast<std::size_t>(-1);
+            //Gathers are staged in order, after anything staged before.
+            auto first = staged.size() - staged_at[index];
+            T result = own[index];
+            for (auto child : children)
+                result = combine(result,
+                                 staged_at[child] == none
+                                 ? total[child]
+                                 : staged[first + staged_at[child]].second);
+            staged.emplace_back(index, std::move(result));
+        }
+
+        inline void commit() noexcept override {
+            for (auto &[index, result] : staged)
+                total[index] = std::move(result);
+            if (staged_own) {
+                own.push_back(std::move(*staged_own));
+                total.push_back(std::move(*staged_total));
+            }
+            discard();
+        }
+
+        inline void discard() noexcept override {
+            staged.clear();
+            staged_own.reset();
+            staged_total.reset();
+        }
+
+        inline void erase(std::size_t index) noexcept override {
+            own[index] = std::move(own.back());
+            own.pop_back();
+            total[index] = std::move(total.back());
+            total.pop_back();
+        }
+
+        inline std::unique_ptr<aggregate_base>
+        permuted(std::vector<std::size_t> const &old_indexes) const override {
+            auto result = std::make_unique<aggregate_storage>(
+                    identity, combine, value, is_idempotent, inverse);
+            result->own.reserve(old_indexes.size());
+            result->total.reserve(old_indexes.size());
+            for (auto index : old_indexes) {
+                result->own.push_back(own[index]);
+                result->total.push_back(total[index]);
+            }
+            return result;
+        }
+    };
+
+    //MinHash signatures of the lineage - the virus and its ancestors - of
+    //every virus by table index, and viruses by the bands of theirs. Changes
+    //are staged like those of aggregates; bucket entries of staged
+    //signatures go in right away, those they replace are erased on commit.
+    class lineage_index {
+    public:
+        using id_t = typename Virus::id_type;
+        using entry_t = std::pair<std::uint64_t, id_t>;
+
+        //Orders bucket entries by band, then id, so that one entry is found
+        //in O(log n) however many viruses share its band, and a band is
+        //looked up by itself.
+        struct entry_order {
+            using is_transparent = void;
+
+            inline bool operator()(entry_t const &a, entry_t const &b) const {
+                return a < b;
+            }
+            inline bool operator()(entry_t const &a, std::uint64_t b) const {
+                return a.first < b;
+            }
+            inline bool operator()(std::uint64_t a, entry_t const &b) const {
+                return a < b.first;
+            }
+        };
+
+        //Most viruses of one bucket most_similar_lineages() considers.
+        static constexpr std::size_t bucket_scan_limit = 4096;
+
+        std::vector<genealogy_minhash> signatures;
+        std::set<entry_t, entry_order> buckets;
+
+        std::optional<genealogy_minhash> staged_new;
+        std::vector<std::pair<std::size_t, genealogy_minhash>> staged;
+        std::vector<std::pair<std::uint64_t, id_t>> added;
+        std::vector<std::pair<std::uint64_t, id_t>> replaced;
+
+        //Only hashable ids get signatures, see enable_lineage_signatures().
+        static inline genealogy_minhash own(id_t const &id) {
+            if constexpr (genealogy_hashable<id_t>)
+                return genealogy_minhash(std::hash<id_t>{}(id));
+            else
+                return genealogy_minhash();
+        }
+
+        //Signature of a new virus, which goes at the end of the table.
+        inline void stage_new(id_t const &id,
+                              genealogy_minhash const &signature) {
+            if (signatures.size() == signatures.capacity())
+                signatures.reserve(2 * signatures.size() + 1);
+            add(id, signature, nullptr);
+            staged_new = signature;
+        }
+
+        inline void stage(std::size_t index, id_t const &id,
+                          genealogy_minhash const &signature) {
+            add(id, signature, &signatures[index]);
+            staged.emplace_back(index, signature);
+        }
+
+        inline void commit() noexcept {
+            for (auto &[key, id] : replaced)
+                unbucket(key, id);
+            for (auto &[index, signature] : staged)
+                signatures[index] = signature;
+            if (staged_new)
+                signatures.push_back(*staged_new);
+            clear_stage();
+        }
+
+        inline void discard() noexcept {
+            for (auto &[key, id] : added)
+                unbucket(key, id);
+            clear_stage();
+        }
+
+        //Drops the virus at index, moving the last signature there.
+        inline void erase(std::size_t index, id_t const &id) noexcept {
+            for (std::size_t band = 0; band < genealogy_minhash::bands; ++band)
+                unbucket(signatures[index].band(band), id);
+            signatures[index] = signatures.back();
+            signatures.pop_back();
+        }
+
+    private:
+        //Puts in entries for the bands in which signature differs from old.
+        inline void add(id_t const &id, genealogy_minhash const &signature,
+                        genealogy_minhash const *old) {
+            for (std::size_t band = 0; band < genealogy_minhash::bands;
+                 ++band) {
+                auto key = signature.band(band);
+                if (old && old->band(band) == key)
+                    continue;
+
+                //Recorded first, so that no entry goes in unrecorded.
+                added.emplace_back(key, id);
+                try {
+                    buckets.emplace(key, id);
+                }
+                catch (...) {
+                    added.pop_back();
+                    throw;
+                }
+                if (old)
+                    replaced.emplace_back(old->band(band), id);
+            }
+        }
+
+        inline void unbucket(std::uint64_t key, id_t const &id) noexcept {
+            auto it = buckets.find(entry_t(key, id));
+            if (it != buckets.end())
+                buckets.erase(it);
+        }
+
+        inline void clear_stage() noexcept {
+            staged_new.reset();
+            staged.clear();
+            added.clear();
+            replaced.clear();
+        }
+    };
+
+    //Discards stages of aggregates and lineage signatures unless committed.
+    class aggregate_stage {
+    public:
+        inline aggregate_stage(
+                std::vector<std::unique_ptr<aggregate_base>> &aggregates,
+                std::optional<lineage_index> &lineages)
+                : aggregates(aggregates), lineages(lineages) {}
+
+        aggregate_stage(const aggregate_stage &) = delete;
+
+        aggregate_stage &operator=(const aggregate_stage &) = delete;
+
+        inline ~aggregate_stage() {
+            if (committed)
+                return;
+            for (auto &aggregate : aggregates)
+                aggregate->discard();
+            if (lineages)
+                lineages->discard();
+        }
+
+        inline void commit() noexcept {
+            for (auto &aggregate : aggregates)
+                aggregate->commit();
+            if (lineages)
+                lineages->commit();
+            committed = true;
+        }
+
+    private:
+        std::vector<std::unique_ptr<aggregate_base>> &aggregates;
+        std::optional<lineage_index> &lineages;
+        bool committed = false;
+    };
+
+    Allocator allocator;
+    mutable graph_t graph;
+    table_t table;
+    std::vector<std::unique_ptr<aggregate_base>> aggregates;
+    //Set by enable_lineage_signatures().
+    std::optional<lineage_index> lineages;
+    static constexpr std::size_t table_chunk = 1024;
+    mutable virus_set_t virus_set;
+    typename Virus::id_type stem_id;
+    genealogy_mode mode;
+    euler_tour tour;
+    std::size_t edges = 0;
+    degree_index degrees;
+    creations_t creations;
+    std::size_t removed_creations = 0;
+    std::uint64_t last_stamp = 0;
+    std::uint64_t creation_sequence = 0;
+    //Set by set_creation_clock().
+    std::function<std::uint64_t()> creation_clock;
+    //Set by enable_descendant_sketches().
+    std::optional<std::size_t> descendant_sketch_slot;
+
+    inline bool is_tree() const noexcept {
+        return mode == genealogy_mode::tree;
+    }
+
+    //Lays out the Euler tour of a freshly built tree.
+    inline void link_tree(std::vector<Node *> const &nodes,
+                          std::vector<std::size_t> const &child_offsets,
+                          std::vector<std::size_t> const &child_indexes,
+                          std::size_t stem) {
+        for (std::size_t i = 0; i < nodes.size(); ++i)
+            if (nodes[i]->parents.size() != (i == stem ? 0 : 1))
+                throw TriedToAddSecondParent();
+
+        nodes[stem]->tokens = tour.acquire();
+        tour.link_root(nodes[stem]->tokens);
+
+        std::size_t linked = 1;
+        std::vector<std::size_t> to_link{stem};
+        while (!to_link.empty()) {
+            auto parent = to_link.back();
+            to_link.pop_back();
+            for (auto j = child_offsets[parent]; j < child_offsets[parent + 1];
+                 ++j) {
+                auto child = child_indexes[j];
+                nodes[child]->tokens = tour.acquire();
+                tour.link_after(nodes[parent]->tokens.first,
+                                nodes[child]->tokens);
+                to_link.push_back(child);
+                ++linked;
+            }
+        }
+
+        //Anything not reached from the stem hangs on a cycle.
+        if (linked != nodes.size())
+            throw std::invalid_argument("Malformed topology");
+    }
+
+    inline tokens_t acquire_tokens() {
+        return is_tree() ? tour.acquire() : tokens_t{0, 0};
+    }
+
+    inline void release_tokens(tokens_t const &tokens) noexcept {
+        if (is_tree())
+            tour.release(tokens);
+    }
+
+    //Makes room for one more node in the table, so that adding it later
+    //cannot throw.
+    inline void reserve_table() {
+        if (table.size() == table.capacity())
+            table.reserve(2 * table.size() + 1);
+    }
+
+    inline void add_to_table(Node &node) noexcept {
+        node.index = table.size();
+        table.push_back(&node);
+    }
+
+    inline void remove_from_table(Node &node) noexcept {
+        auto last = table.back();
+        table[node.index] = last;
+        last->index = node.index;
+        table.pop_back();
+    }
+
+    //Stamp of the next virus created - the next number in sequence, or the
+    //time of the creation clock, but never earlier than the last one.
+    inline std::uint64_t next_stamp() const {
+        return creation_clock ? std::max(last_stamp, creation_clock())
+                              : last_stamp + 1;
+    }
+
+    //Makes room for one more creation, so that adding it cannot throw.
+    inline void reserve_creations() {
+        if (creations.size() == creations.capacity())
+            creations.reserve(2 * creations.size() + 1);
+    }
+
+    //A stamp older than the last one is slotted in among the earlier
+    //creations, moving the later entries. They are trivially copyable and
+    //reserve_creations() made room, so this cannot throw.
+    inline void add_creation(Node &node, std::uint64_t stamp) noexcept {
+        node.created = stamp;
+        node.sequence = creation_sequence++;
+        creation_entry entry{stamp, node.sequence, &node};
+        if (stamp >= last_stamp) {
+            creations.push_back(entry);
+            last_stamp = stamp;
+            return;
+        }
+
+        creations.insert(std::upper_bound(creations.begin(), creations.end(),
+                                          entry, creation_entry::before),
+                         entry);
+    }
+
+    //Finds the entry of the node by binary search alone, however many
+    //viruses share its stamp.
+    inline void forget_creation(Node const &node) noexcept {
+        std::lower_bound(creations.begin(), creations.end(),
+                         creation_entry{node.created, node.sequence, nullptr},
+                         creation_entry::before)->node = nullptr;
+        ++removed_creations;
+    }
+
+    inline void squeeze_creations() noexcept {
+        if (removed_creations <= creations.size() - removed_creations)
+            return;
+
+        creations.erase(std::remove_if(creations.begin(), creations.end(),
+                                       [](creation_entry const &entry) {
+                                           return !entry.node;
+                                       }),
+                        creations.end());
+        removed_creations = 0;
+    }
+
+    //Entries of the table in order of creation.
+    static inline creations_t creations_of(table_t const &table) {
+        creations_t result(table.get_allocator());
+        result.reserve(table.size());
+        for (auto node : table)
+            result.push_back({node->created, node->sequence, node});
+        std::sort(result.begin(), result.end(), creation_entry::before);
+        return result;
+    }
+
+    static inline unsigned policy_threads(
+            genealogy_parallel_policy const &policy) noexcept {
+        return policy.threads ? policy.threads
+                              : std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    static inline unsigned policy_threads(genealogy_sequenced_policy) noexcept {
+        return 1;
+    }
+
+    //Neighbours of every node of the table as table indexes, in CSR form -
+    //parents with of_parents set, children otherwise.
+    inline std::pair<std::vector<std::size_t>, std::vector<std::size_t>>
+    table_adjacency(bool of_parents, unsigned threads) const {
+        auto n = table.size();
+        std::vector<std::size_t> offsets(n + 1, 0);
+        for (std::size_t i = 0; i < n; ++i)
+            offsets[i + 1] = offsets[i] + (of_parents
+                                           ? table[i]->parents.size()
+                                           : table[i]->children.size());
+
+        std::vector<std::size_t> indexes(offsets.back());
+        auto chunks = (n + table_chunk - 1) / table_chunk;
+        genealogy_parallel_for(chunks, threads, [&](std::size_t chunk) {
+            auto end = std::min(n, (chunk + 1) * table_chunk);
+            for (auto i = chunk * table_chunk; i < end; ++i) {
+                auto out = indexes.begin() + offsets[i];
+                auto fill = [&](auto const &ids) {
+                    for (auto &id : ids)
+                        *out++ = graph.find(id)->second.index;
+                };
+                if (of_parents)
+                    fill(table[i]->parents);
+                else
+                    fill(table[i]->children);
+            }
+        });
+
+        return {std::move(offsets), std::move(indexes)};
+    }
+
+    //Table indexes of the nodes at starts and all of their ancestors, apart
+    //from skipped ones and what is reachable only through them.
+    inline std::vector<std::size_t>
+    ancestor_indexes(std::vector<std::size_t> const &starts,
+                     std::vector<bool> const *skipped = nullptr) const {
+        std::vector<bool> visited(table.size(), false);
+        std::vector<std::size_t> result;
+        for (auto start : starts)
+            if (!visited[start] && !(skipped && (*skipped)[start])) {
+                visited[start] = true;
+                result.push_back(start);
+            }
+
+        for (std::size_t next = 0; next < result.size(); ++next)
+            for (auto &parent : table[result[next]]->parents) {
+                auto index = graph.find(parent)->second.index;
+                if (!visited[index] && !(skipped && (*skipped)[index])) {
+                    visited[index] = true;
+                    result.push_back(index);
+                }
+            }
+
+        return result;
+    }
+
+    //Table indexes of the node at start and all of its descendants, as they
+    //will be once skipped nodes are gone and extra, a (parent, child) pair
+    //of indexes, is an edge.
+    inline std::vector<std::size_t> descendant_indexes(
+            std::size_t start, std::vector<bool> const *skipped = nullptr,
+            std::optional<std::pair<std::size_t, std::size_t>> extra = {})
+            const {
+        std::vector<bool> visited(table.size(), false);
+        std::vector<std::size_t> result{start};
+        visited[start] = true;
+
+        auto visit = [&](std::size_t index) {
+            if (!visited[index] && !(skipped && (*skipped)[index])) {
+                visited[index] = true;
+                result.push_back(index);
+            }
+        };
+        for (std::size_t next = 0; next < result.size(); ++next) {
+            auto current = result[next];
+            for (auto &child : table[current]->children)
+                visit(graph.find(child)->second.index);
+            if (extra && extra->first == current)
+                visit(extra->second);
+        }
+
+        return result;
+    }
+
+    //Stages aggregates for a new virus with the given parents.
+    inline void stage_created(typename Virus::id_type const &id,
+                              std::vector<std::size_t> const &parents) {
+        if (lineages) {
+            auto signature = lineage_index::own(id);
+            for (auto parent : parents)
+                signature.merge(lineages->signatures[parent]);
+            lineages->stage_new(id, signature);
+        }
+        if (aggregates.empty())
+            return;
+
+        auto affected = ancestor_indexes(parents);
+        for (auto &aggregate : aggregates) {
+            aggregate->stage_new(id);
+            aggregate->stage_combine(affected, std::nullopt);
+        }
+    }
+
+    //Strong guarantee. Folds a new aggregate over everything and adds it.
+    template<typename T>
+    inline void add_aggregate(std::unique_ptr<aggregate_storage<T>> storage) {
+        auto n = table.size();
+        storage->own.reserve(n);
+        storage->total.reserve(n);
+        for (auto node : table)
+            storage->own.push_back(storage->value(node->virus));
+
+        if (storage->is_idempotent || is_tree()) {
+            //Totals of children cover all descendants, each combined once
+            //in a tree and harmlessly again in a dag.
+            auto totals = dynamic_program<T>(
+                    genealogy_direction::bottom_up, genealogy_seq,
+                    [&](typename Virus::id_type const &id, auto const &children) {
+                        T result = storage->own[graph.find(id)->second.index];
+                        for (auto &child : children)
+                            result = storage->combine(result, child);
+                        return result;
+                    });
+            storage->total.resize(n, storage->identity);
+            auto it = graph.begin();
+            for (auto &[id, result] : totals)
+                storage->total[(it++)->second.index] = std::move(result);
+        } else {
+            for (std::size_t i = 0; i < n; ++i) {
+                T result = storage->identity;
+                for (auto descendant : descendant_indexes(i))
+                    result = storage->combine(result, storage->own[descendant]);
+                storage->total.push_back(std::move(result));
+            }
+        }
+
+        aggregates.push_back(std::move(storage));
+    }
+
+    //Orders affected so that each comes after its children among them, and
+    //sets staged_at of each to its place in that order. False if a cycle
+    //makes that impossible.
+    inline bool order_bottom_up(std::vector<std::size_t> const &affected,
+                                std::vector<std::size_t> &order,
+                                std::vector<std::size_t> &staged_at) const {
+        constexpr auto none = static_cast<std::size_t>(-1);
+        std::vector<std::size_t> place(table.size(), none);
+        for (std::size_t i = 0; i < affected.size(); ++i)
+            place[affected[i]] = i;
+
+        std::vector<std::size_t> waiting(affected.size(), 0);
+        for (std::size_t i = 0; i < affected.size(); ++i)
+            for (auto &child : table[affected[i]]->children)
+                if (place[graph.find(child)->second.index] != none)
+                    ++waiting[i];
+
+        order.clear();
+        for (std::size_t i = 0; i < affected.size(); ++i)
+            if (waiting[i] == 0)
+                order.push_back(affected[i]);
+        for (std::size_t next = 0; next < order.size(); ++next)
+            for (auto &parent : table[order[next]]->parents) {
+                auto at = place[graph.find(parent)->second.index];
+                if (at != none && --waiting[at] == 0)
+                    order.push_back(affected[at]);
+            }
+        if (order.size() != affected.size())
+            return false;
+
+        staged_at.assign(table.size(), none);
+        for (std::size_t i = 0; i < order.size(); ++i)
+            staged_at[order[i]] = i;
+        return true;
+    }
+
+    //Stages aggregates of the ancestors of affected for their changed
+    //descendants. Idempotent aggregates just take in the total of the new
+    //child, invertible ones take out the total of lost - given when every
+    //affected ancestor loses all of its descendants, as in a tree. When
+    //ancestors only lose descendants, idempotent aggregates, and all of them
+    //in a tree, gather the totals of children anew from the bottom up, one
+    //combine per edge. Others are folded anew over all descendants.
+    inline void stage_refolded(
+            std::vector<std::size_t> const &affected,
+            std::vector<bool> const *skipped,
+            std::optional<std::pair<std::size_t, std::size_t>> extra,
+            std::optional<std::size_t> lost = std::nullopt) {
+        std::vector<std::size_t> order, staged_at;
+        bool ordered = false;
+        if (!extra && std::any_of(aggregates.begin(), aggregates.end(),
+                                  [&](auto const &aggregate) {
+                                      return aggregate->idempotent() ||
+                                             is_tree();
+                                  }))
+            ordered = order_bottom_up(affected, order, staged_at);
+
+        auto gathered = [&](aggregate_base const &aggregate) {
+            return ordered && !(lost && aggregate.invertible()) &&
+                   (aggregate.idempotent() || is_tree());
+        };
+        auto cheap = [&](aggregate_base const &aggregate) {
+            return (extra && aggregate.idempotent()) ||
+                   (lost && aggregate.invertible()) || gathered(aggregate);
+        };
+
+        bool refold = false, gather = false;
+        for (auto &aggregate : aggregates)
+            if (extra && aggregate->idempotent())
+                aggregate->stage_combine(affected, extra->second);
+            else if (lost && aggregate->invertible())
+                aggregate->stage_subtract(affected, *lost);
+            else if (gathered(*aggregate))
+                gather = true;
+            else
+                refold = true;
+
+        if (gather) {
+            std::vector<std::size_t> children;
+            for (auto index : order) {
+                children.clear();
+                for (auto &child : table[index]->children) {
+                    auto child_index = graph.find(child)->second.index;
+                    if (!(skipped && (*skipped)[child_index]))
+                        children.push_back(child_index);
+                }
+                for (auto &aggregate : aggregates)
+                    if (gathered(*aggregate))
+                        aggregate->stage_gather(index, children, staged_at);
+            }
+        }
+        if (!refold)
+            return;
+
+        for (auto index : affected) {
+            auto descendants = descendant_indexes(index, skipped, extra);
+            for (auto &aggregate : aggregates)
+                if (!cheap(*aggregate))
+                    aggregate->stage_fold(index, descendants);
+        }
+    }
+
+    //Stages lineage signatures of child and its descendants, which now
+    //descend from parent too. Whatever does not change shields its own
+    //descendants, their lineages already hold the parent's.
+    inline void stage_lineage_joined(std::size_t parent, std::size_t child) {
+        auto const &with = lineages->signatures[parent];
+        std::vector<bool> visited(table.size(), false);
+        std::vector<std::size_t> to_visit{child};
+        visited[child] = true;
+
+        while (!to_visit.empty()) {
+            auto index = to_visit.back();
+            to_visit.pop_back();
+
+            auto signature = lineages->signatures[index];
+            signature.merge(with);
+            if (signature == lineages->signatures[index])
+                continue;
+            lineages->stage(index, table[index]->virus, signature);
+
+            for (auto &child_id : table[index]->children) {
+                auto child_index = graph.find(child_id)->second.index;
+                if (!visited[child_index]) {
+                    visited[child_index] = true;
+                    to_visit.push_back(child_index);
+                }
+            }
+        }
+    }
+
+    //Stages lineage signatures of the viruses at starts and their
+    //descendants, recomputed from their parents as they will be once
+    //skipped viruses are gone - each after its parents, and on a cycle from
+    //all of its ancestors.
+    inline void stage_lineage_cut(std::vector<std::size_t> const &starts,
+                                  std::vector<bool> const &skipped) {
+        constexpr auto none = static_cast<std::size_t>(-1);
+        std::vector<std::size_t> affected;
+        std::vector<std::size_t> position(table.size(), none);
+        for (auto start : starts)
+            if (position[start] == none) {
+                position[start] = affected.size();
+                affected.push_back(start);
+            }
+        for (std::size_t next = 0; next < affected.size(); ++next)
+            for (auto &child : table[affected[next]]->children) {
+                auto index = graph.find(child)->second.index;
+                if (position[index] == none && !skipped[index]) {
+                    position[index] = affected.size();
+                    affected.push_back(index);
+                }
+            }
+
+        auto surviving_parents = [&](std::size_t index, auto const &f) {
+            for (auto &parent : table[index]->parents) {
+                auto parent_index = graph.find(parent)->second.index;
+                if (!skipped[parent_index])
+                    f(parent_index);
+            }
+        };
+
+        std::vector<std::size_t> pending(affected.size(), 0);
+        std::vector<std::size_t> ready;
+        for (std::size_t i = 0; i < affected.size(); ++i) {
+            surviving_parents(affected[i], [&](std::size_t parent) {
+                pending[i] += position[parent] != none;
+            });
+            if (pending[i] == 0)
+                ready.push_back(i);
+        }
+
+        std::vector<genealogy_minhash> signatures(affected.size());
+        std::vector<bool> done(affected.size(), false);
+        while (!ready.empty()) {
+            auto i = ready.back();
+            ready.pop_back();
+            signatures[i] = lineage_index::own(table[affected[i]]->virus);
+            surviving_parents(affected[i], [&](std::size_t parent) {
+                signatures[i].merge(position[parent] != none
+                                    ? signatures[position[parent]]
+                                    : lineages->signatures[parent]);
+            });
+            done[i] = true;
+
+            for (auto &child : table[affected[i]]->children) {
+                auto index = graph.find(child)->second.index;
+                if (position[index] != none && --pending[position[index]] == 0)
+                    ready.push_back(position[index]);
+            }
+        }
+
+        for (std::size_t i = 0; i < affected.size(); ++i) {
+            if (!done[i])
+                for (auto ancestor : ancestor_indexes({affected[i]}, &skipped))
+                    signatures[i].merge(
+                            lineage_index::own(table[ancestor]->virus));
+            if (!(signatures[i] == lineages->signatures[affected[i]]))
+                lineages->stage(affected[i], table[affected[i]]->virus,
+                                signatures[i]);
+        }
+    }
+
+    //Where the weight of the edge from parent is or would go.
+    template<typename Weights>
+    static inline auto find_weight(Weights &weights,
+                                   typename Virus::id_type const &parent) {
+        return std::lower_bound(weights.begin(), weights.end(), parent,
+                                [](auto const &weight, auto const &id) {
+                                    return weight.first < id;
+                                });
+    }
+
+    inline double weight_of(Node const &child,
+                            typename Virus::id_type const &parent) const {
+        auto it = find_weight(child.weights, parent);
+        return it != child.weights.end() && !(parent < it->first)
+               ? it->second : default_edge_weight;
+    }
+
+    //Collects ids of all descendants of the virus, including itself.
+    inline std::set<typename Virus::id_type>
+    collect_descendants(typename Virus::id_type const &id) const {
+        std::set<typename Virus::id_type> visited{id};
+        std::vector<typename Virus::id_type> to_visit{id};
+
+        while (!to_visit.empty()) {
+            auto current = to_visit.back();
+            to_visit.pop_back();
+            for (auto &child : graph.find(current)->second.children)
+                if (visited.insert(child).second)
+                    to_visit.push_back(child);
+        }
+
+        return visited;
+    }
+
+    //Collects the virus and all of its descendants which would be left
+    //without parents after removing it. Does not modify anything.
+    inline std::set<typename Virus::id_type>
+    collect_removed(typename Virus::id_type const &id) const {
+        std::set<typename Virus::id_type> removed{id};
+        std::map<typename Virus::id_type, std::size_t> removed_parents;
+        std::vector<typename Virus::id_type> to_visit{id};
+
+        while (!to_visit.empty()) {
+            auto current = to_visit.back();
+            to_visit.pop_back();
+            for (auto &child : graph.find(current)->second.children) {
+                //Stem can only get parents through a cycle and is never
+                //removed.
+                if (child == stem_id)
+                    continue;
+
+                auto parents_count = graph.find(child)->second.parents.size();
+                if (++removed_parents[child] == parents_count &&
+                    removed.insert(child).second)
+                    to_visit.push_back(child);
+            }
+        }
+
+        return removed;
+    }
+
+    inline parents_t create_virus_set(
+            std::vector<typename Virus::id_type> const &ids) {
+        parents_t result(allocator);
+
+        for (auto &id : ids)
+            result.insert(graph.find(id)->second.virus);
+
+        return result;
+    }
+
+public:
+    class children_iterator {
+    public:
+        //Needed to satisfy bidirectional_iterator concept.
+        using difference_type = std::ptrdiff_t;
+        using type = Virus *;
+        using value_type = typename Virus::id_type;
+
+        inline const Virus &operator*() const {
+            virus_set.insert(Virus(*children_vec_it));
+            return *virus_set.find(*children_vec_it);
+        }
+
+        inline const Virus *operator->() {
+            virus_set.insert(Virus(*children_vec_it));
+            return &**this;
+        }
+
+        inline children_iterator &operator++() {
+            ++children_vec_it;
+            return *this;
+        }
+
+        inline children_iterator operator++(int) {
+            auto copy = *this;
+            ++children_vec_it;
+            return copy;
+        }
+
+        inline children_iterator &operator--() {
+            --children_vec_it;
+            return *this;
+        }
+
+        inline children_iterator operator--(int) {
+            auto copy = *this;
+            --children_vec_it;
+            return copy;
+        }
+
+        inline bool operator==(const children_iterator &other) const {
+            return other.children_vec_it == children_vec_it;
+        }
+
+        inline children_iterator(typename children_t::iterator it,
+                                 virus_set_t virus_set)
+                : children_vec_it(it), virus_set(virus_set) {}
+
+        inline children_iterator() = default;
+
+    private:
+        typename children_t::iterator children_vec_it;
+        mutable virus_set_t virus_set;
+
+    };
+
+    inline VirusGenealogy<Virus, Allocator>::children_iterator
+    get_children_begin(typename Virus::id_type const &id) const {
+        if (!exists(id))
+            throw VirusNotFound();
+
+        return children_iterator(graph.find(id)->second.children.begin(),
+                                 virus_set);
+    }
+
+    inline VirusGenealogy<Virus, Allocator>::children_iterator
+    get_children_end(typename Virus::id_type const &id) const {
+        if (!exists(id))
+            throw VirusNotFound();
+
+        return children_iterator(graph.find(id)->second.children.end(),
+                                 virus_set);
+    }
+
+    // Strong guarantee is provided by working on a copy.
+    inline VirusGenealogy(typename Virus::id_type const &stem_id,
+                          Allocator const &allocator,
+                          genealogy_mode mode = genealogy_mode::dag)
+            : allocator(allocator), graph(allocator), table(allocator),
+              stem_id(stem_id), mode(mode), tour(allocator),
+              degrees(allocator), creations(allocator) {
+        auto tokens = acquire_tokens();
+        graph_t tmp_graph(allocator);
+        tmp_graph.insert({stem_id,
+                          Node(children_t(allocator), parents_t(allocator),
+                               stem_id, tokens)});
+        reserve_table();
+        degrees.reserve(0);
+        reserve_creations();
+
+        std::swap(graph, tmp_graph);
+        add_to_table(graph.begin()->second);
+        degrees.insert(graph.begin()->second);
+        add_creation(graph.begin()->second, 0);
+        if (is_tree())
+            tour.link_root(tokens);
+    }
+
+    inline VirusGenealogy(typename Virus::id_type const &stem_id,
+                          genealogy_mode mode = genealogy_mode::dag)
+            : VirusGenealogy(stem_id, Allocator(), mode) {}
+
+    //Builds the genealogy described by topology, filling adjacency sets on
+    //threads threads. Throws std::invalid_argument if it is malformed, and
+    //TriedToAddSecondParent if it is not a tree in tree mode.
+    inline VirusGenealogy(
+            genealogy_topology<typename Virus::id_type> const &topology,
+            Allocator const &allocator, unsigned threads = 1)
+            : allocator(allocator), graph(allocator), table(allocator),
+              stem_id(topology.ids.at(topology.stem)), mode(topology.mode),
+              tour(allocator), degrees(allocator), creations(allocator) {
+        auto &ids = topology.ids;
+        auto &offsets = topology.parent_offsets;
+        auto &indexes = topology.parent_indexes;
+        auto n = ids.size();
+
+        if (offsets.size() != n + 1 || offsets.back() != indexes.size() ||
+            (!topology.created.empty() && topology.created.size() != n))
+            throw std::invalid_argument("Malformed topology");
+        for (std::size_t i = 0; i < n; ++i)
+            if (offsets[i] > offsets[i + 1] || (i && !(ids[i - 1] < ids[i])))
+                throw std::invalid_argument("Malformed topology");
+        for (auto &index : indexes)
+            if (index >= n)
+                throw std::invalid_argument("Malformed topology");
+
+        //Children of each virus, in increasing order.
+        std::vector<std::size_t> child_offsets(n + 1, 0);
+        for (auto &index : indexes)
+            ++child_offsets[index + 1];
+        for (std::size_t i = 0; i < n; ++i)
+            child_offsets[i + 1] += child_offsets[i];
+
+        std::vector<std::size_t> child_indexes(indexes.size());
+        std::vector<std::size_t> filled(child_offsets.begin(),
+                                        child_offsets.end() - 1);
+        for (std::size_t i = 0; i < n; ++i)
+            for (auto j = offsets[i]; j < offsets[i + 1]; ++j)
+                child_indexes[filled[indexes[j]]++] = i;
+
+        std::vector<Node *> nodes;
+        nodes.reserve(n);
+        for (auto &id : ids)
+            nodes.push_back(&graph.emplace_hint(
+                    graph.end(), id,
+                    Node(children_t(allocator), parents_t(allocator),
+                         id))->second);
+
+        constexpr std::size_t chunk = 4096;
+        genealogy_parallel_for((n + chunk - 1) / chunk, threads,
+                               [&](std::size_t task) {
+            auto end = std::min(n, (task + 1) * chunk);
+            for (auto i = task * chunk; i < end; ++i) {
+                for (auto j = offsets[i]; j < offsets[i + 1]; ++j)
+                    nodes[i]->parents.insert(ids[indexes[j]]);
+                for (auto j = child_offsets[i]; j < child_offsets[i + 1]; ++j)
+                    nodes[i]->children.emplace_hint(nodes[i]->children.end(),
+                                                    ids[child_indexes[j]]);
+            }
+        });
+
+        table.reserve(n);
+        for (auto node : nodes) {
+            edges += node->parents.size();
+            add_to_table(*node);
+        }
+        degrees.rebuild(table);
+        if (topology.created.empty()) {
+            creations.reserve(n);
+            for (std::size_t i = 0; i < n; ++i)
+                add_creation(*nodes[i], i);
+        } else {
+            for (std::size_t i = 0; i < n; ++i) {
+                nodes[i]->created = topology.created[i];
+                nodes[i]->sequence = i;
+                last_stamp = std::max(last_stamp, topology.created[i]);
+            }
+            creation_sequence = n;
+            creations = creations_of(table);
+        }
+
+        if (is_tree())
+            link_tree(nodes, child_offsets, child_indexes, topology.stem);
+    }
+
+    inline VirusGenealogy(
+            genealogy_topology<typename Virus::id_type> const &topology,
+            unsigned threads = 1)
+            : VirusGenealogy(topology, Allocator(), threads) {}
+
+    inline VirusGenealogy(const VirusGenealogy &) = delete;
+
+    inline VirusGenealogy &operator=(const VirusGenealogy &) = delete;
+
+    //Strong guarantee, becaus comaprison of ids can throw.
+    inline bool exists(typename Virus::id_type const &id) const {
+        return graph.contains(id);
+    }
+
+    //Strong guarantee - does not modify anything, ctor of Virus
+    //can throw exception, as well as comparison of Virus (used in find()).
+    inline const Virus &operator[](typename Virus::id_type const &id) const {
+        auto result = graph.find(id);
+        if (result != graph.end()) {
+            virus_set.insert(Virus(result->second.virus));
+            return *virus_set.find(result->second.virus);
+        } else
+            throw VirusNotFound();
+    }
+
+
+    //Stamps the virus with next_stamp().
+    inline void create(typename Virus::id_type const &id,
+                       typename Virus::id_type const &parent_id) {
+        create(id, parent_id, next_stamp());
+    }
+
+    //Stamps the virus with stamp, e.g. when replaying a log or bringing an
+    //evicted virus back. A stamp older than the last one costs O(n) more.
+    //This is strong guarantee, because only operation on original is strong
+    //guarantee, and if any operation fails after it, rollback in nothrow way is
+    //performed.
+    inline void create(typename Virus::id_type const &id,
+                       typename Virus::id_type const &parent_id,
+                       std::uint64_t stamp) {
+        if (exists(id))
+            throw VirusAlreadyCreated();
+
+        if (!exists(parent_id))
+            throw VirusNotFound();
+
+        parents_t parents(allocator);
+        parents.insert(graph.find(parent_id)->second.virus);
+        reserve_table();
+        degrees.reserve(graph.find(parent_id)->second.children.size() + 1);
+        reserve_creations();
+        aggregate_stage stage(aggregates, lineages);
+        stage_created(id, {graph.find(parent_id)->second.index});
+
+        auto tokens = acquire_tokens();
+        typename graph_t::iterator it_inserted, it_parent;
+
+        try {
+            it_inserted = graph.insert(graph.end(),
+                                       {id, Node(children_t(allocator),
+                                                 parents, id, tokens)});
+        }
+        catch (...) {
+            release_tokens(tokens);
+
+            throw;
+        }
+
+        try {
+            //Strong, and no copy of the children of a hub.
+            it_parent = graph.find(parent_id);
+            it_parent->second.children.insert(it_inserted->second.virus);
+        }
+        catch (...) {
+            //If something above threw, that means I have to only erase what
+            //has been added to graph -
+            //fortunately erase is nothrow if iterator is known.
+            graph.erase(it_inserted);
+            release_tokens(tokens);
+
+            throw;
+        }
+
+        //Nothrow.
+        if (is_tree())
+            tour.link_after(it_parent->second.tokens.first, tokens);
+        add_to_table(it_inserted->second);
+        degrees.increment(it_parent->second,
+                          it_parent->second.children.size() - 1);
+        degrees.insert(it_inserted->second);
+        add_creation(it_inserted->second, stamp);
+        stage.commit();
+        ++edges;
+    }
+
+    inline void create(typename Virus::id_type const &id,
+                       std::vector<typename Virus::id_type> const &parent_ids) {
+        create(id, parent_ids, next_stamp());
+    }
+
+    //The same technic as above, only we need to remember changes in some way,
+    //so where the new virus went into children of its parents is saved, to
+    //be erased by iterator, which is nothrow.
+    inline void create(typename Virus::id_type const &id,
+                       std::vector<typename Virus::id_type> const &parent_ids,
+                       std::uint64_t stamp) {
+        if (exists(id))
+            throw VirusAlreadyCreated();
+
+        for (auto &parent_id: parent_ids)
+            if (!exists(parent_id)) {
+                throw VirusNotFound();
+            }
+
+        if (parent_ids.size() == 0)
+            return;
+
+        parents_t parents(create_virus_set(parent_ids));
+
+        if (is_tree()) {
+            if (parents.size() > 1)
+                throw TriedToAddSecondParent();
+
+            return create(id, *parents.begin(), stamp);
+        }
+
+        reserve_table();
+        for (auto &parent : parents)
+            degrees.reserve(graph.find(parent)->second.children.size() + 1);
+        reserve_creations();
+        aggregate_stage stage(aggregates, lineages);
+        if (!aggregates.empty() || lineages) {
+            std::vector<std::size_t> parent_indexes;
+            for (auto &parent : parents)
+                parent_indexes.push_back(graph.find(parent)->second.index);
+            stage_created(id, parent_indexes);
+        }
+
+        auto it_inserted = graph.insert(graph.end(),
+                                        {id,
+                                         {children_t(allocator), parents,
+                                          id}});
+
+        std::vector<std::pair<children_t *, typename children_t::iterator>>
+                inserted;
+
+        try {
+            inserted.reserve(parents.size());
+            for (auto &parent : parents) {
+                auto &children = graph.find(parent)->second.children;
+                inserted.emplace_back(
+                        &children,
+                        children.insert(it_inserted->second.virus).first);
+            }
+        }
+        catch (...) {
+            //If something above threw, that means I have to only erase what I
+            //have added - fortunately erase is nothrow if iterator is known
+            //(getting iterator can throw).
+            for (auto &[children, it] : inserted)
+                children->erase(it);
+            graph.erase(it_inserted);
+
+            throw;
+        }
+
+        //All below is nothrow.
+        add_to_table(it_inserted->second);
+        for (auto &parent : it_inserted->second.parents) {
+            auto &parent_node = graph.find(parent)->second;
+            degrees.increment(parent_node, parent_node.children.size() - 1);
+        }
+        degrees.insert(it_inserted->second);
+        add_creation(it_inserted->second, stamp);
+        stage.commit();
+        edges += it_inserted->second.parents.size();
+    }
+
+    inline typename Virus::id_type get_stem_id() const {
+        return stem_id;
+    }
+
+    //This is strong guarantee.
+    inline std::vector<typename Virus::id_type>
+    get_parents(typename Virus::id_type const &id) const {
+        if (!exists(id))
+            throw VirusNotFound();
+
+        return graph.find(id)->second.parents.sorted();
+    }
+
+    inline std::size_t size() const noexcept {
+        return graph.size();
+    }
+
+    inline std::size_t edge_count() const noexcept {
+        return edges;
+    }
+
+    //Strong guarantee. Throws VirusNotFound if the virus does not exist.
+    inline std::size_t parent_count(typename Virus::id_type const &id) const {
+        auto it = graph.find(id);
+        if (it == graph.end())
+            throw VirusNotFound();
+
+        return it->second.parents.size();
+    }
+
+    //Strong guarantee. Throws VirusNotFound if the virus does not exist.
+    inline std::size_t child_count(typename Virus::id_type const &id) const {
+        auto it = graph.find(id);
+        if (it == graph.end())
+            throw VirusNotFound();
+
+        return it->second.children.size();
+    }
+
+    //From now on stamps created viruses with the time clock returns instead
+    //of a sequence number, or the last stamp if the clock went back. An
+    //empty clock goes back to sequence numbers.
+    inline void set_creation_clock(std::function<std::uint64_t()> clock) {
+        creation_clock = std::move(clock);
+    }
+
+    //Strong guarantee. When the virus was created - the stem at 0 and every
+    //later virus after the one before, unless set_creation_clock() says
+    //otherwise. Throws VirusNotFound if the virus does not exist.
+    inline std::uint64_t created_at(typename Virus::id_type const &id) const {
+        auto it = graph.find(id);
+        if (it == graph.end())
+            throw VirusNotFound();
+
+        return it->second.created;
+    }
+
+    //Strong guarantee. Viruses created at from or later and before to, in
+    //order of creation. O(log n + k), plus removed viruses still in the
+    //creation index, never more than those left.
+    inline std::vector<typename Virus::id_type>
+    created_between(std::uint64_t from, std::uint64_t to) const {
+        auto it = std::lower_bound(
+                creations.begin(), creations.end(), from,
+                [](creation_entry const &entry, std::uint64_t stamp) {
+                    return entry.stamp < stamp;
+                });
+
+        std::vector<typename Virus::id_type> result;
+        for (; it != creations.end() && it->stamp < to; ++it)
+            if (it->node)
+                result.push_back(it->node->virus);
+        return result;
+    }
+
+    //Strong guarantee. Up to k viruses created last, the newest first.
+    //Costs like created_between().
+    inline std::vector<typename Virus::id_type> newest(std::size_t k) const {
+        std::vector<typename Virus::id_type> result;
+        result.reserve(std::min(k, graph.size()));
+        for (auto it = creations.rbegin();
+             it != creations.rend() && result.size() < k; ++it)
+            if (it->node)
+                result.push_back(it->node->virus);
+        return result;
+    }
+
+    //Strong guarantee. Up to k viruses with the most children and how many
+    //they have, most first and ties in no particular order, in O(k).
+    inline std::vector<std::pair<typename Virus::id_type, std::size_t>>
+    top_by_children(std::size_t k) const {
+        std::vector<std::pair<typename Virus::id_type, std::size_t>> result;
+        result.reserve(std::min(k, graph.size()));
+        for (auto count = degrees.top();
+             count != degree_index::none && result.size() < k;
+             count = degrees[count].lower)
+            for (auto node = degrees[count].first;
+                 node && result.size() < k; node = node->degree_next)
+                result.emplace_back(node->virus, count);
+        return result;
+    }
+
+    //Viruses without children, the tips of the genealogy, in no particular
+    //order. Valid until the genealogy changes.
+    class leaf_range {
+    public:
+        class iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+            using value_type = typename Virus::id_type;
+            using pointer = const typename Virus::id_type *;
+            using reference = const typename Virus::id_type &;
+
+            inline iterator() = default;
+
+            inline const typename Virus::id_type &operator*() const {
+                return node->virus;
+            }
+
+            inline const typename Virus::id_type *operator->() const {
+                return &**this;
+            }
+
+            inline iterator &operator++() {
+                node = node->degree_next;
+                return *this;
+            }
+
+            inline iterator operator++(int) {
+                auto copy = *this;
+                ++*this;
+                return copy;
+            }
+
+            inline bool operator==(const iterator &other) const {
+                return node == other.node;
+            }
+
+        private:
+            friend class leaf_range;
+
+            inline explicit iterator(const Node *node) : node(node) {}
+
+            const Node *node = nullptr;
+        };
+
+        inline iterator begin() const {
+            return iterator(first);
+        }
 
-    using children_t = std::set<typename Virus::id_type>;
-    using parents_t = std::set<typename Virus::id_type>;
-    using virus_set_t = std::set<Virus, set_compare>;
+        inline iterator end() const {
+            return iterator(nullptr);
+        }
 
-    class Node {
-    public:
-        children_t children;
-        parents_t parents;
-        typename Virus::id_type virus;
+        inline std::size_t size() const noexcept {
+            return count;
+        }
 
-        Node(children_t children, parents_t parents,
-             typename Virus::id_type virus)
-                : children(children), parents(parents), virus(virus) {}
+        inline bool empty() const noexcept {
+            return count == 0;
+        }
+
+    private:
+        friend class VirusGenealogy;
+
+        inline leaf_range(const Node *first, std::size_t count)
+                : first(first), count(count) {}
+
+        const Node *first;
+        std::size_t count;
     };
 
-    using graph_t = std::map<typename Virus::id_type, Node>;
+    //Nothrow. The viruses without children - kept as those with zero of
+    //them in the degree index - with size() in O(1).
+    inline leaf_range leaves() const noexcept {
+        return leaf_range(degrees[0].first, degrees[0].size);
+    }
 
-    mutable graph_t graph;
-    mutable virus_set_t virus_set;
-    typename Virus::id_type stem_id;
+    //Strong guarantee. k distinct viruses, each set of them equally likely,
+    //picked by index from the node table in O(k) - or all of them, in no
+    //particular order, if there are no more.
+    template<typename Rng>
+    inline std::vector<typename Virus::id_type> sample(std::size_t k,
+                                                       Rng &rng) const {
+        auto n = table.size();
+        std::vector<typename Virus::id_type> result;
+        if (k >= n) {
+            result.reserve(n);
+            for (auto node : table)
+                result.push_back(node->virus);
+            return result;
+        }
 
-    inline parents_t create_virus_set(
-            std::vector<typename Virus::id_type> const &ids) {
-        parents_t result;
+        //Floyd's algorithm, a uniform k-subset with k draws.
+        std::unordered_set<std::size_t> picked;
+        picked.reserve(k);
+        result.reserve(k);
+        for (auto i = n - k; i < n; ++i) {
+            auto index = std::uniform_int_distribution<std::size_t>(0, i)(rng);
+            if (!picked.insert(index).second) {
+                index = i;
+                picked.insert(index);
+            }
+            result.push_back(table[index]->virus);
+        }
+        return result;
+    }
 
-        for (auto &id : ids)
-            result.insert(graph.find(id)->second.virus);
+    //Strong guarantee. A random walk of up to steps steps from the virus,
+    //each to a uniformly chosen child (top_down) or parent (bottom_up),
+    //ending early at a virus with none. Returns the viruses visited, the
+    //first one included. A step costs O(number of children or parents).
+    template<typename Rng>
+    inline std::vector<typename Virus::id_type>
+    random_walk(typename Virus::id_type const &id, std::size_t steps, Rng &rng,
+                genealogy_direction direction = genealogy_direction::top_down)
+                const {
+        auto it = graph.find(id);
+        if (it == graph.end())
+            throw VirusNotFound();
 
+        std::vector<typename Virus::id_type> result{id};
+        auto step = [&](auto const &neighbours) {
+            auto pick = std::uniform_int_distribution<std::size_t>(
+                    0, neighbours.size() - 1)(rng);
+            result.push_back(*std::next(neighbours.begin(), pick));
+        };
+        for (; steps > 0; --steps) {
+            auto const &node = it->second;
+            if (direction == genealogy_direction::top_down) {
+                if (node.children.empty())
+                    break;
+                step(node.children);
+            } else {
+                if (node.parents.empty())
+                    break;
+                step(node.parents);
+            }
+            it = graph.find(result.back());
+        }
         return result;
     }
 
-public:
-    class children_iterator {
+    //Calls f with the id of every virus, in no particular order. With a
+    //parallel policy the node table is split into chunks which threads take
+    //one by one, f may then only use const methods other than operator[]
+    //and get_children_begin/end. The first exception of f is rethrown once
+    //all threads have stopped.
+    template<typename F>
+    inline void for_each_virus(genealogy_sequenced_policy, F &&f) const {
+        for (auto node : table)
+            f(node->virus);
+    }
+
+    template<typename F>
+    inline void for_each_virus(genealogy_parallel_policy const &policy,
+                               F &&f) const {
+        auto chunks = (table.size() + table_chunk - 1) / table_chunk;
+        genealogy_parallel_for(chunks, policy_threads(policy),
+                               [&](std::size_t chunk) {
+            auto end = std::min(table.size(), (chunk + 1) * table_chunk);
+            for (auto i = chunk * table_chunk; i < end; ++i)
+                f(table[i]->virus);
+        });
+    }
+
+    //Reduces transform(id) of every virus, starting from init, like
+    //std::transform_reduce - reduce has to be associative and commutative.
+    template<typename T, typename Reduce, typename Transform>
+    inline T transform_reduce(genealogy_sequenced_policy, T init,
+                              Reduce reduce, Transform transform) const {
+        for (auto node : table)
+            init = reduce(std::move(init), transform(node->virus));
+        return init;
+    }
+
+    template<typename T, typename Reduce, typename Transform>
+    inline T transform_reduce(genealogy_parallel_policy const &policy, T init,
+                              Reduce reduce, Transform transform) const {
+        auto chunks = (table.size() + table_chunk - 1) / table_chunk;
+        std::vector<std::optional<T>> partial(chunks);
+
+        genealogy_parallel_for(chunks, policy_threads(policy),
+                               [&](std::size_t chunk) {
+            auto i = chunk * table_chunk;
+            auto end = std::min(table.size(), i + table_chunk);
+            T result = transform(table[i]->virus);
+            for (++i; i < end; ++i)
+                result = reduce(std::move(result), transform(table[i]->virus));
+            partial[chunk] = std::move(result);
+        });
+
+        for (auto &result : partial)
+            init = reduce(std::move(init), std::move(*result));
+        return init;
+    }
+
+    //Results of the viruses a virus depends on in dynamic_program().
+    template<typename T>
+    class dependency_results {
     public:
-        //Needed to satisfy bidirectional_iterator concept.
-        using difference_type = std::ptrdiff_t;
-        using type = Virus *;
-        using value_type = typename Virus::id_type;
+        class iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type = std::ptrdiff_t;
+            using value_type = T;
+            using pointer = const T *;
+            using reference = const T &;
+
+            inline iterator() = default;
+
+            inline const T &operator*() const {
+                return *results[*index];
+            }
 
-        inline const Virus &operator*() const {
-            virus_set.insert(Virus(*children_vec_it));
-            return *virus_set.find(*children_vec_it);
-        }
+            inline const T *operator->() const {
+                return &**this;
+            }
 
-        inline const Virus *operator->() {
-            virus_set.insert(Virus(*children_vec_it));
-            return &**this;
-        }
+            inline iterator &operator++() {
+                ++index;
+                return *this;
+            }
 
-        inline children_iterator &operator++() {
-            ++children_vec_it;
-            return *this;
+            inline iterator operator++(int) {
+                auto copy = *this;
+                ++index;
+                return copy;
+            }
+
+            inline bool operator==(const iterator &other) const {
+                return index == other.index;
+            }
+
+        private:
+            friend class dependency_results;
+
+            inline iterator(const std::size_t *index,
+                            const std::optional<T> *results)
+                    : index(index), results(results) {}
+
+            const std::size_t *index = nullptr;
+            const std::optional<T> *results = nullptr;
+        };
+
+        inline iterator begin() const {
+            return iterator(first, results);
         }
 
-        inline children_iterator operator++(int) {
-            auto copy = *this;
-            ++children_vec_it;
-            return copy;
+        inline iterator end() const {
+            return iterator(last, results);
         }
 
-        inline children_iterator &operator--() {
-            --children_vec_it;
-            return *this;
+        inline std::size_t size() const noexcept {
+            return last - first;
         }
 
-        inline children_iterator operator--(int) {
-            auto copy = *this;
-            --children_vec_it;
-            return copy;
+        inline bool empty() const noexcept {
+            return first == last;
         }
 
-        inline bool operator==(const children_iterator &other) const {
-            return other.children_vec_it == children_vec_it;
+    private:
+        friend class VirusGenealogy;
+
+        inline dependency_results(const std::size_t *first,
+                                  const std::size_t *last,
+                                  const std::optional<T> *results)
+                : first(first), last(last), results(results) {}
+
+        const std::size_t *first;
+        const std::size_t *last;
+        const std::optional<T> *results;
+    };
+
+    //Computes f(id, results) for every virus, where results are those of its
+    //parents (top_down) or children (bottom_up), and returns them by
+    //increasing id. A virus is scheduled as soon as everything it depends
+    //on is done: every thread works off its own queue of ready viruses and
+    //steals from the others when it runs dry.
+    //
+    //With a parallel policy f may only use const methods other than
+    //operator[] and get_children_begin/end. Throws std::invalid_argument if
+    //connect() closed a cycle, and rethrows the first exception of f.
+    template<typename T, typename Policy, typename F>
+    inline std::vector<std::pair<typename Virus::id_type, T>>
+    dynamic_program(genealogy_direction direction, Policy const &policy,
+                    F &&f) const {
+        auto n = table.size();
+        auto threads = static_cast<unsigned>(
+                std::min<std::size_t>(policy_threads(policy),
+                                      std::max<std::size_t>(n, 1)));
+        bool top_down = direction == genealogy_direction::top_down;
+        auto [input_offsets, inputs] = table_adjacency(top_down, threads);
+        auto [output_offsets, outputs] = table_adjacency(!top_down, threads);
+
+        std::vector<std::optional<T>> results(n);
+        std::unique_ptr<std::atomic<std::size_t>[]> waiting(
+                new std::atomic<std::size_t>[n]);
+
+        struct queue {
+            std::mutex mutex;
+            std::deque<std::size_t> ready;
+        };
+        std::vector<queue> queues(threads);
+        //Viruses queued or running, once it drops to 0 nothing more can
+        //become ready.
+        std::atomic<std::size_t> active = 0;
+        std::atomic<std::size_t> done = 0;
+        std::atomic<bool> failed = false;
+
+        for (std::size_t i = 0, next = 0; i < n; ++i) {
+            waiting[i] = input_offsets[i + 1] - input_offsets[i];
+            if (waiting[i] == 0) {
+                queues[next++ % threads].ready.push_back(i);
+                ++active;
+            }
         }
 
-        inline children_iterator(typename children_t::iterator it,
-                                 virus_set_t virus_set)
-                : children_vec_it(it), virus_set(virus_set) {}
+        auto take = [&](unsigned worker, std::size_t &node) {
+            for (unsigned k = 0; k < threads; ++k) {
+                auto &q = queues[(worker + k) % threads];
+                std::lock_guard lock(q.mutex);
+                if (q.ready.empty())
+                    continue;
+                //Own work from the back keeps caches warm, stolen work comes
+                //from the front.
+                if (k == 0) {
+                    node = q.ready.back();
+                    q.ready.pop_back();
+                } else {
+                    node = q.ready.front();
+                    q.ready.pop_front();
+                }
+                return true;
+            }
+            return false;
+        };
+
+        genealogy_parallel_for(threads, threads, [&](std::size_t task) {
+            auto worker = static_cast<unsigned>(task);
+            auto &own = queues[worker];
+            std::size_t node;
+            while (!failed && active > 0) {
+                if (!take(worker, node)) {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                try {
+                    results[node].emplace(f(
+                            table[node]->virus,
+                            dependency_results<T>(
+                                    inputs.data() + input_offsets[node],
+                                    inputs.data() + input_offsets[node + 1],
+                                    results.data())));
+
+                    for (auto j = output_offsets[node];
+                         j < output_offsets[node + 1]; ++j)
+                        if (--waiting[outputs[j]] == 0) {
+                            std::lock_guard lock(own.mutex);
+                            own.ready.push_back(outputs[j]);
+                            ++active;
+                        }
+                }
+                catch (...) {
+                    failed = true;
+                    --active;
+                    throw;
+                }
+                ++done;
+                --active;
+            }
+        });
 
-        inline children_iterator() = default;
+        if (done != n)
+            throw std::invalid_argument("Genealogy has a cycle");
+
+        std::vector<std::pair<typename Virus::id_type, T>> result;
+        result.reserve(n);
+        for (auto &[id, node] : graph)
+            result.emplace_back(id, std::move(*results[node.index]));
+        return result;
+    }
 
+    //Names an aggregate registered with register_aggregate().
+    template<typename T>
+    class aggregate_handle {
     private:
-        typename children_t::iterator children_vec_it;
-        mutable virus_set_t virus_set;
+        friend class VirusGenealogy;
 
+        std::size_t slot;
+
+        inline explicit aggregate_handle(std::size_t slot) : slot(slot) {}
     };
 
-    inline VirusGenealogy<Virus>::children_iterator
-    get_children_begin(typename Virus::id_type const &id) const {
-        if (!exists(id))
-            throw VirusNotFound();
+    //Strong guarantee. Registers a monoid - identity and an associative
+    //combine - folded over value(id) of every virus and its descendants,
+    //each counted once however many paths lead to it. From now on create
+    //only combines the new value into the ancestors, in O(ancestors);
+    //connect does the same for idempotent monoids (like max). On remove
+    //idempotent monoids, and all of them in tree mode, gather every
+    //affected ancestor anew from its children, bottom up, one combine per
+    //edge among the ancestors. Otherwise connect, like remove, folds every
+    //affected ancestor anew over all of its descendants, O(ancestors *
+    //descendants) - in tree mode a group registered with
+    //register_invertible_aggregate() only subtracts the removed subtree.
+    //Registering folds everything once.
+    template<typename T, typename Combine, typename Value>
+    inline aggregate_handle<T>
+    register_aggregate(T identity, Combine combine, Value value,
+                       bool idempotent = false) {
+        add_aggregate(std::make_unique<aggregate_storage<T>>(
+                std::move(identity), std::move(combine), std::move(value),
+                idempotent, nullptr));
+        return aggregate_handle<T>(aggregates.size() - 1);
+    }
 
-        return children_iterator(graph.find(id)->second.children.begin(),
-                                 virus_set);
+    //Strong guarantee. Like register_aggregate(), for a commutative group,
+    //like a sum, with combine(x, inverse(x)) equal to identity. In tree mode
+    //remove then takes the removed subtree out of its ancestors in
+    //O(ancestors) instead of folding them anew. Floating point sums drift
+    //by rounding this way.
+    template<typename T, typename Combine, typename Inverse, typename Value>
+    inline aggregate_handle<T>
+    register_invertible_aggregate(T identity, Combine combine, Inverse inverse,
+                                  Value value) {
+        add_aggregate(std::make_unique<aggregate_storage<T>>(
+                std::move(identity), std::move(combine), std::move(value),
+                false, std::move(inverse)));
+        return aggregate_handle<T>(aggregates.size() - 1);
     }
 
-    inline VirusGenealogy<Virus>::children_iterator
-    get_children_end(typename Virus::id_type const &id) const {
-        if (!exists(id))
+    //Strong guarantee. The aggregate folded over the virus and all of its
+    //descendants, O(1) after finding the virus.
+    template<typename T>
+    inline T const &aggregate(aggregate_handle<T> const &handle,
+                              typename Virus::id_type const &id) const {
+        auto it = graph.find(id);
+        if (it == graph.end())
             throw VirusNotFound();
 
-        return children_iterator(graph.find(id)->second.children.end(),
-                                 virus_set);
+        return static_cast<aggregate_storage<T> const &>(
+                *aggregates.at(handle.slot)).total[it->second.index];
     }
 
-    // Strong guarantee is provided by working on a copy.
-    inline VirusGenealogy(typename Virus::id_type const &stem_id)
-            : stem_id(stem_id) {
-        graph_t tmp_graph;
-        tmp_graph.insert({stem_id,
-                          Node(children_t(), parents_t(), stem_id)});
+    //Strong guarantee. From now on keeps a HyperLogLog sketch of the
+    //descendants of every virus, merged up the genealogy as an aggregate,
+    //for estimated_descendants. Every merge copies a sketch of up to 4 KB:
+    //create merges into every ancestor, remove merges the children of every
+    //affected ancestor into it anew, so either moves up to 4 KB times the
+    //ancestors, or the edges among them.
+    inline void enable_descendant_sketches()
+    requires genealogy_hashable<typename Virus::id_type> {
+        if (descendant_sketch_slot)
+            return;
 
-        std::swap(graph, tmp_graph);
+        descendant_sketch_slot = register_aggregate(
+                genealogy_hll(),
+                [](genealogy_hll const &a, genealogy_hll const &b) {
+                    auto result = a;
+                    result.merge(b);
+                    return result;
+                },
+                [](typename Virus::id_type const &id) {
+                    genealogy_hll result;
+                    result.add(std::hash<typename Virus::id_type>{}(id));
+                    return result;
+                },
+                true).slot;
     }
 
-    inline VirusGenealogy(const VirusGenealogy &) = delete;
-
-    inline VirusGenealogy &operator=(const VirusGenealogy &) = delete;
+    //Strong guarantee. Estimated number of descendants of the virus, itself
+    //included, within about 2% and exact for small numbers. Needs
+    //enable_descendant_sketches() first.
+    inline double
+    estimated_descendants(typename Virus::id_type const &id) const {
+        if (!descendant_sketch_slot)
+            throw std::logic_error("Descendant sketches are not enabled");
 
-    //Strong guarantee, becaus comaprison of ids can throw.
-    inline bool exists(typename Virus::id_type const &id) const {
-        return graph.contains(id);
+        return aggregate(aggregate_handle<genealogy_hll>(*descendant_sketch_slot),
+                         id).estimate();
     }
 
-    //Strong guarantee - does not modify anything, ctor of Virus
-    //can throw exception, as well as comparison of Virus (used in find()).
-    inline const Virus &operator[](typename Virus::id_type const &id) const {
-        auto result = graph.find(id);
-        if (result != graph.end()) {
-            virus_set.insert(Virus(result->second.virus));
-            return *virus_set.find(result->second.virus);
-        } else
-            throw VirusNotFound();
-    }
+    //Strong guarantee. From now on keeps a MinHash signature of the lineage
+    //- the virus and its ancestors - of every virus, taken from its parents
+    //on create and passed down on connect, and indexes viruses by bands of
+    //them for most_similar_lineages. Throws std::invalid_argument if the
+    //genealogy has a cycle.
+    inline void enable_lineage_signatures()
+    requires genealogy_hashable<typename Virus::id_type> {
+        if (lineages)
+            return;
 
+        auto signatures = dynamic_program<genealogy_minhash>(
+                genealogy_direction::top_down, genealogy_seq,
+                [](typename Virus::id_type const &id, auto const &parents) {
+                    auto result = lineage_index::own(id);
+                    for (auto &parent : parents)
+                        result.merge(parent);
+                    return result;
+                });
+
+        lineage_index index;
+        index.signatures.resize(table.size());
+        auto it = graph.begin();
+        for (auto &[id, signature] : signatures) {
+            index.signatures[(it++)->second.index] = signature;
+            for (std::size_t band = 0; band < genealogy_minhash::bands; ++band)
+                index.buckets.emplace(signature.band(band), id);
+        }
+        lineages.emplace(std::move(index));
+    }
 
-    //This is strong guarantee, because only operation on original is strong
-    //guarantee, and if any operation fails after it, rollback in nothrow way is
-    //performed.
-    inline void create(typename Virus::id_type const &id,
-                       typename Virus::id_type const &parent_id) {
-        if (exists(id))
-            throw VirusAlreadyCreated();
+    //Strong guarantee. Estimated Jaccard similarity of the lineages of both
+    //viruses, within about 0.125. Needs enable_lineage_signatures() first.
+    inline double lineage_similarity(typename Virus::id_type const &a_id,
+                                     typename Virus::id_type const &b_id) const {
+        if (!lineages)
+            throw std::logic_error("Lineage signatures are not enabled");
 
-        if (!exists(parent_id))
+        auto a = graph.find(a_id), b = graph.find(b_id);
+        if (a == graph.end() || b == graph.end())
             throw VirusNotFound();
 
-        parents_t parents;
-        parents.insert(graph.find(parent_id)->second.virus);
-
-        auto it_inserted = graph.insert(graph.end(), {id,
-                                                      Node(children_t(),
-                                                           parents, id)});
+        return lineages->signatures[a->second.index].similarity(
+                lineages->signatures[b->second.index]);
+    }
 
-        try {
-            auto it_parent = graph.find(parent_id);
-            auto child_vector_cp = it_parent->second.children;
-            child_vector_cp.insert(it_inserted->second.virus);
+    //Strong guarantee. Up to limit other viruses with the most similar
+    //lineages, most similar first, with their estimated similarity. Only
+    //viruses sharing a band of the signature are considered, which those
+    //at least about 50% similar most likely do, and of each band at most
+    //bucket_scan_limit, the first by id, so that descendants of a hub
+    //sharing its band are not all scanned.
+    inline std::vector<std::pair<typename Virus::id_type, double>>
+    most_similar_lineages(typename Virus::id_type const &id,
+                          std::size_t limit) const {
+        if (!lineages)
+            throw std::logic_error("Lineage signatures are not enabled");
+
+        auto it = graph.find(id);
+        if (it == graph.end())
+            throw VirusNotFound();
 
-            //Nothrow.
-            std::swap(it_parent->second.children, child_vector_cp);
+        auto const &signature = lineages->signatures[it->second.index];
+        std::unordered_set<typename Virus::id_type> seen{id};
+        std::vector<std::pair<typename Virus::id_type, double>> result;
+        for (std::size_t band = 0; band < genealogy_minhash::bands; ++band) {
+            auto [candidate, end] =
+                    lineages->buckets.equal_range(signature.band(band));
+            for (std::size_t scanned = 0;
+                 candidate != end &&
+                 scanned < lineage_index::bucket_scan_limit;
+                 ++candidate, ++scanned)
+                if (seen.insert(candidate->second).second)
+                    result.emplace_back(
+                            candidate->second,
+                            signature.similarity(lineages->signatures[
+                                    graph.find(candidate->second)->second.index]));
         }
-        catch (...) {
-            //If something above threw, that means I have to only erase what
-            //has been added to graph -
-            //fortunately erase is nothrow if iterator is known.
-            graph.erase(it_inserted);
 
-            throw;
-        }
+        auto more_similar = [](auto const &a, auto const &b) {
+            return a.second > b.second ||
+                   (a.second == b.second && a.first < b.first);
+        };
+        if (result.size() > limit) {
+            std::partial_sort(result.begin(), result.begin() + limit,
+                              result.end(), more_similar);
+            result.resize(limit);
+        } else
+            std::sort(result.begin(), result.end(), more_similar);
+        return result;
     }
 
-    //The same technic as above, only we need to remember changes in some way,
-    //so they are saved in list because it has many nothrow operations.
-    inline void create(typename Virus::id_type const &id,
-                       std::vector<typename Virus::id_type> const &parent_ids) {
-        if (exists(id))
-            throw VirusAlreadyCreated();
+    //Strong guarantee. Whether parent_id is a parent of child_id, after
+    //finding the child it is O(1) for hashable ids. Throws VirusNotFound if
+    //the child does not exist.
+    inline bool has_edge(typename Virus::id_type const &child_id,
+                         typename Virus::id_type const &parent_id) const {
+        auto it = graph.find(child_id);
+        if (it == graph.end())
+            throw VirusNotFound();
 
-        for (auto &parent_id: parent_ids)
-            if (!exists(parent_id)) {
-                throw VirusNotFound();
-            }
+        return it->second.parents.contains(parent_id);
+    }
 
-        if (parent_ids.size() == 0)
-            return;
+    //Weight of every edge which has not been given one.
+    static constexpr double default_edge_weight = 1;
+
+    //Strong guarantee. Gives the edge from parent_id to child_id a weight,
+    //e.g. the mutation distance between them. Throws VirusNotFound if the
+    //child does not exist and std::invalid_argument if the edge does not.
+    //Weights are not part of the topology, so not of snapshots either;
+    //DurableVirusGenealogy logs them.
+    inline void set_edge_weight(typename Virus::id_type const &child_id,
+                                typename Virus::id_type const &parent_id,
+                                double weight) {
+        if (!has_edge(child_id, parent_id))
+            throw std::invalid_argument("No such edge");
+
+        auto &weights = graph.find(child_id)->second.weights;
+        auto weights_cp = weights;
+        auto it = find_weight(weights_cp, parent_id);
+        if (it != weights_cp.end() && !(parent_id < it->first))
+            it->second = weight;
+        else
+            weights_cp.emplace(it, parent_id, weight);
+
+        //Nothrow.
+        std::swap(weights, weights_cp);
+    }
 
-        parents_t parents(create_virus_set(parent_ids));
+    //Strong guarantee. Throws like set_edge_weight().
+    inline double edge_weight(typename Virus::id_type const &child_id,
+                              typename Virus::id_type const &parent_id) const {
+        if (!has_edge(child_id, parent_id))
+            throw std::invalid_argument("No such edge");
 
-        auto it_inserted = graph.insert(graph.end(),
-                                        {id,
-                                         {children_t(), parents, id}});
+        return weight_of(graph.find(child_id)->second, parent_id);
+    }
 
-        std::list<children_t> sets_to_swap;
-        std::list<typename graph_t::iterator> its_to_originals;
+    //Strong guarantee. Every edge given a weight - its child, its parent
+    //and the weight - in no particular order, in O(n + weighted edges).
+    inline std::vector<std::tuple<typename Virus::id_type,
+                                  typename Virus::id_type, double>>
+    edge_weights() const {
+        std::vector<std::tuple<typename Virus::id_type,
+                               typename Virus::id_type, double>> result;
+        for (auto node : table)
+            for (auto &[parent, weight] : node->weights)
+                result.emplace_back(node->virus, parent, weight);
+        return result;
+    }
 
-        try {
-            for (auto &parent : parent_ids) {
-                auto it_parent = graph.find(parent);
-                auto child_vector_cp = it_parent->second.children;
-                child_vector_cp.insert(it_inserted->second.virus);
+    //Strong guarantee. The lightest path of edges from the stem to the
+    //virus and its weight. Only ancestors of the virus are looked at, each
+    //once, relaxing its edges in topological order - which also allows
+    //negative weights. Throws std::invalid_argument if the virus lies on or
+    //below a cycle.
+    inline std::pair<std::vector<typename Virus::id_type>, double>
+    weighted_lineage(typename Virus::id_type const &id) const {
+        auto it = graph.find(id);
+        if (it == graph.end())
+            throw VirusNotFound();
 
-                sets_to_swap.push_back(child_vector_cp);
-                its_to_originals.push_back(it_parent);
+        constexpr auto none = static_cast<std::size_t>(-1);
+        auto ancestors = ancestor_indexes({it->second.index});
+        std::vector<std::size_t> position(table.size(), none);
+        for (std::size_t i = 0; i < ancestors.size(); ++i)
+            position[ancestors[i]] = i;
+
+        //Parents of ancestors are ancestors too.
+        std::vector<std::size_t> pending(ancestors.size());
+        std::vector<std::size_t> ready;
+        for (std::size_t i = 0; i < ancestors.size(); ++i) {
+            pending[i] = table[ancestors[i]]->parents.size();
+            if (pending[i] == 0)
+                ready.push_back(i);
+        }
 
-                //If nothing failed, that means two lists have been created -
-                //lists of modified sets and its to originals.
+        std::vector<double> distance(ancestors.size(), 0);
+        std::vector<std::size_t> via(ancestors.size(), none);
+        while (!ready.empty()) {
+            auto i = ready.back();
+            ready.pop_back();
+            auto &node = *table[ancestors[i]];
+            for (auto &parent : node.parents) {
+                auto j = position[graph.find(parent)->second.index];
+                auto through = distance[j] + weight_of(node, parent);
+                if (via[i] == none || through < distance[i]) {
+                    distance[i] = through;
+                    via[i] = j;
+                }
             }
-        }
-        catch (...) {
-            //If something above threw, that means I have to only erase what I
-            //have added to graph - fortunately erase is nothrow if iterator
-            //is known (getting iterator can throw).
-            graph.erase(it_inserted);
 
-            throw;
+            for (auto &child : node.children) {
+                auto j = position[graph.find(child)->second.index];
+                if (j != none && --pending[j] == 0)
+                    ready.push_back(j);
+            }
         }
 
-        //All below is nothrow because std::swap is, pop(), back() also.
-        //operations on iterator are most likely unsafe on exceptions,
-        //hence decision to use std::list has been made.
-        while (!sets_to_swap.empty()) {
-            std::swap(sets_to_swap.back(),
-                      its_to_originals.back()->second.children);
+        //The virus itself is at position 0 and done last, if at all.
+        if (pending[0] != 0)
+            throw std::invalid_argument("Genealogy has a cycle");
 
-            sets_to_swap.pop_back();
-            its_to_originals.pop_back();
-        }
+        std::vector<typename Virus::id_type> path;
+        for (std::size_t i = 0; i != none; i = via[i])
+            path.push_back(table[ancestors[i]]->virus);
+        std::reverse(path.begin(), path.end());
+        return {std::move(path), distance[0]};
     }
 
-    inline typename Virus::id_type get_stem_id() const {
-        return stem_id;
+    //This is strong guarantee.
+    inline std::vector<typename Virus::id_type>
+    get_children(typename Virus::id_type const &id) const {
+        auto it = graph.find(id);
+        if (it == graph.end())
+            throw VirusNotFound();
+
+        return std::vector<typename Virus::id_type>(
+                it->second.children.begin(), it->second.children.end());
     }
 
-    //This is strong guarantee.
+    //Strong guarantee. Up to limit children following cursor in increasing
+    //order, from the first child without one; the last of them is the cursor
+    //of the next page. O(log k + limit) for k children.
     inline std::vector<typename Virus::id_type>
-    get_parents(typename Virus::id_type const &id) const {
-        if (!exists(id))
+    children_page(typename Virus::id_type const &id,
+                  std::optional<typename Virus::id_type> const &cursor,
+                  std::size_t limit) const {
+        auto it = graph.find(id);
+        if (it == graph.end())
             throw VirusNotFound();
 
-        std::vector<typename Virus::id_type> result;
-        parents_t set_of_parents = graph.at(id).parents;
+        auto &children = it->second.children;
+        auto child = cursor ? children.upper_bound(*cursor) : children.begin();
 
-        for (auto &parent : set_of_parents)
-            result.push_back(parent);
+        std::vector<typename Virus::id_type> result;
+        for (; child != children.end() && result.size() < limit; ++child)
+            result.push_back(*child);
 
         return result;
     }
 
-    //Strong guarantee, by working on copies and performing nothrow swaps later.
+    //Strong guarantee - the edge goes into both live adjacency sets, each
+    //insertion strong, and out of the first again if the second one throws,
+    //so that connecting into a hub does not copy its sets.
     inline void connect(typename Virus::id_type const &child_id,
                         typename Virus::id_type const &parent_id) {
         if (!exists(child_id) || !exists(parent_id))
@@ -296,59 +2791,322 @@ public:
 
         //The task does not allow multiverticies.
         if (!(child_node->second.parents.contains(parent_id))) {
-            auto child_parents_cp = child_node->second.parents;
-            auto parent_children_cp = parent_node->second.children;
+            //Every virus in a tree already has its only parent, apart from
+            //the stem, which would close a cycle.
+            if (is_tree())
+                throw TriedToAddSecondParent();
+
+            auto &child_parents = child_node->second.parents;
+            auto &parent_children = parent_node->second.children;
+            degrees.reserve(parent_children.size() + 1);
+
+            aggregate_stage stage(aggregates, lineages);
+            if (!aggregates.empty())
+                stage_refolded(ancestor_indexes({parent_node->second.index}),
+                               nullptr, std::pair{parent_node->second.index,
+                                                  child_node->second.index});
+            if (lineages)
+                stage_lineage_joined(parent_node->second.index,
+                                     child_node->second.index);
 
             //We have to tell child that it has new parent,
             //and we have to tell parent that it has new child.
-            child_parents_cp.insert(parent_node->second.virus);
-            parent_children_cp.insert(child_node->second.virus);
+            child_parents.insert(parent_node->second.virus);
+            try {
+                parent_children.insert(child_node->second.virus);
+            }
+            catch (...) {
+                child_parents.erase(parent_node->second.virus);
+                throw;
+            }
 
             //Nothrow.
-            std::swap(child_node->second.parents, child_parents_cp);
-            std::swap(parent_node->second.children, parent_children_cp);
+            degrees.increment(parent_node->second, parent_children.size() - 1);
+            stage.commit();
+            ++edges;
         }
     }
 
-    //Strong guarantee, because all operations are performed on copies.
-    inline graph_t
-    remove_helper(graph_t copied_graph, typename Virus::id_type const &id) {
-        auto children_set_copy = copied_graph.at(id).children;
+    //This is strong guarantee - everything that can throw is done aside
+    //before the first modification, then only nothrow swaps and erases are
+    //performed. Edges of surviving viruses are erased one by one, so their
+    //adjacency sets are never copied, however big. Every removed virus is
+    //visited, so removing k viruses costs O(k log n) even in tree mode.
+    inline void remove(typename Virus::id_type const &id) {
+        if (!exists(id))
+            throw VirusNotFound();
+
+        if (id == stem_id)
+            throw TriedToRemoveStemVirus();
+
+        auto removed = collect_removed(id);
+
+        //Where removed viruses are in adjacency sets of surviving ones. They
+        //are erased from there only at the end, by iterator from children
+        //and by id from parents, both nothrow, so the set of a hub is never
+        //copied.
+        std::map<typename Virus::id_type,
+                 std::pair<typename graph_t::iterator,
+                           std::vector<typename children_t::iterator>>>
+                children_to_erase;
+        std::map<typename Virus::id_type,
+                 std::pair<typename graph_t::iterator,
+                           std::vector<typename Virus::id_type const *>>>
+                parents_to_erase;
+        std::vector<typename graph_t::iterator> its_to_erase;
+        its_to_erase.reserve(removed.size());
+        //Edges into removed viruses and from them to surviving ones.
+        std::size_t removed_edges = 0;
+
+        for (auto &removed_id : removed) {
+            auto it_removed = graph.find(removed_id);
+            its_to_erase.push_back(it_removed);
+            removed_edges += it_removed->second.parents.size();
+
+            for (auto &parent : it_removed->second.parents) {
+                if (removed.contains(parent))
+                    continue;
+
+                auto entry = children_to_erase.find(parent);
+                if (entry == children_to_erase.end())
+                    entry = children_to_erase.insert(
+                            {parent, {graph.find(parent), {}}}).first;
+                entry->second.second.push_back(
+                        entry->second.first->second.children.find(removed_id));
+            }
+
+            for (auto &child : it_removed->second.children) {
+                if (removed.contains(child))
+                    continue;
+                ++removed_edges;
+
+                auto entry = parents_to_erase.find(child);
+                if (entry == parents_to_erase.end())
+                    entry = parents_to_erase.insert(
+                            {child, {graph.find(child), {}}}).first;
+                entry->second.second.push_back(&it_removed->first);
+            }
+        }
+
+        //Surviving children forget weights of edges from removed parents.
+        std::vector<std::pair<typename graph_t::iterator, weights_t>>
+                weights_to_swap;
+        for (auto &[child, entry] : parents_to_erase) {
+            auto &weights = entry.first->second.weights;
+            if (std::none_of(weights.begin(), weights.end(),
+                             [&](auto const &weight) {
+                                 return removed.contains(weight.first);
+                             }))
+                continue;
+
+            weights_t kept(weights.get_allocator());
+            for (auto &weight : weights)
+                if (!removed.contains(weight.first))
+                    kept.push_back(weight);
+            weights_to_swap.emplace_back(entry.first, std::move(kept));
+        }
+
+        //Ancestors of removed viruses lose descendants, their aggregates are
+        //folded anew without them. Descendants lose ancestors.
+        aggregate_stage stage(aggregates, lineages);
+        if (!aggregates.empty() || lineages) {
+            std::vector<bool> skipped(table.size(), false);
+            for (auto &it : its_to_erase)
+                skipped[it->second.index] = true;
+
+            if (!aggregates.empty()) {
+                std::vector<std::size_t> parents;
+                for (auto &[parent, entry] : children_to_erase)
+                    parents.push_back(entry.first->second.index);
+                //In a tree the removed subtree is what every ancestor loses.
+                std::optional<std::size_t> lost;
+                if (is_tree())
+                    lost = graph.find(id)->second.index;
+                stage_refolded(ancestor_indexes(parents, &skipped), &skipped,
+                               std::nullopt, lost);
+            }
+            if (lineages) {
+                std::vector<std::size_t> children;
+                for (auto &[child, entry] : parents_to_erase)
+                    children.push_back(entry.first->second.index);
+                stage_lineage_cut(children, skipped);
+            }
+        }
+
+        //All below is nothrow.
+        if (is_tree())
+            tour.erase(graph.find(id)->second.tokens);
 
-        auto it = copied_graph.at(id).parents.begin();
-        while (it != copied_graph.at(id).parents.end()) {
-            copied_graph.at((*it)).children.erase(graph.at(id).virus);
-            it++;
+        for (auto &[parent, entry] : children_to_erase) {
+            auto &parent_node = entry.first->second;
+            for (auto &it_child : entry.second) {
+                degrees.decrement(parent_node, parent_node.children.size());
+                parent_node.children.erase(it_child);
+            }
+        }
+
+        for (auto &[child, entry] : parents_to_erase)
+            for (auto removed_parent : entry.second)
+                entry.first->second.parents.erase(*removed_parent);
+
+        for (auto &[it_child, weights] : weights_to_swap)
+            std::swap(it_child->second.weights, weights);
+
+        //Staged values refer to indexes from before the table shrinks.
+        stage.commit();
+        for (auto &it : its_to_erase) {
+            for (auto &aggregate : aggregates)
+                aggregate->erase(it->second.index);
+            if (lineages)
+                lineages->erase(it->second.index, it->first);
+            degrees.erase(it->second);
+            forget_creation(it->second);
+            remove_from_table(it->second);
+            graph.erase(it);
         }
+        squeeze_creations();
+        edges -= removed_edges;
+    }
+
+    //Strong guarantee - the new layout is built aside and swapped in.
+    //Nodes and their adjacency sets are allocated anew in traversal order
+    //from the stem, so that later scans of descendants mostly walk memory
+    //forward instead of jumping around in the original allocation order.
+    inline void reorder(traversal_order order = traversal_order::bfs) {
+        std::vector<typename graph_t::iterator> layout;
+        layout.reserve(graph.size());
+
+        std::set<typename Virus::id_type> visited;
+        std::deque<typename graph_t::iterator> to_visit{graph.find(stem_id)};
+
+        while (!to_visit.empty()) {
+            typename graph_t::iterator it;
+            if (order == traversal_order::bfs) {
+                it = to_visit.front();
+                to_visit.pop_front();
+            } else {
+                it = to_visit.back();
+                to_visit.pop_back();
+            }
+
+            if (!visited.insert(it->first).second)
+                continue;
+            layout.push_back(it);
 
-        it = children_set_copy.begin();
-        while (it != children_set_copy.end()) {
-            if (copied_graph.at(*it).parents.size() == 1) {
-                auto tmp = remove_helper(copied_graph, *it);
-                swap(copied_graph, tmp);
+            auto &children = it->second.children;
+            if (order == traversal_order::bfs) {
+                for (auto child = children.begin(); child != children.end();
+                     ++child)
+                    if (!visited.contains(*child))
+                        to_visit.push_back(graph.find(*child));
             } else {
-                copied_graph.at((*it)).parents.erase(
-                        graph.at(id).virus);
+                //Reversed, so that children are visited in their order.
+                for (auto child = children.rbegin(); child != children.rend();
+                     ++child)
+                    if (!visited.contains(*child))
+                        to_visit.push_back(graph.find(*child));
             }
-            ++it;
         }
-        copied_graph.erase(id);
-        return copied_graph;
+
+        //Only a cycle through the stem can leave anything unreachable.
+        for (auto it = graph.begin(); it != graph.end(); ++it)
+            if (!visited.contains(it->first))
+                layout.push_back(it);
+
+        graph_t relaid(allocator);
+        table_t relaid_table(allocator);
+        relaid_table.reserve(layout.size());
+        std::vector<std::size_t> old_indexes;
+        old_indexes.reserve(layout.size());
+        for (auto &it : layout) {
+            old_indexes.push_back(it->second.index);
+            auto &node = relaid.insert(*it).first->second;
+            node.index = relaid_table.size();
+            relaid_table.push_back(&node);
+        }
+
+        std::vector<std::unique_ptr<aggregate_base>> relaid_aggregates;
+        for (auto &aggregate : aggregates)
+            relaid_aggregates.push_back(aggregate->permuted(old_indexes));
+
+        degree_index relaid_degrees(allocator);
+        relaid_degrees.rebuild(relaid_table);
+        auto relaid_creations = creations_of(relaid_table);
+
+        std::vector<genealogy_minhash> relaid_signatures;
+        if (lineages) {
+            relaid_signatures.reserve(old_indexes.size());
+            for (auto index : old_indexes)
+                relaid_signatures.push_back(lineages->signatures[index]);
+        }
+
+        std::swap(graph, relaid);
+        std::swap(table, relaid_table);
+        std::swap(aggregates, relaid_aggregates);
+        std::swap(degrees, relaid_degrees);
+        std::swap(creations, relaid_creations);
+        removed_creations = 0;
+        if (lineages)
+            std::swap(lineages->signatures, relaid_signatures);
     }
 
-    //This is strong guarantee, because all of the work is done on copy and swap
-    //is performed later. It cannot be done without copying, because nothrow
-    //rollback is not possible.
-    inline void remove(typename Virus::id_type const &id) {
+    //Strong guarantee - describes the genealogy for saving it elsewhere.
+    inline genealogy_topology<typename Virus::id_type> topology() const {
+        genealogy_topology<typename Virus::id_type> result;
+        result.mode = mode;
+        result.ids.reserve(graph.size());
+        result.parent_offsets.reserve(graph.size() + 1);
+        result.created.reserve(graph.size());
+
+        for (auto &[id, node] : graph) {
+            result.ids.push_back(id);
+            result.created.push_back(node.created);
+        }
+
+        auto index_of = [&](typename Virus::id_type const &id) {
+            return static_cast<std::size_t>(
+                    std::lower_bound(result.ids.begin(), result.ids.end(), id) -
+                    result.ids.begin());
+        };
+
+        result.stem = index_of(stem_id);
+        for (auto &[id, node] : graph) {
+            for (auto &parent : node.parents)
+                result.parent_indexes.push_back(index_of(parent));
+            result.parent_offsets.push_back(result.parent_indexes.size());
+        }
+
+        return result;
+    }
+
+    inline genealogy_mode get_mode() const noexcept {
+        return mode;
+    }
+
+    //Strong guarantee. O(log n) in tree mode, in dag mode descendants of
+    //root_id are traversed.
+    inline bool in_subtree(typename Virus::id_type const &id,
+                           typename Virus::id_type const &root_id) const {
+        if (!exists(id) || !exists(root_id))
+            throw VirusNotFound();
+
+        if (is_tree())
+            return tour.contains(graph.find(root_id)->second.tokens,
+                                 graph.find(id)->second.tokens);
+
+        return collect_descendants(root_id).contains(id);
+    }
+
+    //Strong guarantee. Counts the virus with all of its descendants, O(log n)
+    //in tree mode.
+    inline std::size_t subtree_size(typename Virus::id_type const &id) const {
         if (!exists(id))
             throw VirusNotFound();
 
-        if (id == stem_id)
-            throw TriedToRemoveStemVirus();
+        if (is_tree())
+            return tour.size(graph.find(id)->second.tokens);
 
-        auto copied_graph = graph;
-        auto tmp = remove_helper(copied_graph, id);
-        std::swap(graph, tmp);
+        return collect_descendants(id).size();
     }
 };
 
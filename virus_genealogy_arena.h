@@ -0,0 +1,290 @@
+#ifndef _VIRUS_GENEALOGY_ARENA_
+#define _VIRUS_GENEALOGY_ARENA_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//How memory of the arena is backed. Huge pages cut TLB misses of big
+//genealogies - transparent ones are only advised to the kernel, explicit
+//ones come from the hugetlbfs pool and fall back to transparent when the pool
+//is empty.
+enum class page_backing {
+    normal,
+    transparent_huge,
+    explicit_huge
+};
+
+//Arena serving nodes of maps and sets of a genealogy. Memory is taken from
+//the system in big chunks, optionally on huge pages and bound to a single
+//NUMA node, and carved into size classes with free lists, so that nodes of
+//one genealogy stay close together. Blocks up to max_small come in steps of
+//granularity; bigger ones, like bucket arrays and vectors, in powers of two
+//up to max_medium, carved from the same chunks and aligned to their size (up
+//to a page) so that any alignment up to that fits. Both are reused through
+//free lists. Blocks bigger still get a mapping of their own, unmapped again
+//on deallocation.
+class genealogy_arena {
+private:
+    static constexpr std::size_t granularity = 16;
+    static constexpr std::size_t size_classes = 32;
+    static constexpr std::size_t max_small = granularity * size_classes;
+    static constexpr std::size_t page_size = 4096;
+    static constexpr std::size_t huge_page_size = std::size_t(2) << 20;
+    static constexpr std::size_t min_medium = 2 * max_small;
+    static constexpr std::size_t max_medium = huge_page_size / 2;
+    static constexpr std::size_t medium_classes = 11;
+    static_assert(min_medium << (medium_classes - 1) == max_medium);
+
+    page_backing backing;
+    int numa_node;
+    std::size_t chunk_size;
+
+    std::mutex mutex;
+    std::array<void *, size_classes> free_lists{};
+    std::array<void *, medium_classes> medium_free_lists{};
+    std::vector<std::pair<void *, std::size_t>> chunks;
+    //Blocks with a mapping of their own, in no particular order.
+    std::vector<std::pair<void *, std::size_t>> big_blocks;
+    std::byte *bump = nullptr;
+    std::byte *bump_end = nullptr;
+    std::size_t mapped = 0;
+
+    static inline std::size_t round_up(std::size_t n, std::size_t to) noexcept {
+        return (n + to - 1) / to * to;
+    }
+
+    inline void *map(std::size_t bytes) {
+#ifdef __linux__
+        void *result = MAP_FAILED;
+        if (backing == page_backing::explicit_huge)
+            result = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (result == MAP_FAILED)
+            result = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (result == MAP_FAILED)
+            throw std::bad_alloc();
+
+#ifdef MADV_HUGEPAGE
+        if (backing != page_backing::normal)
+            madvise(result, bytes, MADV_HUGEPAGE);
+#endif
+#ifdef SYS_mbind
+        //MPOL_PREFERRED, so that a full node spills over instead of failing.
+        if (numa_node >= 0) {
+            unsigned long mask[16]{};
+            auto bits = 8 * sizeof(unsigned long);
+            if (static_cast<std::size_t>(numa_node) < 16 * bits) {
+                mask[numa_node / bits] |= 1ul << (numa_node % bits);
+                syscall(SYS_mbind, result, bytes, 1, mask, 16 * bits, 0);
+            }
+        }
+#endif
+        return result;
+#else
+        return ::operator new(bytes, std::align_val_t(huge_page_size));
+#endif
+    }
+
+    static inline void unmap(void *p, std::size_t bytes) noexcept {
+#ifdef __linux__
+        munmap(p, bytes);
+#else
+        ::operator delete(p, bytes, std::align_val_t(huge_page_size));
+#endif
+    }
+
+    //Strong guarantee - a mapping is given back if it cannot be recorded.
+    inline void *map_recorded(
+            std::vector<std::pair<void *, std::size_t>> &records,
+            std::size_t bytes) {
+        records.reserve(records.size() + 1);
+        auto result = map(bytes);
+        records.emplace_back(result, bytes);
+        mapped += bytes;
+        return result;
+    }
+
+    //Size class of a block above max_small or aligned above granularity,
+    //medium_classes if it is too big for any.
+    static inline std::size_t medium_class(std::size_t bytes,
+                                           std::size_t alignment) noexcept {
+        bytes = std::max({bytes, alignment, min_medium});
+        std::size_t result = 0;
+        for (auto size = min_medium; size < bytes && result < medium_classes;
+             size *= 2)
+            ++result;
+        return result;
+    }
+
+    //Size of a block with a mapping of its own - pages, huge ones once it
+    //takes at least one.
+    static inline std::size_t big_size(std::size_t bytes) noexcept {
+        return round_up(bytes, bytes >= huge_page_size ? huge_page_size
+                                                       : page_size);
+    }
+
+    inline void *carve(std::size_t bytes, std::size_t alignment) {
+        auto offset = reinterpret_cast<std::uintptr_t>(bump) % alignment;
+        auto padding = offset ? alignment - offset : 0;
+        if (bump_end - bump < static_cast<std::ptrdiff_t>(padding + bytes)) {
+            bump = static_cast<std::byte *>(map_recorded(chunks, chunk_size));
+            bump_end = bump + chunk_size;
+            padding = 0;
+        }
+
+        auto result = bump + padding;
+        bump = result + bytes;
+        return result;
+    }
+
+public:
+    inline explicit genealogy_arena(
+            page_backing backing = page_backing::transparent_huge,
+            int numa_node = -1, std::size_t chunk_size = huge_page_size)
+            : backing(backing), numa_node(numa_node),
+              chunk_size(round_up(chunk_size, huge_page_size)) {}
+
+    inline genealogy_arena(const genealogy_arena &) = delete;
+
+    inline genealogy_arena &operator=(const genealogy_arena &) = delete;
+
+    inline ~genealogy_arena() {
+        release();
+    }
+
+    //Alignment may be at most a page.
+    inline void *allocate(std::size_t bytes, std::size_t alignment) {
+        if (alignment > page_size)
+            throw std::bad_alloc();
+        bytes = round_up(bytes == 0 ? 1 : bytes, granularity);
+        std::lock_guard lock(mutex);
+
+        void **free_list;
+        if (bytes <= max_small && alignment <= granularity) {
+            free_list = &free_lists[bytes / granularity - 1];
+            alignment = granularity;
+        } else {
+            auto size_class = medium_class(bytes, alignment);
+            if (size_class == medium_classes)
+                return map_recorded(big_blocks, big_size(bytes));
+
+            free_list = &medium_free_lists[size_class];
+            bytes = min_medium << size_class;
+            alignment = std::min(bytes, page_size);
+        }
+
+        if (*free_list) {
+            auto result = *free_list;
+            *free_list = *static_cast<void **>(result);
+            return result;
+        }
+        return carve(bytes, alignment);
+    }
+
+    inline void deallocate(void *p, std::size_t bytes,
+                           std::size_t alignment) noexcept {
+        bytes = round_up(bytes == 0 ? 1 : bytes, granularity);
+        std::lock_guard lock(mutex);
+
+        void **free_list;
+        if (bytes <= max_small && alignment <= granularity)
+            free_list = &free_lists[bytes / granularity - 1];
+        else {
+            auto size_class = medium_class(bytes, alignment);
+            if (size_class == medium_classes) {
+                auto it = std::find_if(big_blocks.begin(), big_blocks.end(),
+                                       [p](auto const &block) {
+                                           return block.first == p;
+                                       });
+                unmap(p, it->second);
+                mapped -= it->second;
+                *it = big_blocks.back();
+                big_blocks.pop_back();
+                return;
+            }
+            free_list = &medium_free_lists[size_class];
+        }
+
+        *static_cast<void **>(p) = *free_list;
+        *free_list = p;
+    }
+
+    //Gives all memory back to the system at once. Containers using the arena
+    //must not be touched afterwards, not even destroyed.
+    inline void release() noexcept {
+        std::lock_guard lock(mutex);
+
+        for (auto &[p, bytes] : chunks)
+            unmap(p, bytes);
+        for (auto &[p, bytes] : big_blocks)
+            unmap(p, bytes);
+
+        chunks.clear();
+        big_blocks.clear();
+        free_lists.fill(nullptr);
+        medium_free_lists.fill(nullptr);
+        bump = bump_end = nullptr;
+        mapped = 0;
+    }
+
+    inline std::size_t mapped_bytes() noexcept {
+        std::lock_guard lock(mutex);
+        return mapped;
+    }
+
+    inline int get_numa_node() const noexcept {
+        return numa_node;
+    }
+
+    inline page_backing get_backing() const noexcept {
+        return backing;
+    }
+};
+
+//Allocator handing out memory of a genealogy_arena. Copies share the arena,
+//so adjacency sets copied and swapped by the genealogy stay in it.
+template<typename T>
+class arena_allocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    genealogy_arena *arena;
+
+    inline arena_allocator(genealogy_arena &arena) noexcept : arena(&arena) {}
+
+    template<typename U>
+    inline arena_allocator(const arena_allocator<U> &other) noexcept
+            : arena(other.arena) {}
+
+    inline T *allocate(std::size_t n) {
+        return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    inline void deallocate(T *p, std::size_t n) noexcept {
+        arena->deallocate(p, n * sizeof(T), alignof(T));
+    }
+
+    template<typename U>
+    inline bool operator==(const arena_allocator<U> &other) const noexcept {
+        return arena == other.arena;
+    }
+};
+
+#endif
@@ -0,0 +1,444 @@
+#ifndef _VIRUS_GENEALOGY_ASYNC_IO_
+#define _VIRUS_GENEALOGY_ASYNC_IO_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define VIRUS_GENEALOGY_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+//Background writer for snapshots and logs. Callers only queue requests and
+//get futures, a dedicated thread submits them to io_uring, keeping many of
+//them in flight, or - where io_uring is not available or not wanted - does
+//them itself with pwrite and fdatasync.
+//
+//Writes of one file may complete in any order, a sync waits for all writes
+//queued before it - it is only submitted once they are all done.
+class genealogy_async_io {
+private:
+    struct request {
+        bool sync;
+        int fd;
+        std::uint64_t offset;
+        std::string data;
+        std::size_t done = 0;
+        std::promise<void> promise;
+    };
+
+#ifdef VIRUS_GENEALOGY_IO_URING
+    //Bare io_uring on top of the system calls, without liburing.
+    class ring {
+    private:
+        int fd = -1;
+        io_uring_params params{};
+        void *sq_map = MAP_FAILED;
+        void *cq_map = MAP_FAILED;
+        std::size_t sq_map_size = 0;
+        std::size_t cq_map_size = 0;
+        io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+        unsigned *sq_head = nullptr;
+        unsigned *sq_tail = nullptr;
+        unsigned *sq_mask = nullptr;
+        unsigned *sq_array = nullptr;
+        unsigned *cq_head = nullptr;
+        unsigned *cq_tail = nullptr;
+        unsigned *cq_mask = nullptr;
+        io_uring_cqe *cqes = nullptr;
+
+        template<typename T>
+        static inline T *at(void *base, std::uint32_t offset) noexcept {
+            return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+        }
+
+        //Kernels older than 5.6 set up a ring but know neither the probe
+        //nor IORING_OP_WRITE, later ones may have the operations disabled.
+        inline bool supports_operations() const noexcept {
+            constexpr unsigned probed_ops = 256;
+            alignas(io_uring_probe) unsigned char buffer[
+                    sizeof(io_uring_probe) +
+                    probed_ops * sizeof(io_uring_probe_op)]{};
+            auto probe = reinterpret_cast<io_uring_probe *>(buffer);
+            if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                        probe, probed_ops) < 0)
+                return false;
+
+            for (unsigned op : {IORING_OP_WRITE, IORING_OP_FSYNC})
+                if (op > probe->last_op ||
+                    !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                    return false;
+            return true;
+        }
+
+    public:
+        inline explicit ring(unsigned entries) {
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (fd < 0)
+                return;
+
+            sq_map_size = params.sq_off.array +
+                          params.sq_entries * sizeof(unsigned);
+            cq_map_size = params.cq_off.cqes +
+                          params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+                sq_map_size = cq_map_size =
+                        std::max(sq_map_size, cq_map_size);
+
+            sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (sq_map == MAP_FAILED) {
+                close();
+                return;
+            }
+
+            cq_map = params.features & IORING_FEAT_SINGLE_MMAP
+                     ? sq_map
+                     : mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_map == MAP_FAILED) {
+                close();
+                return;
+            }
+
+            sqes = static_cast<io_uring_sqe *>(
+                    mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe),
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQES));
+            if (sqes == MAP_FAILED) {
+                close();
+                return;
+            }
+
+            sq_head = at<unsigned>(sq_map, params.sq_off.head);
+            sq_tail = at<unsigned>(sq_map, params.sq_off.tail);
+            sq_mask = at<unsigned>(sq_map, params.sq_off.ring_mask);
+            sq_array = at<unsigned>(sq_map, params.sq_off.array);
+            cq_head = at<unsigned>(cq_map, params.cq_off.head);
+            cq_tail = at<unsigned>(cq_map, params.cq_off.tail);
+            cq_mask = at<unsigned>(cq_map, params.cq_off.ring_mask);
+            cqes = at<io_uring_cqe>(cq_map, params.cq_off.cqes);
+
+            if (!supports_operations())
+                close();
+        }
+
+        ring(const ring &) = delete;
+
+        ring &operator=(const ring &) = delete;
+
+        inline ~ring() {
+            close();
+        }
+
+        inline void close() noexcept {
+            if (sqes != MAP_FAILED)
+                munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+            if (cq_map != MAP_FAILED && cq_map != sq_map)
+                munmap(cq_map, cq_map_size);
+            if (sq_map != MAP_FAILED)
+                munmap(sq_map, sq_map_size);
+            if (fd >= 0)
+                ::close(fd);
+
+            sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+            sq_map = cq_map = MAP_FAILED;
+            fd = -1;
+        }
+
+        inline bool usable() const noexcept {
+            return fd >= 0;
+        }
+
+        inline unsigned capacity() const noexcept {
+            return params.sq_entries;
+        }
+
+        //Only the I/O thread touches the submission queue, and never puts
+        //more than capacity() requests in flight, so there is always room.
+        inline void push(request *r) noexcept {
+            auto tail = *sq_tail;
+            auto index = tail & *sq_mask;
+            auto &sqe = sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+
+            sqe.fd = r->fd;
+            sqe.user_data = reinterpret_cast<std::uint64_t>(r);
+            if (r->sync) {
+                sqe.opcode = IORING_OP_FSYNC;
+                sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+            } else {
+                sqe.opcode = IORING_OP_WRITE;
+                sqe.addr = reinterpret_cast<std::uint64_t>(r->data.data() +
+                                                           r->done);
+                sqe.len = static_cast<std::uint32_t>(r->data.size() - r->done);
+                sqe.off = r->offset + r->done;
+            }
+
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        }
+
+        inline int enter(unsigned submit, unsigned wait) noexcept {
+            int result;
+            do
+                result = static_cast<int>(syscall(
+                        __NR_io_uring_enter, fd, submit, wait,
+                        wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+            while (result < 0 && errno == EINTR);
+            return result;
+        }
+
+        //Calls on_retracted(request) for every request pushed but not taken
+        //by the kernel yet, in order, and takes them off the queue. Without
+        //SQPOLL the kernel only takes them in enter().
+        template<typename F>
+        inline void retract(F const &on_retracted) {
+            auto head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            auto tail = *sq_tail;
+            for (auto i = head; i != tail; ++i)
+                on_retracted(reinterpret_cast<request *>(
+                        sqes[sq_array[i & *sq_mask]].user_data));
+            __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+        }
+
+        //Calls on_complete(request, result) for every finished request.
+        template<typename F>
+        inline void reap(F const &on_complete) {
+            auto head = *cq_head;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                auto &cqe = cqes[head & *cq_mask];
+                on_complete(reinterpret_cast<request *>(cqe.user_data),
+                            cqe.res);
+                ++head;
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            }
+        }
+    };
+
+    std::unique_ptr<ring> uring;
+#endif
+
+    std::atomic<bool> uring_active = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::unique_ptr<request>> queued;
+    bool stopping = false;
+    std::thread worker;
+
+    static inline void fail(request &r, int error) {
+        r.promise.set_exception(std::make_exception_ptr(
+                std::system_error(error, std::generic_category(),
+                                  r.sync ? "fdatasync" : "pwrite")));
+    }
+
+    static inline void perform(request &r) {
+        if (r.sync) {
+            if (fdatasync(r.fd) < 0)
+                return fail(r, errno);
+            return r.promise.set_value();
+        }
+
+        while (r.done < r.data.size()) {
+            auto written = pwrite(r.fd, r.data.data() + r.done,
+                                  r.data.size() - r.done, r.offset + r.done);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                return fail(r, errno);
+            r.done += written;
+        }
+        r.promise.set_value();
+    }
+
+    //Takes queued requests, waiting for some unless busy is set. Returns
+    //false once stopped and drained.
+    inline bool take(std::deque<std::unique_ptr<request>> &into, bool busy,
+                     std::size_t limit) {
+        std::unique_lock lock(mutex);
+        if (!busy)
+            wake.wait(lock, [&] { return stopping || !queued.empty(); });
+
+        while (!queued.empty() && into.size() < limit) {
+            into.push_back(std::move(queued.front()));
+            queued.pop_front();
+        }
+        return !(stopping && queued.empty() && into.empty() && !busy);
+    }
+
+    inline void run_blocking() {
+        std::deque<std::unique_ptr<request>> batch;
+        while (take(batch, false, SIZE_MAX)) {
+            for (auto &r : batch)
+                perform(*r);
+            batch.clear();
+        }
+    }
+
+#ifdef VIRUS_GENEALOGY_IO_URING
+    inline void run_uring() {
+        std::deque<std::unique_ptr<request>> waiting;
+        std::size_t in_flight = 0;
+        std::unordered_map<request *, std::unique_ptr<request>> owned;
+
+        auto complete = [&](request *r, int result) {
+            --in_flight;
+            auto it = owned.find(r);
+            if (result < 0) {
+                fail(*r, -result);
+            } else if (!r->sync &&
+                       r->done + result < r->data.size()) {
+                //Short write, the rest goes in again - before any sync
+                //queued after it, see below.
+                r->done += result;
+                waiting.push_front(std::move(it->second));
+            } else
+                r->promise.set_value();
+            owned.erase(it);
+        };
+
+        while (take(waiting, in_flight > 0 || !waiting.empty(),
+                    uring->capacity() - in_flight) ||
+               !waiting.empty()) {
+            unsigned submitted = 0;
+            while (!waiting.empty() && in_flight < uring->capacity()) {
+                auto r = waiting.front().get();
+                //A sync goes in only once every write before it is done,
+                //with the rest of a short one, which may go in again.
+                if (r->sync && in_flight > 0)
+                    break;
+                owned[r] = std::move(waiting.front());
+                waiting.pop_front();
+                uring->push(r);
+                ++submitted;
+                ++in_flight;
+            }
+
+            if (uring->enter(submitted, in_flight ? 1 : 0) < 0) {
+                fall_back(waiting, owned, in_flight, complete);
+                return run_blocking();
+            }
+
+            uring->reap(complete);
+        }
+    }
+
+    //Finishes the plain way after the ring broke down. What the kernel has
+    //not taken yet is taken back, what it has is waited for, as it may
+    //still read the data. If even waiting fails, those requests are done
+    //again and their data is never freed.
+    template<typename Complete>
+    inline void fall_back(
+            std::deque<std::unique_ptr<request>> &waiting,
+            std::unordered_map<request *, std::unique_ptr<request>> &owned,
+            std::size_t &in_flight, Complete const &complete) {
+        std::deque<std::unique_ptr<request>> retracted;
+        uring->retract([&](request *r) {
+            auto it = owned.find(r);
+            retracted.push_back(std::move(it->second));
+            owned.erase(it);
+            --in_flight;
+        });
+        waiting.insert(waiting.begin(),
+                       std::make_move_iterator(retracted.begin()),
+                       std::make_move_iterator(retracted.end()));
+
+        uring->reap(complete);
+        while (in_flight > 0 && uring->enter(0, 1) >= 0)
+            uring->reap(complete);
+
+        uring_active = false;
+        for (auto &[r, request] : owned) {
+            perform(*request);
+            request.release();
+        }
+        owned.clear();
+        for (auto &request : waiting)
+            perform(*request);
+        waiting.clear();
+    }
+#endif
+
+    inline std::future<void> submit(std::unique_ptr<request> r) {
+        auto result = r->promise.get_future();
+        {
+            std::lock_guard lock(mutex);
+            queued.push_back(std::move(r));
+        }
+        wake.notify_one();
+        return result;
+    }
+
+public:
+    //With use_io_uring unset, or where the kernel refuses it or does not
+    //support the writes and syncs used, requests are done by the worker
+    //thread with plain system calls.
+    inline explicit genealogy_async_io(bool use_io_uring = true,
+                                       unsigned ring_entries = 64) {
+#ifdef VIRUS_GENEALOGY_IO_URING
+        if (use_io_uring) {
+            uring = std::make_unique<ring>(ring_entries);
+            if (!uring->usable())
+                uring.reset();
+        }
+        if (uring) {
+            uring_active = true;
+            worker = std::thread([this] { run_uring(); });
+            return;
+        }
+#else
+        (void) use_io_uring;
+        (void) ring_entries;
+#endif
+        worker = std::thread([this] { run_blocking(); });
+    }
+
+    genealogy_async_io(const genealogy_async_io &) = delete;
+
+    genealogy_async_io &operator=(const genealogy_async_io &) = delete;
+
+    //Finishes everything queued before returning.
+    inline ~genealogy_async_io() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    inline bool uses_io_uring() const noexcept {
+        return uring_active;
+    }
+
+    inline std::future<void> write(int fd, std::uint64_t offset,
+                                   std::string data) {
+        return submit(std::unique_ptr<request>(
+                new request{false, fd, offset, std::move(data), 0, {}}));
+    }
+
+    inline std::future<void> sync(int fd) {
+        return submit(std::unique_ptr<request>(
+                new request{true, fd, 0, {}, 0, {}}));
+    }
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef _VIRUS_GENEALOGY_CODEC_
+#define _VIRUS_GENEALOGY_CODEC_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+//Turns ids into bytes and back for everything that leaves memory - pages,
+//snapshots, logs and sockets. Specialize it for other id types.
+template<typename Id, typename = void>
+struct genealogy_id_codec;
+
+template<typename Id>
+struct genealogy_id_codec<Id, std::enable_if_t<std::is_arithmetic_v<Id>>> {
+    static inline void encode(Id const &id, std::string &out) {
+        char bytes[sizeof(Id)];
+        std::memcpy(bytes, &id, sizeof(Id));
+        out.append(bytes, sizeof(Id));
+    }
+
+    static inline Id decode(std::string_view bytes) {
+        if (bytes.size() != sizeof(Id))
+            throw std::runtime_error("Malformed id");
+
+        Id id;
+        std::memcpy(&id, bytes.data(), sizeof(Id));
+        return id;
+    }
+};
+
+template<>
+struct genealogy_id_codec<std::string> {
+    static inline void encode(std::string const &id, std::string &out) {
+        out.append(id);
+    }
+
+    static inline std::string decode(std::string_view bytes) {
+        return std::string(bytes);
+    }
+};
+
+//Little helpers for the binary formats built on top of the codec.
+struct genealogy_bytes {
+    static inline void put_varint(std::string &out, std::uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    //Consumes a varint from the front of in, throws if it is cut short.
+    static inline std::uint64_t get_varint(std::string_view &in) {
+        std::uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7) {
+            if (in.empty())
+                throw std::runtime_error("Truncated varint");
+
+            auto byte = static_cast<unsigned char>(in.front());
+            in.remove_prefix(1);
+            value |= std::uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        throw std::runtime_error("Malformed varint");
+    }
+
+    static inline void put_u32(std::string &out, std::uint32_t value) {
+        char bytes[4];
+        for (int i = 0; i < 4; ++i)
+            bytes[i] = static_cast<char>(value >> (8 * i));
+        out.append(bytes, 4);
+    }
+
+    static inline std::uint32_t get_u32(std::string_view &in) {
+        if (in.size() < 4)
+            throw std::runtime_error("Truncated u32");
+
+        std::uint32_t value = 0;
+        for (int i = 0; i < 4; ++i)
+            value |= std::uint32_t(static_cast<unsigned char>(in[i])) << (8 * i);
+        in.remove_prefix(4);
+        return value;
+    }
+
+    static inline void put_u64(std::string &out, std::uint64_t value) {
+        put_u32(out, static_cast<std::uint32_t>(value));
+        put_u32(out, static_cast<std::uint32_t>(value >> 32));
+    }
+
+    static inline std::uint64_t get_u64(std::string_view &in) {
+        auto low = get_u32(in);
+        return low | std::uint64_t(get_u32(in)) << 32;
+    }
+
+    template<typename Id>
+    static inline void put_id(std::string &out, Id const &id) {
+        std::string bytes;
+        genealogy_id_codec<Id>::encode(id, bytes);
+        put_varint(out, bytes.size());
+        out.append(bytes);
+    }
+
+    template<typename Id>
+    static inline Id get_id(std::string_view &in) {
+        auto size = get_varint(in);
+        if (in.size() < size)
+            throw std::runtime_error("Truncated id");
+
+        auto id = genealogy_id_codec<Id>::decode(in.substr(0, size));
+        in.remove_prefix(size);
+        return id;
+    }
+};
+
+#endif
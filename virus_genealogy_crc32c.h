@@ -0,0 +1,125 @@
+#ifndef _VIRUS_GENEALOGY_CRC32C_
+#define _VIRUS_GENEALOGY_CRC32C_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define VIRUS_GENEALOGY_CRC32C_SSE42
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define VIRUS_GENEALOGY_CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+//CRC32C (Castagnoli) guarding blocks of snapshots. Uses the crc32
+//instruction of SSE4.2 or ARMv8 when the processor has it, which checks
+//several GB/s per core, and slicing-by-8 tables otherwise.
+struct genealogy_crc32c {
+private:
+    using tables_t = std::array<std::array<std::uint32_t, 256>, 8>;
+
+    static inline tables_t const &tables() {
+        static const tables_t result = [] {
+            tables_t t{};
+            for (std::uint32_t i = 0; i < 256; ++i) {
+                auto crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                    crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+                t[0][i] = crc;
+            }
+            for (std::size_t k = 1; k < 8; ++k)
+                for (std::size_t i = 0; i < 256; ++i)
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            return t;
+        }();
+        return result;
+    }
+
+    static inline std::uint32_t software(const unsigned char *p,
+                                         std::size_t size,
+                                         std::uint32_t crc) noexcept {
+        auto &t = tables();
+        while (size >= 8) {
+            std::uint64_t word;
+            std::memcpy(&word, p, 8);
+            word ^= crc;
+            crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+                  t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+                  t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+                  t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+            p += 8;
+            size -= 8;
+        }
+        while (size--)
+            crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+        return crc;
+    }
+
+#ifdef VIRUS_GENEALOGY_CRC32C_SSE42
+    __attribute__((target("sse4.2")))
+    static inline std::uint32_t hardware(const unsigned char *p,
+                                         std::size_t size,
+                                         std::uint32_t crc) noexcept {
+        std::uint64_t wide = crc;
+        while (size >= 8) {
+            std::uint64_t word;
+            std::memcpy(&word, p, 8);
+            wide = _mm_crc32_u64(wide, word);
+            p += 8;
+            size -= 8;
+        }
+        crc = static_cast<std::uint32_t>(wide);
+        while (size--)
+            crc = _mm_crc32_u8(crc, *p++);
+        return crc;
+    }
+
+    static inline bool has_hardware() noexcept {
+        static const bool result = __builtin_cpu_supports("sse4.2");
+        return result;
+    }
+#elif defined(VIRUS_GENEALOGY_CRC32C_ARM)
+    static inline std::uint32_t hardware(const unsigned char *p,
+                                         std::size_t size,
+                                         std::uint32_t crc) noexcept {
+        while (size >= 8) {
+            std::uint64_t word;
+            std::memcpy(&word, p, 8);
+            crc = __crc32cd(crc, word);
+            p += 8;
+            size -= 8;
+        }
+        while (size--)
+            crc = __crc32cb(crc, *p++);
+        return crc;
+    }
+
+    static inline bool has_hardware() noexcept {
+        return true;
+    }
+#endif
+
+public:
+    //Continues crc, a previous result, over more data.
+    static inline std::uint32_t compute(const void *data, std::size_t size,
+                                        std::uint32_t crc = 0) noexcept {
+        auto p = static_cast<const unsigned char *>(data);
+        crc = ~crc;
+#if defined(VIRUS_GENEALOGY_CRC32C_SSE42) || defined(VIRUS_GENEALOGY_CRC32C_ARM)
+        if (has_hardware())
+            return ~hardware(p, size, crc);
+#endif
+        return ~software(p, size, crc);
+    }
+
+    static inline std::uint32_t software_compute(const void *data,
+                                                 std::size_t size) noexcept {
+        return ~software(static_cast<const unsigned char *>(data), size,
+                         ~std::uint32_t(0));
+    }
+};
+
+#endif
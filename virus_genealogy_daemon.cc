@@ -0,0 +1,53 @@
+// serves a genealogy of viruses with string ids over a Unix socket, see
+// virus_genealogy_rpc.h for the protocol
+//
+// usage: virus_genealogy_daemon <socket path> <stem id>
+
+#include "virus_genealogy_rpc.h"
+#include <csignal>
+#include <exception>
+#include <iostream>
+#include <string>
+
+class Virus {
+public:
+    using id_type = std::string;
+    Virus(id_type const &_id) : id(_id) {
+    }
+    id_type get_id() const {
+        return id;
+    }
+private:
+    id_type id;
+};
+
+using server_t = genealogy_rpc_server<Virus>;
+
+static server_t *running = nullptr;
+
+extern "C" void on_signal(int) {
+    if (running)
+        running->stop();
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <socket path> <stem id>\n";
+        return 2;
+    }
+
+    try {
+        VirusGenealogy<Virus> genealogy(argv[2]);
+        server_t server(genealogy, argv[1]);
+
+        running = &server;
+        std::signal(SIGINT, on_signal);
+        std::signal(SIGTERM, on_signal);
+        server.run();
+        running = nullptr;
+    }
+    catch (std::exception const &e) {
+        std::cerr << argv[0] << ": " << e.what() << "\n";
+        return 1;
+    }
+}
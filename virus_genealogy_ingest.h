@@ -0,0 +1,254 @@
+#ifndef _VIRUS_GENEALOGY_INGEST_
+#define _VIRUS_GENEALOGY_INGEST_
+
+#include "virus_genealogy.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//Front end letting many threads mutate one genealogy. Producers push
+//requests onto a lock-free multi-producer single-consumer queue and get
+//futures, a single writer thread drains it in batches. A batch is applied
+//under one exclusive lock and, for genealogies with sync() such as
+//DurableVirusGenealogy, made durable by one sync before any of its futures
+//is fulfilled.
+//
+//Every request keeps the guarantees of the underlying genealogy and fails on
+//its own, its future then holds the exception. Requests of one thread are
+//applied in the order they were made.
+template<typename Virus, typename Genealogy = VirusGenealogy<Virus>>
+class IngestingVirusGenealogy {
+private:
+    using id_t = typename Virus::id_type;
+
+    enum class kind {
+        create, connect, remove
+    };
+
+    struct link {
+        std::atomic<link *> next = nullptr;
+    };
+
+    struct request : link {
+        kind what;
+        id_t id;
+        std::vector<id_t> others;
+        std::promise<void> promise;
+    };
+
+    //Queue by Vyukov: producers exchange the head and then link the previous
+    //one to their request, the writer follows links from the tail. A request
+    //whose predecessor is not linked yet stays invisible for a moment.
+    std::atomic<link *> head;
+    link *tail;
+    link stub;
+    //Pushed by the destructor to stop the writer, which cannot allocate.
+    link stop;
+
+    //Requests pushed but not taken by the writer, which sleeps on it at 0.
+    std::atomic<std::size_t> pending = 0;
+    std::atomic<std::size_t> batch_count = 0;
+
+    std::size_t max_batch;
+    mutable std::shared_mutex mutex;
+    Genealogy genealogy;
+    //Used only by the writer. Room for max_batch requests is reserved up
+    //front, as the writer has nobody to report a failed allocation to.
+    std::vector<std::unique_ptr<request>> batch;
+    std::vector<std::exception_ptr> errors;
+    std::thread writer;
+
+    inline void push(link *r) noexcept {
+        auto previous = head.exchange(r, std::memory_order_acq_rel);
+        previous->next.store(r, std::memory_order_release);
+        if (pending.fetch_add(1, std::memory_order_release) == 0)
+            pending.notify_one();
+    }
+
+    inline link *pop() noexcept {
+        auto first = tail;
+        auto next = first->next.load(std::memory_order_acquire);
+        if (first == &stub) {
+            if (!next)
+                return nullptr;
+            tail = first = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            tail = next;
+            return first;
+        }
+        if (first != head.load(std::memory_order_acquire))
+            return nullptr;
+
+        stub.next.store(nullptr, std::memory_order_relaxed);
+        push_stub();
+        next = first->next.load(std::memory_order_acquire);
+        if (next) {
+            tail = next;
+            return first;
+        }
+        return nullptr;
+    }
+
+    inline void push_stub() noexcept {
+        auto previous = head.exchange(&stub, std::memory_order_acq_rel);
+        previous->next.store(&stub, std::memory_order_release);
+    }
+
+    inline std::future<void> submit(kind what, id_t const &id,
+                                    std::vector<id_t> others) {
+        std::unique_ptr<request> r(
+                new request{{}, what, id, std::move(others), {}});
+        auto result = r->promise.get_future();
+        push(r.release());
+        return result;
+    }
+
+    inline void apply(request &r) {
+        switch (r.what) {
+            case kind::create:
+                if (r.others.size() == 1)
+                    genealogy.create(r.id, r.others.front());
+                else
+                    genealogy.create(r.id, r.others);
+                break;
+            case kind::connect:
+                genealogy.connect(r.id, r.others.front());
+                break;
+            case kind::remove:
+                genealogy.remove(r.id);
+                break;
+        }
+    }
+
+    inline void run() {
+        bool stopping = false;
+
+        while (!stopping) {
+            pending.wait(0, std::memory_order_acquire);
+
+            batch.clear();
+            std::size_t taken = 0;
+            while (batch.size() < max_batch && !stopping) {
+                auto r = pop();
+                if (!r)
+                    break;
+                ++taken;
+                if (r == &stop) {
+                    stopping = true;
+                    continue;
+                }
+                //Owned before it is pushed, which cannot reallocate anyway.
+                std::unique_ptr<request> popped(static_cast<request *>(r));
+                batch.push_back(std::move(popped));
+            }
+            if (taken == 0) {
+                //Some producer is halfway through linking its request.
+                std::this_thread::yield();
+                continue;
+            }
+            pending.fetch_sub(taken, std::memory_order_relaxed);
+            if (batch.empty())
+                continue;
+
+            //Within the reserved capacity, so nothrow.
+            errors.assign(batch.size(), nullptr);
+            {
+                std::unique_lock lock(mutex);
+                for (std::size_t i = 0; i < batch.size(); ++i) {
+                    try {
+                        apply(*batch[i]);
+                    }
+                    catch (...) {
+                        errors[i] = std::current_exception();
+                    }
+                }
+            }
+
+            std::exception_ptr unsynced;
+            if constexpr (requires { genealogy.sync().get(); })
+                try {
+                    genealogy.sync().get();
+                }
+                catch (...) {
+                    unsynced = std::current_exception();
+                }
+
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                auto error = errors[i] ? errors[i] : unsynced;
+                if (error)
+                    batch[i]->promise.set_exception(error);
+                else
+                    batch[i]->promise.set_value();
+            }
+            ++batch_count;
+        }
+    }
+
+public:
+    //The genealogy is built from args. max_batch bounds the requests applied
+    //under one lock, room for that many is allocated here.
+    template<typename... Args>
+    inline explicit IngestingVirusGenealogy(std::size_t max_batch,
+                                            Args &&... args)
+            : head(&stub), tail(&stub),
+              max_batch(std::max<std::size_t>(1, max_batch)),
+              genealogy(std::forward<Args>(args)...) {
+        batch.reserve(this->max_batch);
+        errors.reserve(this->max_batch);
+        writer = std::thread([this] { run(); });
+    }
+
+    IngestingVirusGenealogy(const IngestingVirusGenealogy &) = delete;
+
+    IngestingVirusGenealogy &operator=(const IngestingVirusGenealogy &) = delete;
+
+    //Applies everything submitted before, then stops the writer. Nothing
+    //may be submitted concurrently.
+    inline ~IngestingVirusGenealogy() {
+        push(&stop);
+        writer.join();
+    }
+
+    inline std::future<void> create(id_t const &id, id_t const &parent_id) {
+        return submit(kind::create, id, {parent_id});
+    }
+
+    inline std::future<void> create(id_t const &id,
+                                    std::vector<id_t> const &parent_ids) {
+        return submit(kind::create, id, parent_ids);
+    }
+
+    inline std::future<void> connect(id_t const &child_id,
+                                     id_t const &parent_id) {
+        return submit(kind::connect, child_id, {parent_id});
+    }
+
+    inline std::future<void> remove(id_t const &id) {
+        return submit(kind::remove, id, {});
+    }
+
+    //Runs f on the genealogy under a shared lock, so it sees whole batches.
+    template<typename F>
+    inline decltype(auto) read(F &&f) const {
+        std::shared_lock lock(mutex);
+        return std::forward<F>(f)(static_cast<Genealogy const &>(genealogy));
+    }
+
+    inline std::size_t batches() const noexcept {
+        return batch_count.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
@@ -0,0 +1,983 @@
+#ifndef _VIRUS_GENEALOGY_PAGED_
+#define _VIRUS_GENEALOGY_PAGED_
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_codec.h"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//File cut into fixed pages which are cached by an LRU buffer pool. Page 0 is
+//the header, released pages are chained into a free list.
+class genealogy_page_file {
+public:
+    static constexpr std::size_t page_size = 4096;
+    using page_id = std::uint32_t;
+
+    //Offset in the header page from which the owner of the file may store
+    //its own fields.
+    static constexpr std::size_t user_header = 16;
+
+    static inline std::uint32_t load_u32(const unsigned char *p) noexcept {
+        std::uint32_t value;
+        std::memcpy(&value, p, 4);
+        return value;
+    }
+
+    static inline void store_u32(unsigned char *p, std::uint32_t value) noexcept {
+        std::memcpy(p, &value, 4);
+    }
+
+    static inline std::uint16_t load_u16(const unsigned char *p) noexcept {
+        std::uint16_t value;
+        std::memcpy(&value, p, 2);
+        return value;
+    }
+
+    static inline void store_u16(unsigned char *p, std::uint16_t value) noexcept {
+        std::memcpy(p, &value, 2);
+    }
+
+private:
+    static constexpr char magic[8] = {'V', 'G', 'P', 'A', 'G', 'E', 'S', '1'};
+
+    struct frame {
+        page_id id = 0;
+        bool used = false;
+        bool dirty = false;
+        std::size_t pins = 0;
+        std::list<std::size_t>::iterator lru;
+        std::array<unsigned char, page_size> data;
+    };
+
+    int fd;
+    std::vector<frame> frames;
+    std::unordered_map<page_id, std::size_t> resident;
+    //Most recently used frames first.
+    std::list<std::size_t> lru;
+    page_id page_count = 1;
+    page_id free_head = 0;
+    bool created = false;
+    std::uint64_t reads = 0;
+
+    [[noreturn]] static inline void fail(const char *what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    inline void read_frame(frame &f) {
+        std::size_t done = 0;
+        while (done < page_size) {
+            auto got = pread(fd, f.data.data() + done, page_size - done,
+                             off_t(f.id) * page_size + done);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                fail("pread");
+            //Pages past the end of file have never been written out.
+            if (got == 0)
+                break;
+            done += got;
+        }
+        std::fill(f.data.begin() + done, f.data.end(), 0);
+        ++reads;
+    }
+
+    inline void write_frame(frame &f) {
+        std::size_t done = 0;
+        while (done < page_size) {
+            auto put = pwrite(fd, f.data.data() + done, page_size - done,
+                              off_t(f.id) * page_size + done);
+            if (put < 0 && errno == EINTR)
+                continue;
+            if (put < 0)
+                fail("pwrite");
+            done += put;
+        }
+        f.dirty = false;
+    }
+
+    inline std::size_t victim() {
+        for (auto it = lru.rbegin(); it != lru.rend(); ++it)
+            if (frames[*it].pins == 0)
+                return *it;
+
+        throw std::runtime_error("All pages of the buffer pool are pinned");
+    }
+
+    inline void load_header() {
+        auto header = fetch(0);
+        if (std::memcmp(header.data(), magic, sizeof(magic)) != 0)
+            throw std::runtime_error("Not a paged genealogy file");
+
+        page_count = load_u32(header.data() + 8);
+        free_head = load_u32(header.data() + 12);
+    }
+
+public:
+    //Pins a page in the pool for as long as it lives.
+    class page_ref {
+    public:
+        inline page_ref(genealogy_page_file *file, std::size_t frame) noexcept
+                : file(file), frame(frame) {}
+
+        inline page_ref(page_ref &&other) noexcept
+                : file(other.file), frame(other.frame) {
+            other.file = nullptr;
+        }
+
+        page_ref(const page_ref &) = delete;
+
+        page_ref &operator=(const page_ref &) = delete;
+
+        inline ~page_ref() {
+            if (file)
+                --file->frames[frame].pins;
+        }
+
+        inline unsigned char *data() noexcept {
+            return file->frames[frame].data.data();
+        }
+
+        inline void mark_dirty() noexcept {
+            file->frames[frame].dirty = true;
+        }
+
+        inline page_id id() const noexcept {
+            return file->frames[frame].id;
+        }
+
+    private:
+        genealogy_page_file *file;
+        std::size_t frame;
+    };
+
+    inline genealogy_page_file(std::string const &path, std::size_t pool_pages)
+            : frames(std::max<std::size_t>(pool_pages, 16)) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            fail("open");
+
+        try {
+            for (std::size_t i = 0; i < frames.size(); ++i)
+                frames[i].lru = lru.insert(lru.end(), i);
+
+            struct stat info;
+            if (fstat(fd, &info) < 0)
+                fail("fstat");
+
+            created = info.st_size == 0;
+            if (created) {
+                auto header = fetch(0);
+                std::memcpy(header.data(), magic, sizeof(magic));
+                header.mark_dirty();
+            } else
+                load_header();
+        }
+        catch (...) {
+            ::close(fd);
+            throw;
+        }
+    }
+
+    genealogy_page_file(const genealogy_page_file &) = delete;
+
+    genealogy_page_file &operator=(const genealogy_page_file &) = delete;
+
+    inline ~genealogy_page_file() {
+        try {
+            flush();
+        }
+        catch (...) {
+        }
+        ::close(fd);
+    }
+
+    inline bool is_new() const noexcept {
+        return created;
+    }
+
+    //Number of pages read from disk so far, i.e. misses of the pool.
+    inline std::uint64_t page_reads() const noexcept {
+        return reads;
+    }
+
+    inline page_ref fetch(page_id id) {
+        auto found = resident.find(id);
+        if (found != resident.end()) {
+            auto &f = frames[found->second];
+            lru.splice(lru.begin(), lru, f.lru);
+            ++f.pins;
+            return page_ref(this, found->second);
+        }
+
+        auto index = victim();
+        auto &f = frames[index];
+        if (f.used) {
+            if (f.dirty)
+                write_frame(f);
+            resident.erase(f.id);
+            f.used = false;
+        }
+
+        f.id = id;
+        read_frame(f);
+        resident.insert({id, index});
+        f.used = true;
+        f.pins = 1;
+        lru.splice(lru.begin(), lru, f.lru);
+        return page_ref(this, index);
+    }
+
+    //Returns a zeroed page, reusing released ones first.
+    inline page_ref allocate() {
+        page_id id = free_head;
+        if (id) {
+            auto page = fetch(id);
+            free_head = load_u32(page.data());
+            std::fill(page.data(), page.data() + page_size, 0);
+            page.mark_dirty();
+            return page;
+        }
+
+        auto page = fetch(page_count);
+        ++page_count;
+        page.mark_dirty();
+        return page;
+    }
+
+    inline void release(page_id id) {
+        auto page = fetch(id);
+        store_u32(page.data(), free_head);
+        page.mark_dirty();
+        free_head = id;
+    }
+
+    inline void flush() {
+        {
+            auto header = fetch(0);
+            store_u32(header.data() + 8, page_count);
+            store_u32(header.data() + 12, free_head);
+            header.mark_dirty();
+        }
+
+        for (auto &f : frames)
+            if (f.used && f.dirty)
+                write_frame(f);
+
+        if (fdatasync(fd) < 0)
+            fail("fdatasync");
+    }
+};
+
+//B+tree over the page file mapping encoded ids to fixed size values. Keys
+//are kept in fixed slots, so ids longer than max_key bytes are rejected.
+//Nothing is ever deleted from it, owners mark dead entries in the value.
+class genealogy_btree {
+public:
+    using page_id = genealogy_page_file::page_id;
+
+    static constexpr std::size_t key_size = 64;
+    static constexpr std::size_t max_key = key_size - 1;
+    static constexpr std::size_t value_size = 20;
+
+private:
+    static constexpr unsigned char leaf_page = 1;
+    static constexpr unsigned char inner_page = 2;
+    static constexpr std::size_t header = 8;
+    static constexpr std::size_t leaf_entry = key_size + value_size;
+    static constexpr std::size_t inner_entry = key_size + 4;
+    static constexpr std::size_t leaf_capacity =
+            (genealogy_page_file::page_size - header) / leaf_entry;
+    static constexpr std::size_t inner_capacity =
+            (genealogy_page_file::page_size - header) / inner_entry;
+
+    //Position of the root page in the header of the file.
+    static constexpr std::size_t root_offset = genealogy_page_file::user_header;
+
+    struct image {
+        bool leaf;
+        std::vector<std::string> keys;
+        std::vector<std::string> values;
+        std::vector<page_id> children;
+    };
+
+    genealogy_page_file &file;
+    page_id root;
+
+    static inline std::string_view key_at(const unsigned char *slot) noexcept {
+        return {reinterpret_cast<const char *>(slot + 1), slot[0]};
+    }
+
+    static inline void put_key(unsigned char *slot, std::string_view key) noexcept {
+        slot[0] = static_cast<unsigned char>(key.size());
+        std::memcpy(slot + 1, key.data(), key.size());
+    }
+
+    inline image load(page_id id) {
+        auto page = file.fetch(id);
+        auto data = page.data();
+        image result;
+        result.leaf = data[0] == leaf_page;
+        std::size_t count = genealogy_page_file::load_u16(data + 2);
+
+        if (result.leaf) {
+            for (std::size_t i = 0; i < count; ++i) {
+                auto slot = data + header + i * leaf_entry;
+                result.keys.emplace_back(key_at(slot));
+                result.values.emplace_back(
+                        reinterpret_cast<const char *>(slot + key_size),
+                        value_size);
+            }
+        } else {
+            result.children.push_back(genealogy_page_file::load_u32(data + 4));
+            for (std::size_t i = 0; i < count; ++i) {
+                auto slot = data + header + i * inner_entry;
+                result.keys.emplace_back(key_at(slot));
+                result.children.push_back(
+                        genealogy_page_file::load_u32(slot + key_size));
+            }
+        }
+        return result;
+    }
+
+    inline void store(genealogy_page_file::page_ref &page, image const &node) {
+        auto data = page.data();
+        std::fill(data, data + genealogy_page_file::page_size, 0);
+        data[0] = node.leaf ? leaf_page : inner_page;
+        genealogy_page_file::store_u16(data + 2,
+                                       static_cast<std::uint16_t>(node.keys.size()));
+
+        if (node.leaf) {
+            for (std::size_t i = 0; i < node.keys.size(); ++i) {
+                auto slot = data + header + i * leaf_entry;
+                put_key(slot, node.keys[i]);
+                std::memcpy(slot + key_size, node.values[i].data(), value_size);
+            }
+        } else {
+            genealogy_page_file::store_u32(data + 4, node.children[0]);
+            for (std::size_t i = 0; i < node.keys.size(); ++i) {
+                auto slot = data + header + i * inner_entry;
+                put_key(slot, node.keys[i]);
+                genealogy_page_file::store_u32(slot + key_size,
+                                               node.children[i + 1]);
+            }
+        }
+        page.mark_dirty();
+    }
+
+    inline void store(page_id id, image const &node) {
+        auto page = file.fetch(id);
+        store(page, node);
+    }
+
+    inline void set_root(page_id id) {
+        root = id;
+        auto header = file.fetch(0);
+        genealogy_page_file::store_u32(header.data() + root_offset, root);
+        header.mark_dirty();
+    }
+
+    //Returns the separator and the new right sibling if the page was split.
+    inline std::optional<std::pair<std::string, page_id>>
+    insert_into(page_id id, std::string const &key, std::string const &value) {
+        auto node = load(id);
+        auto pos = std::upper_bound(node.keys.begin(), node.keys.end(), key) -
+                   node.keys.begin();
+
+        if (node.leaf) {
+            if (pos > 0 && node.keys[pos - 1] == key) {
+                node.values[pos - 1] = value;
+                store(id, node);
+                return std::nullopt;
+            }
+            node.keys.insert(node.keys.begin() + pos, key);
+            node.values.insert(node.values.begin() + pos, value);
+        } else {
+            auto split = insert_into(node.children[pos], key, value);
+            if (!split)
+                return std::nullopt;
+            node.keys.insert(node.keys.begin() + pos, split->first);
+            node.children.insert(node.children.begin() + pos + 1,
+                                 split->second);
+        }
+
+        if (node.keys.size() <=
+            (node.leaf ? leaf_capacity : inner_capacity)) {
+            store(id, node);
+            return std::nullopt;
+        }
+
+        auto middle = node.keys.size() / 2;
+        image right{node.leaf, {}, {}, {}};
+        std::string separator;
+
+        if (node.leaf) {
+            right.keys.assign(node.keys.begin() + middle, node.keys.end());
+            right.values.assign(node.values.begin() + middle,
+                                node.values.end());
+            node.keys.resize(middle);
+            node.values.resize(middle);
+            separator = right.keys.front();
+        } else {
+            separator = node.keys[middle];
+            right.keys.assign(node.keys.begin() + middle + 1, node.keys.end());
+            right.children.assign(node.children.begin() + middle + 1,
+                                  node.children.end());
+            node.keys.resize(middle);
+            node.children.resize(middle + 1);
+        }
+
+        auto right_page = file.allocate();
+        store(right_page, right);
+        store(id, node);
+        return std::make_pair(separator, right_page.id());
+    }
+
+public:
+    inline explicit genealogy_btree(genealogy_page_file &file) : file(file) {
+        auto header = file.fetch(0);
+        root = genealogy_page_file::load_u32(header.data() + root_offset);
+        if (!root) {
+            auto page = file.allocate();
+            store(page, image{true, {}, {}, {}});
+            genealogy_page_file::store_u32(header.data() + root_offset,
+                                           page.id());
+            header.mark_dirty();
+            root = page.id();
+        }
+    }
+
+    //Reads only the pages on the path from the root, which in a tree of
+    //height three means one or two reads for a cold key.
+    inline std::optional<std::string> find(std::string_view key) {
+        page_id id = root;
+        while (true) {
+            auto page = file.fetch(id);
+            auto data = page.data();
+            std::size_t count = genealogy_page_file::load_u16(data + 2);
+
+            if (data[0] == leaf_page) {
+                std::size_t low = 0, high = count;
+                while (low < high) {
+                    auto mid = (low + high) / 2;
+                    if (key_at(data + header + mid * leaf_entry) < key)
+                        low = mid + 1;
+                    else
+                        high = mid;
+                }
+                auto slot = data + header + low * leaf_entry;
+                if (low < count && key_at(slot) == key)
+                    return std::string(
+                            reinterpret_cast<const char *>(slot + key_size),
+                            value_size);
+                return std::nullopt;
+            }
+
+            std::size_t low = 0, high = count;
+            while (low < high) {
+                auto mid = (low + high) / 2;
+                if (key_at(data + header + mid * inner_entry) <= key)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            id = low == 0 ? genealogy_page_file::load_u32(data + 4)
+                          : genealogy_page_file::load_u32(
+                                    data + header + (low - 1) * inner_entry +
+                                    key_size);
+        }
+    }
+
+    //Inserts the key or overwrites its value.
+    inline void put(std::string const &key, std::string const &value) {
+        auto split = insert_into(root, key, value);
+        if (!split)
+            return;
+
+        auto new_root = file.allocate();
+        store(new_root, image{false, {split->first}, {}, {root, split->second}});
+        set_root(new_root.id());
+    }
+};
+
+//VirusGenealogy kept in a file instead of memory, for genealogies which do
+//not fit in RAM. Viruses are found through a B+tree over encoded ids and
+//their parents and children are kept in chains of adjacency pages, all read
+//through an LRU buffer pool of pool_pages pages. Reopening a file with the
+//same stem continues the stored genealogy.
+//
+//The public interface is that of VirusGenealogy. Ids are checked before the
+//first write, so VirusNotFound and the other genealogy errors leave the file
+//unchanged. An I/O failure gives no guarantee: a mutation writes its records
+//and adjacency pages one after another, so it may stop half done and leave
+//adjacency pointing at a virus that is not there. Such a file should not be
+//used any more. Changes are persisted by flush() and the destructor.
+template<typename Virus>
+class PagedVirusGenealogy {
+private:
+    using page_id = genealogy_page_file::page_id;
+    using codec_t = genealogy_id_codec<typename Virus::id_type>;
+
+    struct set_compare {
+        inline bool operator()(const Virus &a, const Virus &b) const {
+            return a.get_id() > b.get_id();
+        }
+    };
+
+    using virus_set_t = std::set<Virus, set_compare>;
+
+    static constexpr unsigned char adjacency_page = 3;
+    static constexpr std::size_t adjacency_header = 8;
+    static constexpr std::size_t adjacency_capacity =
+            (genealogy_page_file::page_size - adjacency_header) /
+            genealogy_btree::key_size;
+
+    //Where the encoded stem is kept in the header of the file.
+    static constexpr std::size_t stem_offset =
+            genealogy_page_file::user_header + 4;
+
+    struct record {
+        page_id parents_head = 0;
+        page_id children_head = 0;
+        std::uint32_t parent_count = 0;
+        std::uint32_t child_count = 0;
+        bool alive = true;
+
+        inline std::string encode() const {
+            std::string bytes(genealogy_btree::value_size, '\0');
+            auto data = reinterpret_cast<unsigned char *>(bytes.data());
+            genealogy_page_file::store_u32(data, parents_head);
+            genealogy_page_file::store_u32(data + 4, children_head);
+            genealogy_page_file::store_u32(data + 8, parent_count);
+            genealogy_page_file::store_u32(data + 12, child_count);
+            data[16] = alive;
+            return bytes;
+        }
+
+        static inline record decode(std::string const &bytes) {
+            auto data = reinterpret_cast<const unsigned char *>(bytes.data());
+            return {genealogy_page_file::load_u32(data),
+                    genealogy_page_file::load_u32(data + 4),
+                    genealogy_page_file::load_u32(data + 8),
+                    genealogy_page_file::load_u32(data + 12),
+                    data[16] != 0};
+        }
+    };
+
+    mutable genealogy_page_file file;
+    mutable genealogy_btree index;
+    typename Virus::id_type stem_id;
+    mutable virus_set_t virus_set;
+
+    static inline std::string key_of(typename Virus::id_type const &id) {
+        std::string key;
+        codec_t::encode(id, key);
+        if (key.size() > genealogy_btree::max_key)
+            throw std::length_error("Id too long for a paged genealogy");
+
+        return key;
+    }
+
+    inline std::optional<record> find(std::string const &key) const {
+        auto value = index.find(key);
+        if (!value)
+            return std::nullopt;
+
+        auto result = record::decode(*value);
+        if (!result.alive)
+            return std::nullopt;
+
+        return result;
+    }
+
+    inline record get(typename Virus::id_type const &id) const {
+        auto key = key_of(id);
+        auto result = find(key);
+        if (!result)
+            throw VirusNotFound();
+
+        return *result;
+    }
+
+    inline void put(std::string const &key, record const &value) {
+        index.put(key, value.encode());
+    }
+
+    inline std::vector<std::string> read_list(page_id head) const {
+        std::vector<std::string> result;
+        while (head) {
+            auto page = file.fetch(head);
+            auto data = page.data();
+            std::size_t count = genealogy_page_file::load_u16(data + 2);
+            for (std::size_t i = 0; i < count; ++i) {
+                auto slot = data + adjacency_header +
+                            i * genealogy_btree::key_size;
+                result.emplace_back(reinterpret_cast<const char *>(slot + 1),
+                                    slot[0]);
+            }
+            head = genealogy_page_file::load_u32(data + 4);
+        }
+        return result;
+    }
+
+    inline bool list_contains(page_id head, std::string const &key) const {
+        for (auto &entry : read_list(head))
+            if (entry == key)
+                return true;
+
+        return false;
+    }
+
+    //New entries go to the head page, a new head is chained in when it fills.
+    inline void append(page_id &head, std::string const &key) {
+        std::size_t count = adjacency_capacity;
+        if (head) {
+            auto page = file.fetch(head);
+            count = genealogy_page_file::load_u16(page.data() + 2);
+        }
+
+        if (count == adjacency_capacity) {
+            auto page = file.allocate();
+            page.data()[0] = adjacency_page;
+            genealogy_page_file::store_u32(page.data() + 4, head);
+            head = page.id();
+            count = 0;
+        }
+
+        auto page = file.fetch(head);
+        auto slot = page.data() + adjacency_header +
+                    count * genealogy_btree::key_size;
+        slot[0] = static_cast<unsigned char>(key.size());
+        std::memcpy(slot + 1, key.data(), key.size());
+        genealogy_page_file::store_u16(page.data() + 2,
+                                       static_cast<std::uint16_t>(count + 1));
+        page.mark_dirty();
+    }
+
+    //Moves the last entry of the head page in place of the erased one and
+    //drops the head page once it is empty.
+    inline void erase_from(page_id &head, std::string const &key) {
+        for (page_id id = head; id;) {
+            auto page = file.fetch(id);
+            auto data = page.data();
+            std::size_t count = genealogy_page_file::load_u16(data + 2);
+
+            for (std::size_t i = 0; i < count; ++i) {
+                auto slot = data + adjacency_header +
+                            i * genealogy_btree::key_size;
+                if (std::string_view(reinterpret_cast<const char *>(slot + 1),
+                                     slot[0]) != key)
+                    continue;
+
+                auto head_page = file.fetch(head);
+                auto head_data = head_page.data();
+                std::size_t head_count =
+                        genealogy_page_file::load_u16(head_data + 2);
+                auto last = head_data + adjacency_header +
+                            (head_count - 1) * genealogy_btree::key_size;
+                std::memmove(slot, last, genealogy_btree::key_size);
+                page.mark_dirty();
+
+                genealogy_page_file::store_u16(
+                        head_data + 2,
+                        static_cast<std::uint16_t>(head_count - 1));
+                head_page.mark_dirty();
+
+                if (head_count == 1) {
+                    auto next = genealogy_page_file::load_u32(head_data + 4);
+                    file.release(head);
+                    head = next;
+                }
+                return;
+            }
+            id = genealogy_page_file::load_u32(data + 4);
+        }
+    }
+
+    inline void release_list(page_id head) {
+        while (head) {
+            page_id next;
+            {
+                auto page = file.fetch(head);
+                next = genealogy_page_file::load_u32(page.data() + 4);
+            }
+            file.release(head);
+            head = next;
+        }
+    }
+
+    inline const Virus &cached(typename Virus::id_type const &id) const {
+        virus_set.insert(Virus(id));
+        return *virus_set.find(Virus(id));
+    }
+
+public:
+    class children_iterator {
+    public:
+        //Needed to satisfy bidirectional_iterator concept.
+        using difference_type = std::ptrdiff_t;
+        using value_type = Virus;
+
+        inline const Virus &operator*() const {
+            return (*children)[position];
+        }
+
+        inline const Virus *operator->() const {
+            return &**this;
+        }
+
+        inline children_iterator &operator++() {
+            ++position;
+            return *this;
+        }
+
+        inline children_iterator operator++(int) {
+            auto copy = *this;
+            ++position;
+            return copy;
+        }
+
+        inline children_iterator &operator--() {
+            --position;
+            return *this;
+        }
+
+        inline children_iterator operator--(int) {
+            auto copy = *this;
+            --position;
+            return copy;
+        }
+
+        //Children are read from disk once per begin iterator, so iterators
+        //of one virus are compared by position only.
+        inline bool operator==(const children_iterator &other) const {
+            return other.position == position;
+        }
+
+        inline children_iterator(
+                std::shared_ptr<const std::vector<Virus>> children,
+                std::size_t position)
+                : children(std::move(children)), position(position) {}
+
+        inline children_iterator() = default;
+
+    private:
+        std::shared_ptr<const std::vector<Virus>> children;
+        std::size_t position = 0;
+    };
+
+    inline PagedVirusGenealogy(std::string const &path,
+                               typename Virus::id_type const &stem_id,
+                               std::size_t pool_pages = 1024)
+            : file(path, pool_pages), index(file), stem_id(stem_id) {
+        auto key = key_of(stem_id);
+        auto header = file.fetch(0);
+        auto slot = header.data() + stem_offset;
+
+        if (file.is_new()) {
+            slot[0] = static_cast<unsigned char>(key.size());
+            std::memcpy(slot + 1, key.data(), key.size());
+            header.mark_dirty();
+            put(key, record());
+        } else if (std::string_view(reinterpret_cast<const char *>(slot + 1),
+                                    slot[0]) != key)
+            throw std::runtime_error("File holds a genealogy of another stem");
+    }
+
+    PagedVirusGenealogy(const PagedVirusGenealogy &) = delete;
+
+    PagedVirusGenealogy &operator=(const PagedVirusGenealogy &) = delete;
+
+    inline void flush() {
+        file.flush();
+    }
+
+    inline std::uint64_t page_reads() const noexcept {
+        return file.page_reads();
+    }
+
+    inline typename Virus::id_type get_stem_id() const {
+        return stem_id;
+    }
+
+    inline bool exists(typename Virus::id_type const &id) const {
+        std::string key;
+        codec_t::encode(id, key);
+        return key.size() <= genealogy_btree::max_key && find(key).has_value();
+    }
+
+    inline const Virus &operator[](typename Virus::id_type const &id) const {
+        if (!exists(id))
+            throw VirusNotFound();
+
+        return cached(id);
+    }
+
+    inline std::vector<typename Virus::id_type>
+    get_parents(typename Virus::id_type const &id) const {
+        std::vector<typename Virus::id_type> result;
+        for (auto &key : read_list(get(id).parents_head))
+            result.push_back(codec_t::decode(key));
+
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    inline std::vector<typename Virus::id_type>
+    get_children(typename Virus::id_type const &id) const {
+        std::vector<typename Virus::id_type> result;
+        for (auto &key : read_list(get(id).children_head))
+            result.push_back(codec_t::decode(key));
+
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    inline children_iterator
+    get_children_begin(typename Virus::id_type const &id) const {
+        auto children = std::make_shared<std::vector<Virus>>();
+        for (auto &key : read_list(get(id).children_head))
+            children->emplace_back(codec_t::decode(key));
+
+        return children_iterator(std::move(children), 0);
+    }
+
+    inline children_iterator
+    get_children_end(typename Virus::id_type const &id) const {
+        return children_iterator(nullptr, get(id).child_count);
+    }
+
+    inline void create(typename Virus::id_type const &id,
+                       typename Virus::id_type const &parent_id) {
+        create(id, std::vector<typename Virus::id_type>{parent_id});
+    }
+
+    inline void create(typename Virus::id_type const &id,
+                       std::vector<typename Virus::id_type> const &parent_ids) {
+        auto key = key_of(id);
+        if (find(key))
+            throw VirusAlreadyCreated();
+
+        std::map<std::string, record> parents;
+        for (auto &parent_id : parent_ids) {
+            auto parent_key = key_of(parent_id);
+            auto parent = find(parent_key);
+            if (!parent)
+                throw VirusNotFound();
+            parents.insert({parent_key, *parent});
+        }
+
+        if (parents.empty())
+            return;
+
+        record created;
+        for (auto &[parent_key, parent] : parents) {
+            append(created.parents_head, parent_key);
+            ++created.parent_count;
+
+            append(parent.children_head, key);
+            ++parent.child_count;
+            put(parent_key, parent);
+        }
+        put(key, created);
+    }
+
+    inline void connect(typename Virus::id_type const &child_id,
+                        typename Virus::id_type const &parent_id) {
+        auto child_key = key_of(child_id);
+        auto parent_key = key_of(parent_id);
+        auto child = find(child_key);
+        auto parent = find(parent_key);
+        if (!child || !parent)
+            throw VirusNotFound();
+
+        if (list_contains(child->parents_head, parent_key))
+            return;
+
+        append(child->parents_head, parent_key);
+        ++child->parent_count;
+        put(child_key, *child);
+
+        //Parent could have been the child itself.
+        parent = find(parent_key);
+        append(parent->children_head, child_key);
+        ++parent->child_count;
+        put(parent_key, *parent);
+    }
+
+    //Removes the virus and descendants left without parents, like
+    //VirusGenealogy::remove.
+    inline void remove(typename Virus::id_type const &id) {
+        auto key = key_of(id);
+        if (!find(key))
+            throw VirusNotFound();
+
+        if (id == stem_id)
+            throw TriedToRemoveStemVirus();
+
+        auto stem_key = key_of(stem_id);
+        std::set<std::string> removed{key};
+        std::map<std::string, std::uint32_t> removed_parents;
+        std::vector<std::string> to_visit{key};
+
+        while (!to_visit.empty()) {
+            auto current = to_visit.back();
+            to_visit.pop_back();
+            for (auto &child : read_list(find(current)->children_head)) {
+                if (child == stem_key)
+                    continue;
+
+                if (++removed_parents[child] == find(child)->parent_count &&
+                    removed.insert(child).second)
+                    to_visit.push_back(child);
+            }
+        }
+
+        for (auto &removed_key : removed) {
+            auto gone = *find(removed_key);
+
+            for (auto &parent_key : read_list(gone.parents_head)) {
+                if (removed.contains(parent_key))
+                    continue;
+                auto parent = *find(parent_key);
+                erase_from(parent.children_head, removed_key);
+                --parent.child_count;
+                put(parent_key, parent);
+            }
+
+            for (auto &child_key : read_list(gone.children_head)) {
+                if (removed.contains(child_key))
+                    continue;
+                auto child = *find(child_key);
+                erase_from(child.parents_head, removed_key);
+                --child.parent_count;
+                put(child_key, child);
+            }
+        }
+
+        for (auto &removed_key : removed) {
+            auto gone = *find(removed_key);
+            release_list(gone.parents_head);
+            release_list(gone.children_head);
+            put(removed_key, record{0, 0, 0, 0, false});
+        }
+    }
+};
+
+#endif
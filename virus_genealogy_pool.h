@@ -0,0 +1,118 @@
+#ifndef _VIRUS_GENEALOGY_POOL_
+#define _VIRUS_GENEALOGY_POOL_
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_arena.h"
+
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+//Many small genealogies - e.g. one per patient - sharing one arena. Instead
+//of each paying for its own allocations they carve nodes, adjacency, the
+//degree index and the Euler tour out of common chunks, and clear() gives all
+//memory back to the system at once. destroy() frees the nodes of one
+//genealogy one by one, O(n), for other genealogies to reuse. Aggregates,
+//lineage signatures and the Virus objects handed out by operator[] are still
+//allocated with std::allocator.
+//
+//Genealogies are reached by handles, which are reused after destroy().
+template<typename Virus>
+class VirusGenealogyPool {
+public:
+    using allocator_t = arena_allocator<typename Virus::id_type>;
+    using genealogy_t = VirusGenealogy<Virus, allocator_t>;
+    using handle = std::size_t;
+
+private:
+    genealogy_arena arena;
+    std::deque<std::optional<genealogy_t>> slots;
+    std::vector<handle> free_slots;
+    std::size_t alive = 0;
+
+    inline std::optional<genealogy_t> &slot(handle h) {
+        if (h >= slots.size() || !slots[h])
+            throw std::out_of_range("No genealogy with this handle");
+
+        return slots[h];
+    }
+
+public:
+    inline explicit VirusGenealogyPool(
+            page_backing backing = page_backing::normal, int numa_node = -1)
+            : arena(backing, numa_node) {}
+
+    VirusGenealogyPool(const VirusGenealogyPool &) = delete;
+
+    VirusGenealogyPool &operator=(const VirusGenealogyPool &) = delete;
+
+    inline ~VirusGenealogyPool() {
+        clear();
+    }
+
+    //Strong guarantee - a taken slot is given back if the genealogy cannot
+    //be constructed.
+    inline handle create(typename Virus::id_type const &stem_id,
+                         genealogy_mode mode = genealogy_mode::dag) {
+        free_slots.reserve(slots.size() + 1);
+
+        handle h;
+        if (free_slots.empty()) {
+            slots.emplace_back();
+            h = slots.size() - 1;
+        } else {
+            h = free_slots.back();
+            free_slots.pop_back();
+        }
+
+        try {
+            slots[h].emplace(stem_id, allocator_t(arena), mode);
+        }
+        catch (...) {
+            //Nothrow thanks to the reserve above.
+            free_slots.push_back(h);
+            throw;
+        }
+
+        ++alive;
+        return h;
+    }
+
+    inline genealogy_t &operator[](handle h) {
+        return *slot(h);
+    }
+
+    inline bool contains(handle h) const noexcept {
+        return h < slots.size() && slots[h].has_value();
+    }
+
+    inline std::size_t size() const noexcept {
+        return alive;
+    }
+
+    inline std::size_t mapped_bytes() noexcept {
+        return arena.mapped_bytes();
+    }
+
+    //Nodes of the genealogy go back to the arena for other genealogies,
+    //one by one, in O(n).
+    inline void destroy(handle h) {
+        auto &destroyed = slot(h);
+        free_slots.reserve(free_slots.size() + 1);
+        destroyed.reset();
+        free_slots.push_back(h);
+        --alive;
+    }
+
+    //Destroys all genealogies and returns the whole arena to the system.
+    inline void clear() noexcept {
+        slots.clear();
+        free_slots.clear();
+        alive = 0;
+        arena.release();
+    }
+};
+
+#endif
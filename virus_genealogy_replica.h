@@ -0,0 +1,240 @@
+#ifndef _VIRUS_GENEALOGY_REPLICA_
+#define _VIRUS_GENEALOGY_REPLICA_
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_wal.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+//Read-only copy of a genealogy kept up to date by tailing the write-ahead
+//log of a DurableVirusGenealogy while it is written. catch_up() applies
+//whatever complete records have arrived as one batch under one lock, so
+//readers see whole batches; follow() does it periodically on a thread of
+//its own, which bounds staleness by the interval.
+//
+//The log only holds mutations which succeeded on the primary, so one that
+//fails here means the replica diverged - it stops there and reports it.
+template<typename Virus>
+class ReplicaVirusGenealogy {
+private:
+    using id_t = typename Virus::id_type;
+    using record_t = genealogy_wal_record<id_t>;
+    using clock_t = std::chrono::steady_clock;
+
+    //Guards the log and the undecoded bytes, taken by catch_up only.
+    std::mutex tail_mutex;
+    int fd = -1;
+    //Offset in the log of the first record not applied yet.
+    std::uint64_t position = 0;
+    //Bytes of the log from position on, read again each time, as a gap
+    //left by writes completing out of order may have been filled since.
+    std::string tail;
+
+    mutable std::shared_mutex mutex;
+    VirusGenealogy<Virus> genealogy;
+
+    std::atomic<std::size_t> applied = 0;
+    std::atomic<clock_t::rep> caught_up_at =
+            clock_t::now().time_since_epoch().count();
+    std::exception_ptr failure;
+
+    std::mutex follow_mutex;
+    std::condition_variable follow_wake;
+    bool stopping = false;
+    std::thread follower;
+
+    static inline int open_log(std::string const &path) {
+        int result = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (result < 0)
+            throw std::system_error(errno, std::generic_category(),
+                                    "open genealogy log");
+        return result;
+    }
+
+    //Reads everything the log holds now past position.
+    inline void read_available() {
+        char buffer[65536];
+        tail.clear();
+        for (;;) {
+            auto got = ::pread(fd, buffer, sizeof(buffer),
+                               static_cast<off_t>(position + tail.size()));
+            if (got > 0) {
+                tail.append(buffer, got);
+                continue;
+            }
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                throw std::system_error(errno, std::generic_category(),
+                                        "read genealogy log");
+            return;
+        }
+    }
+
+    inline std::size_t apply_tail() {
+        std::vector<record_t> batch;
+        std::string_view rest(tail);
+        while (auto record = record_t::decode(rest))
+            batch.push_back(std::move(*record));
+        auto consumed = tail.size() - rest.size();
+
+        std::size_t done = 0;
+        {
+            std::unique_lock lock(mutex);
+            try {
+                for (; done < batch.size(); ++done)
+                    batch[done].apply(genealogy);
+            }
+            catch (...) {
+                failure = std::current_exception();
+            }
+        }
+
+        applied += done;
+        if (failure)
+            std::rethrow_exception(failure);
+        tail.erase(0, consumed);
+        position += consumed;
+        return done;
+    }
+
+    inline void stop_following() noexcept {
+        {
+            std::lock_guard lock(follow_mutex);
+            stopping = true;
+        }
+        follow_wake.notify_one();
+        if (follower.joinable())
+            follower.join();
+        stopping = false;
+    }
+
+public:
+    inline ReplicaVirusGenealogy(id_t const &stem_id,
+                                 std::string const &log_path,
+                                 genealogy_mode mode = genealogy_mode::dag)
+            : fd(open_log(log_path)), genealogy(stem_id, mode) {}
+
+    //Starts from a snapshot and the log segment begun with it.
+    inline ReplicaVirusGenealogy(genealogy_topology<id_t> const &snapshot,
+                                 std::string const &log_path,
+                                 unsigned threads = 1)
+            : fd(open_log(log_path)), genealogy(snapshot, threads) {}
+
+    ReplicaVirusGenealogy(const ReplicaVirusGenealogy &) = delete;
+
+    ReplicaVirusGenealogy &operator=(const ReplicaVirusGenealogy &) = delete;
+
+    inline ~ReplicaVirusGenealogy() {
+        stop_following();
+        ::close(fd);
+    }
+
+    //Applies the records which arrived since the last call, returns how
+    //many. Rethrows the failure which stopped the replica, if any.
+    inline std::size_t catch_up() {
+        std::lock_guard lock(tail_mutex);
+        if (failure)
+            std::rethrow_exception(failure);
+
+        read_available();
+        auto result = apply_tail();
+        caught_up_at = clock_t::now().time_since_epoch().count();
+        return result;
+    }
+
+    //Continues with the next log segment, e.g. after the primary made a
+    //checkpoint, once the current one is applied to its end.
+    inline void switch_log(std::string const &log_path) {
+        std::lock_guard lock(tail_mutex);
+        if (failure)
+            std::rethrow_exception(failure);
+
+        int next = open_log(log_path);
+        try {
+            read_available();
+            apply_tail();
+        }
+        catch (...) {
+            ::close(next);
+            throw;
+        }
+        if (!tail.empty()) {
+            ::close(next);
+            throw std::runtime_error("Genealogy log segment ends mid-record");
+        }
+        ::close(fd);
+        fd = next;
+        position = 0;
+    }
+
+    //Catches up every interval on a background thread until stop() or a
+    //failure, which error() then holds.
+    inline void follow(std::chrono::milliseconds interval) {
+        stop_following();
+        follower = std::thread([this, interval] {
+            std::unique_lock lock(follow_mutex);
+            while (!stopping) {
+                lock.unlock();
+                try {
+                    catch_up();
+                }
+                catch (...) {
+                    std::lock_guard failed(tail_mutex);
+                    if (!failure)
+                        failure = std::current_exception();
+                    return;
+                }
+                lock.lock();
+                follow_wake.wait_for(lock, interval, [this] {
+                    return stopping;
+                });
+            }
+        });
+    }
+
+    inline void stop() noexcept {
+        stop_following();
+    }
+
+    inline std::exception_ptr error() {
+        std::lock_guard lock(tail_mutex);
+        return failure;
+    }
+
+    //Runs f on the genealogy under a shared lock.
+    template<typename F>
+    inline decltype(auto) read(F &&f) const {
+        std::shared_lock lock(mutex);
+        return std::forward<F>(f)(genealogy);
+    }
+
+    inline std::size_t applied_records() const noexcept {
+        return applied.load();
+    }
+
+    //When the replica last reached the end of the log, the bound on how
+    //stale it is.
+    inline clock_t::time_point caught_up() const noexcept {
+        return clock_t::time_point(clock_t::duration(caught_up_at.load()));
+    }
+};
+
+#endif
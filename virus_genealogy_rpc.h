@@ -0,0 +1,684 @@
+#ifndef _VIRUS_GENEALOGY_RPC_
+#define _VIRUS_GENEALOGY_RPC_
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_codec.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//Protocol spoken over a Unix stream socket. Every request and reply is a
+//frame - a varint size followed by that many bytes. Requests are an op byte
+//and ids as put_id, replies a status byte and, on success, the result.
+//Replies come in the order of requests, so a client may send many requests
+//before reading any reply.
+//
+//  exists       id                 -> u8
+//  get_parents  id                 -> varint count, ids
+//  get_children id                 -> varint count, ids
+//  create       id, varint count, parent ids
+//  connect      child id, parent id
+//  remove       id
+//  get_stem_id                     -> id
+//  children_page id, u8 has cursor, [cursor id], varint limit
+//                                  -> varint count, ids
+//
+//A reply which would not fit in a frame, e.g. get_children of a hub, is
+//replaced by the status reply_too_large; children_page reads such a list
+//in parts.
+enum class genealogy_rpc_op : std::uint8_t {
+    exists = 1, get_parents, get_children, create, connect, remove,
+    get_stem_id, children_page
+};
+
+enum class genealogy_rpc_status : std::uint8_t {
+    ok = 0, virus_not_found, virus_already_created, tried_to_remove_stem_virus,
+    tried_to_add_second_parent, invalid_argument, failed, reply_too_large
+};
+
+struct genealogy_rpc_frame {
+    static constexpr std::size_t max_size = 16 << 20;
+
+    static inline void put(std::string &out, std::string_view payload) {
+        genealogy_bytes::put_varint(out, payload.size());
+        out.append(payload);
+    }
+
+    //Takes a whole frame from the front of in, if it holds one yet.
+    static inline std::optional<std::string_view> take(std::string_view &in) {
+        std::size_t length = 0;
+        while (length < in.size() && length < 10 && (in[length] & 0x80))
+            ++length;
+        if (length == in.size())
+            return std::nullopt;
+        if (length == 10)
+            throw std::runtime_error("Malformed frame");
+
+        auto rest = in;
+        auto size = genealogy_bytes::get_varint(rest);
+        if (size > max_size)
+            throw std::runtime_error("Frame too large");
+        if (rest.size() < size)
+            return std::nullopt;
+
+        in = rest.substr(size);
+        return rest.substr(0, size);
+    }
+
+    [[noreturn]] static inline void system_failure(const char *what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    static inline sockaddr_un address(std::string const &path) {
+        sockaddr_un result{};
+        result.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(result.sun_path))
+            throw std::invalid_argument("Socket path too long");
+        std::memcpy(result.sun_path, path.c_str(), path.size() + 1);
+        return result;
+    }
+};
+
+//Serves a genealogy to many clients on one thread, multiplexed by poll.
+//Everything a client has sent is handled before its replies are written
+//back with one write, so pipelined requests cost one round trip.
+//
+//A client is not read from while more than max_buffered bytes of replies
+//wait for it, so one that sends without reading holds at most that much
+//plus a frame. When the process runs out of descriptors, accepting pauses
+//for accept_pause instead of polling the listener in a busy loop.
+template<typename Virus, typename Genealogy = VirusGenealogy<Virus>>
+class genealogy_rpc_server {
+private:
+    using id_t = typename Virus::id_type;
+    using op = genealogy_rpc_op;
+    using status = genealogy_rpc_status;
+
+    static constexpr std::size_t max_buffered = 4 << 20;
+    static constexpr std::chrono::milliseconds accept_pause{100};
+
+    struct client {
+        int fd;
+        std::string in;
+        std::string out;
+        //The client is done sending. It is kept until its replies are out.
+        bool closed = false;
+    };
+
+    Genealogy &genealogy;
+    std::string path;
+    int listener = -1;
+    int wake[2] = {-1, -1};
+    std::list<client> clients;
+    std::chrono::steady_clock::time_point accept_paused_until{};
+
+    static inline void put_ids(std::string &out, std::vector<id_t> const &ids) {
+        genealogy_bytes::put_varint(out, ids.size());
+        for (auto &id : ids)
+            genealogy_bytes::put_id(out, id);
+    }
+
+    inline std::string answer(std::string_view request) {
+        std::string reply(1, static_cast<char>(status::ok));
+        try {
+            if (request.empty())
+                throw std::runtime_error("Empty request");
+            auto code = static_cast<op>(request.front());
+            request.remove_prefix(1);
+
+            switch (code) {
+                case op::exists:
+                    reply.push_back(genealogy.exists(
+                            genealogy_bytes::get_id<id_t>(request)));
+                    break;
+                case op::get_parents:
+                    put_ids(reply, genealogy.get_parents(
+                            genealogy_bytes::get_id<id_t>(request)));
+                    break;
+                case op::get_children:
+                    put_ids(reply, genealogy.get_children(
+                            genealogy_bytes::get_id<id_t>(request)));
+                    break;
+                case op::create: {
+                    auto id = genealogy_bytes::get_id<id_t>(request);
+                    auto count = genealogy_bytes::get_varint(request);
+                    if (count > request.size())
+                        throw std::runtime_error("Malformed request");
+                    std::vector<id_t> parent_ids;
+                    for (std::uint64_t i = 0; i < count; ++i)
+                        parent_ids.push_back(
+                                genealogy_bytes::get_id<id_t>(request));
+                    if (!request.empty())
+                        throw std::runtime_error("Malformed request");
+                    genealogy.create(id, parent_ids);
+                    return reply;
+                }
+                case op::connect: {
+                    auto child_id = genealogy_bytes::get_id<id_t>(request);
+                    auto parent_id = genealogy_bytes::get_id<id_t>(request);
+                    if (!request.empty())
+                        throw std::runtime_error("Malformed request");
+                    genealogy.connect(child_id, parent_id);
+                    return reply;
+                }
+                case op::remove: {
+                    auto id = genealogy_bytes::get_id<id_t>(request);
+                    if (!request.empty())
+                        throw std::runtime_error("Malformed request");
+                    genealogy.remove(id);
+                    return reply;
+                }
+                case op::get_stem_id:
+                    genealogy_bytes::put_id(reply, genealogy.get_stem_id());
+                    break;
+                case op::children_page: {
+                    auto id = genealogy_bytes::get_id<id_t>(request);
+                    if (request.empty())
+                        throw std::runtime_error("Malformed request");
+                    std::optional<id_t> cursor;
+                    auto has_cursor = request.front();
+                    request.remove_prefix(1);
+                    if (has_cursor)
+                        cursor = genealogy_bytes::get_id<id_t>(request);
+                    auto limit = genealogy_bytes::get_varint(request);
+                    if constexpr (requires {
+                        genealogy.children_page(id, cursor, limit);
+                    })
+                        put_ids(reply, genealogy.children_page(id, cursor,
+                                                               limit));
+                    else
+                        throw std::runtime_error("Unknown request");
+                    break;
+                }
+                default:
+                    throw std::runtime_error("Unknown request");
+            }
+            if (!request.empty())
+                throw std::runtime_error("Malformed request");
+            if (reply.size() > genealogy_rpc_frame::max_size)
+                return std::string(1,
+                                   static_cast<char>(status::reply_too_large));
+        }
+        catch (VirusNotFound const &) {
+            return std::string(1, static_cast<char>(status::virus_not_found));
+        }
+        catch (VirusAlreadyCreated const &) {
+            return std::string(1,
+                               static_cast<char>(status::virus_already_created));
+        }
+        catch (TriedToRemoveStemVirus const &) {
+            return std::string(
+                    1, static_cast<char>(status::tried_to_remove_stem_virus));
+        }
+        catch (TriedToAddSecondParent const &) {
+            return std::string(
+                    1, static_cast<char>(status::tried_to_add_second_parent));
+        }
+        catch (std::invalid_argument const &) {
+            return std::string(1, static_cast<char>(status::invalid_argument));
+        }
+        catch (std::exception const &) {
+            //Malformed requests too, their frame still keeps the stream
+            //in step.
+            return std::string(1, static_cast<char>(status::failed));
+        }
+        return reply;
+    }
+
+    //Answers the whole frames received so far. False once the client
+    //broke the framing.
+    inline bool answer_received(client &c) {
+        try {
+            std::string_view pending = c.in;
+            while (auto request = genealogy_rpc_frame::take(pending))
+                genealogy_rpc_frame::put(c.out, answer(*request));
+            c.in.erase(0, c.in.size() - pending.size());
+        }
+        catch (std::runtime_error const &) {
+            return false;
+        }
+        catch (std::bad_alloc const &) {
+            return false;
+        }
+        return true;
+    }
+
+    //Reads until the socket is empty or max_buffered bytes of replies wait.
+    //False once the client broke the framing. Sets closed when the client
+    //is done sending, what it sent before is still answered.
+    inline bool receive(client &c, bool &closed) {
+        char buffer[65536];
+        while (c.out.size() < max_buffered) {
+            auto got = ::read(c.fd, buffer, sizeof(buffer));
+            if (got > 0) {
+                c.in.append(buffer, got);
+                if (!answer_received(c))
+                    return false;
+                continue;
+            }
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            closed = true;
+            break;
+        }
+        return true;
+    }
+
+    inline bool send(client &c) {
+        while (!c.out.empty()) {
+            auto sent = ::send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (sent < 0)
+                return false;
+            c.out.erase(0, sent);
+        }
+        return true;
+    }
+
+    inline void accept_clients() {
+        for (;;) {
+            int fd = ::accept4(listener, nullptr, nullptr,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0 && (errno == EINTR || errno == ECONNABORTED))
+                continue;
+            if (fd < 0 && (errno == EMFILE || errno == ENFILE ||
+                           errno == ENOBUFS || errno == ENOMEM))
+                accept_paused_until =
+                        std::chrono::steady_clock::now() + accept_pause;
+            if (fd < 0)
+                return;
+            try {
+                clients.push_back({fd, {}, {}, false});
+            }
+            catch (...) {
+                ::close(fd);
+                throw;
+            }
+        }
+    }
+
+public:
+    //Listens on path, replacing whatever socket was left there.
+    inline genealogy_rpc_server(Genealogy &genealogy, std::string const &path)
+            : genealogy(genealogy), path(path) {
+        auto address = genealogy_rpc_frame::address(path);
+        if (::pipe2(wake, O_NONBLOCK | O_CLOEXEC) < 0)
+            genealogy_rpc_frame::system_failure("pipe");
+
+        listener = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            0);
+        if (listener < 0) {
+            close();
+            genealogy_rpc_frame::system_failure("socket");
+        }
+        ::unlink(path.c_str());
+        if (::bind(listener, reinterpret_cast<sockaddr *>(&address),
+                   sizeof(address)) < 0 || ::listen(listener, 128) < 0) {
+            auto error = errno;
+            close();
+            errno = error;
+            genealogy_rpc_frame::system_failure("bind");
+        }
+    }
+
+    genealogy_rpc_server(const genealogy_rpc_server &) = delete;
+
+    genealogy_rpc_server &operator=(const genealogy_rpc_server &) = delete;
+
+    inline ~genealogy_rpc_server() {
+        close();
+        ::unlink(path.c_str());
+    }
+
+    inline void close() noexcept {
+        for (auto &c : clients)
+            ::close(c.fd);
+        clients.clear();
+        for (int fd : {listener, wake[0], wake[1]})
+            if (fd >= 0)
+                ::close(fd);
+        listener = wake[0] = wake[1] = -1;
+    }
+
+    //Serves until stop() is called.
+    inline void run() {
+        std::vector<pollfd> fds;
+        for (;;) {
+            auto paused = accept_paused_until -
+                          std::chrono::steady_clock::now();
+            auto accepting = paused <= paused.zero();
+            fds.clear();
+            fds.push_back({wake[0], POLLIN, 0});
+            fds.push_back({listener,
+                           static_cast<short>(accepting ? POLLIN : 0), 0});
+            for (auto &c : clients)
+                fds.push_back({c.fd, static_cast<short>(
+                        (c.closed || c.out.size() >= max_buffered
+                         ? 0 : POLLIN) |
+                        (c.out.empty() ? 0 : POLLOUT)), 0});
+
+            auto timeout = accepting
+                    ? -1
+                    : static_cast<int>(std::chrono::ceil<
+                            std::chrono::milliseconds>(paused).count());
+            if (::poll(fds.data(), fds.size(), timeout) < 0) {
+                if (errno == EINTR)
+                    continue;
+                genealogy_rpc_frame::system_failure("poll");
+            }
+            if (fds[0].revents)
+                return;
+            if (fds[1].revents & POLLIN)
+                accept_clients();
+
+            auto it = clients.begin();
+            for (std::size_t i = 2; i < fds.size(); ++i) {
+                auto &c = *it;
+                bool alive = true;
+                if (!c.closed && c.out.size() < max_buffered &&
+                    fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    alive = receive(c, c.closed);
+                if (alive)
+                    alive = send(c) && !(c.closed && c.out.empty());
+                if (alive) {
+                    ++it;
+                } else {
+                    ::close(c.fd);
+                    it = clients.erase(it);
+                }
+            }
+        }
+    }
+
+    //Makes run() return, safe to call from other threads and from signal
+    //handlers.
+    inline void stop() noexcept {
+        char byte = 0;
+        [[maybe_unused]] auto ignored = ::write(wake[1], &byte, 1);
+    }
+};
+
+template<typename Id>
+struct genealogy_rpc_reply {
+    genealogy_rpc_status status;
+    bool exists = false;
+    std::vector<Id> ids;
+};
+
+//Client side of the protocol. The plain calls mirror VirusGenealogy and
+//throw its exceptions, a pipeline sends many requests in one go.
+template<typename Id>
+class genealogy_rpc_client {
+private:
+    using op = genealogy_rpc_op;
+    using status = genealogy_rpc_status;
+    using reply_t = genealogy_rpc_reply<Id>;
+
+    int fd = -1;
+    std::string in;
+
+    inline void send_all(std::string const &bytes) {
+        std::size_t done = 0;
+        while (done < bytes.size()) {
+            auto sent = ::send(fd, bytes.data() + done, bytes.size() - done,
+                               MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent < 0)
+                genealogy_rpc_frame::system_failure("send");
+            done += sent;
+        }
+    }
+
+    inline std::string receive_frame() {
+        for (;;) {
+            std::string_view pending = in;
+            if (auto frame = genealogy_rpc_frame::take(pending)) {
+                std::string result(*frame);
+                in.erase(0, in.size() - pending.size());
+                return result;
+            }
+
+            char buffer[65536];
+            auto got = ::read(fd, buffer, sizeof(buffer));
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0)
+                genealogy_rpc_frame::system_failure("read");
+            if (got == 0)
+                throw std::runtime_error("Genealogy server closed connection");
+            in.append(buffer, got);
+        }
+    }
+
+    static inline reply_t parse(op code, std::string_view bytes) {
+        if (bytes.empty())
+            throw std::runtime_error("Malformed reply");
+        reply_t reply{static_cast<status>(bytes.front()), false, {}};
+        bytes.remove_prefix(1);
+        if (reply.status != status::ok)
+            return reply;
+
+        switch (code) {
+            case op::exists:
+                if (bytes.size() != 1)
+                    throw std::runtime_error("Malformed reply");
+                reply.exists = bytes.front() != 0;
+                bytes.remove_prefix(1);
+                break;
+            case op::get_parents:
+            case op::get_children:
+            case op::children_page: {
+                auto count = genealogy_bytes::get_varint(bytes);
+                if (count > bytes.size())
+                    throw std::runtime_error("Malformed reply");
+                reply.ids.reserve(count);
+                for (std::uint64_t i = 0; i < count; ++i)
+                    reply.ids.push_back(genealogy_bytes::get_id<Id>(bytes));
+                break;
+            }
+            case op::get_stem_id:
+                reply.ids.push_back(genealogy_bytes::get_id<Id>(bytes));
+                break;
+            default:
+                break;
+        }
+        if (!bytes.empty())
+            throw std::runtime_error("Malformed reply");
+        return reply;
+    }
+
+    static inline reply_t const &check(reply_t const &reply) {
+        switch (reply.status) {
+            case status::ok:
+                return reply;
+            case status::virus_not_found:
+                throw VirusNotFound();
+            case status::virus_already_created:
+                throw VirusAlreadyCreated();
+            case status::tried_to_remove_stem_virus:
+                throw TriedToRemoveStemVirus();
+            case status::tried_to_add_second_parent:
+                throw TriedToAddSecondParent();
+            case status::invalid_argument:
+                throw std::invalid_argument("Rejected by genealogy server");
+            case status::reply_too_large:
+                throw std::length_error("Genealogy server reply too large");
+            default:
+                throw std::runtime_error("Genealogy server failed");
+        }
+    }
+
+public:
+    //Requests queued with the calls below and sent by run() at once.
+    class pipeline {
+    private:
+        genealogy_rpc_client &client;
+        std::string out;
+        std::vector<op> codes;
+
+        inline pipeline &add(op code, std::vector<Id> const &ids,
+                             bool counted = false) {
+            std::string request(1, static_cast<char>(code));
+            for (std::size_t i = 0; i < ids.size(); ++i) {
+                if (counted && i == 1)
+                    genealogy_bytes::put_varint(request, ids.size() - 1);
+                genealogy_bytes::put_id(request, ids[i]);
+            }
+            if (counted && ids.size() == 1)
+                genealogy_bytes::put_varint(request, 0);
+
+            genealogy_rpc_frame::put(out, request);
+            codes.push_back(code);
+            return *this;
+        }
+
+    public:
+        inline explicit pipeline(genealogy_rpc_client &client)
+                : client(client) {}
+
+        inline pipeline &exists(Id const &id) {
+            return add(op::exists, {id});
+        }
+
+        inline pipeline &get_parents(Id const &id) {
+            return add(op::get_parents, {id});
+        }
+
+        inline pipeline &get_children(Id const &id) {
+            return add(op::get_children, {id});
+        }
+
+        inline pipeline &get_stem_id() {
+            return add(op::get_stem_id, {});
+        }
+
+        inline pipeline &children_page(Id const &id,
+                                       std::optional<Id> const &cursor,
+                                       std::size_t limit) {
+            std::string request(1, static_cast<char>(op::children_page));
+            genealogy_bytes::put_id(request, id);
+            request.push_back(cursor.has_value());
+            if (cursor)
+                genealogy_bytes::put_id(request, *cursor);
+            genealogy_bytes::put_varint(request, limit);
+
+            genealogy_rpc_frame::put(out, request);
+            codes.push_back(op::children_page);
+            return *this;
+        }
+
+        inline pipeline &create(Id const &id,
+                                std::vector<Id> const &parent_ids) {
+            std::vector<Id> ids{id};
+            ids.insert(ids.end(), parent_ids.begin(), parent_ids.end());
+            return add(op::create, ids, true);
+        }
+
+        inline pipeline &connect(Id const &child_id, Id const &parent_id) {
+            return add(op::connect, {child_id, parent_id});
+        }
+
+        inline pipeline &remove(Id const &id) {
+            return add(op::remove, {id});
+        }
+
+        //Replies in the order of requests, failed ones only carry a status.
+        inline std::vector<reply_t> run() {
+            client.send_all(out);
+            out.clear();
+
+            std::vector<reply_t> replies;
+            replies.reserve(codes.size());
+            for (auto code : codes)
+                replies.push_back(parse(code, client.receive_frame()));
+            codes.clear();
+            return replies;
+        }
+    };
+
+    inline explicit genealogy_rpc_client(std::string const &path) {
+        auto address = genealogy_rpc_frame::address(path);
+        fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            genealogy_rpc_frame::system_failure("socket");
+        if (::connect(fd, reinterpret_cast<sockaddr *>(&address),
+                      sizeof(address)) < 0) {
+            auto error = errno;
+            ::close(fd);
+            errno = error;
+            genealogy_rpc_frame::system_failure("connect");
+        }
+    }
+
+    genealogy_rpc_client(const genealogy_rpc_client &) = delete;
+
+    genealogy_rpc_client &operator=(const genealogy_rpc_client &) = delete;
+
+    inline ~genealogy_rpc_client() {
+        ::close(fd);
+    }
+
+    inline Id get_stem_id() {
+        return check(pipeline(*this).get_stem_id().run().front()).ids.front();
+    }
+
+    inline bool exists(Id const &id) {
+        return check(pipeline(*this).exists(id).run().front()).exists;
+    }
+
+    inline std::vector<Id> get_parents(Id const &id) {
+        return check(pipeline(*this).get_parents(id).run().front()).ids;
+    }
+
+    //Throws std::length_error for a list too long for one reply.
+    inline std::vector<Id> get_children(Id const &id) {
+        return check(pipeline(*this).get_children(id).run().front()).ids;
+    }
+
+    inline std::vector<Id> children_page(Id const &id,
+                                         std::optional<Id> const &cursor,
+                                         std::size_t limit) {
+        return check(pipeline(*this).children_page(id, cursor, limit)
+                             .run().front()).ids;
+    }
+
+    inline void create(Id const &id, Id const &parent_id) {
+        create(id, std::vector<Id>{parent_id});
+    }
+
+    inline void create(Id const &id, std::vector<Id> const &parent_ids) {
+        check(pipeline(*this).create(id, parent_ids).run().front());
+    }
+
+    inline void connect(Id const &child_id, Id const &parent_id) {
+        check(pipeline(*this).connect(child_id, parent_id).run().front());
+    }
+
+    inline void remove(Id const &id) {
+        check(pipeline(*this).remove(id).run().front());
+    }
+};
+
+#endif
@@ -0,0 +1,172 @@
+#ifndef _VIRUS_GENEALOGY_SKETCH_
+#define _VIRUS_GENEALOGY_SKETCH_
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+//Spreads the bits of a hash, which for integer ids is often the id itself.
+inline constexpr std::uint64_t genealogy_mix_hash(std::uint64_t hash) noexcept {
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebull;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+//HyperLogLog sketch of a set of hashes, estimating its size to about 1.6%
+//(1.04 / sqrt(registers)). Up to sparse_limit hashes it keeps the hashes
+//themselves instead, which take no more room and count small sets exactly,
+//and merge quickly.
+class genealogy_hll {
+public:
+    static constexpr unsigned precision = 12;
+    static constexpr std::size_t registers = std::size_t(1) << precision;
+
+    //Strong guarantee.
+    inline void add(std::uint64_t hash) {
+        hash = genealogy_mix_hash(hash);
+        if (!dense.empty()) {
+            set_register(dense, hash);
+            return;
+        }
+
+        auto it = std::lower_bound(sparse.begin(), sparse.end(), hash);
+        if (it != sparse.end() && *it == hash)
+            return;
+        if (sparse.size() == sparse_limit) {
+            auto grown = densified();
+            set_register(grown, hash);
+            dense.swap(grown);
+            sparse.clear();
+            return;
+        }
+        sparse.insert(it, hash);
+    }
+
+    //Strong guarantee. Makes this the sketch of the union of both sets.
+    inline void merge(genealogy_hll const &other) {
+        if (dense.empty() && other.dense.empty()) {
+            std::vector<std::uint64_t> merged;
+            merged.reserve(sparse.size() + other.sparse.size());
+            std::set_union(sparse.begin(), sparse.end(), other.sparse.begin(),
+                           other.sparse.end(), std::back_inserter(merged));
+            if (merged.size() <= sparse_limit) {
+                sparse.swap(merged);
+                return;
+            }
+        }
+
+        auto result = dense.empty() ? densified() : dense;
+        if (other.dense.empty())
+            for (auto hash : other.sparse)
+                set_register(result, hash);
+        else
+            for (std::size_t i = 0; i < registers; ++i)
+                result[i] = std::max(result[i], other.dense[i]);
+        dense.swap(result);
+        sparse.clear();
+    }
+
+    //Estimated number of distinct hashes added, exact up to sparse_limit.
+    inline double estimate() const noexcept {
+        if (dense.empty())
+            return static_cast<double>(sparse.size());
+
+        double sum = 0;
+        std::size_t zeros = 0;
+        for (auto rank : dense) {
+            zeros += rank == 0;
+            sum += std::ldexp(1.0, -static_cast<int>(rank));
+        }
+
+        constexpr double m = registers;
+        auto raw = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+        //Small sets are counted better by the registers left empty.
+        if (raw <= 2.5 * m && zeros != 0)
+            return m * std::log(m / static_cast<double>(zeros));
+        return raw;
+    }
+
+private:
+    static constexpr std::size_t sparse_limit =
+            registers / sizeof(std::uint64_t);
+
+    //Either of them is empty. Hashes are sorted.
+    std::vector<std::uint64_t> sparse;
+    std::vector<std::uint8_t> dense;
+
+    static inline void set_register(std::vector<std::uint8_t> &to,
+                                    std::uint64_t hash) noexcept {
+        auto index = hash >> (64 - precision);
+        auto rest = (hash << precision) | (std::uint64_t(1) << (precision - 1));
+        auto rank = static_cast<std::uint8_t>(std::countl_zero(rest) + 1);
+        to[index] = std::max(to[index], rank);
+    }
+
+    inline std::vector<std::uint8_t> densified() const {
+        std::vector<std::uint8_t> result(registers, 0);
+        for (auto hash : sparse)
+            set_register(result, hash);
+        return result;
+    }
+};
+
+//MinHash signature of a set of hashes - the least value of each of several
+//independent hash functions over its members. The fraction of equal values
+//of two signatures estimates the Jaccard similarity of their sets, to about
+//1 / sqrt(values). Split into bands of rows values each, signatures of sets
+//at least about 50% similar likely share a band, which is what
+//locality-sensitive hashing looks them up by.
+class genealogy_minhash {
+public:
+    static constexpr std::size_t values = 64;
+    static constexpr std::size_t rows = 4;
+    static constexpr std::size_t bands = values / rows;
+
+    //Signature of the empty set.
+    inline genealogy_minhash() noexcept {
+        least.fill(UINT64_MAX);
+    }
+
+    //Signature of the set of just hash.
+    inline explicit genealogy_minhash(std::uint64_t hash) noexcept {
+        hash = genealogy_mix_hash(hash);
+        for (std::size_t i = 0; i < values; ++i)
+            least[i] = genealogy_mix_hash(hash + (i + 1) * 0x9e3779b97f4a7c15ull);
+    }
+
+    //Makes this the signature of the union of both sets.
+    inline void merge(genealogy_minhash const &other) noexcept {
+        for (std::size_t i = 0; i < values; ++i)
+            least[i] = std::min(least[i], other.least[i]);
+    }
+
+    inline double similarity(genealogy_minhash const &other) const noexcept {
+        std::size_t equal = 0;
+        for (std::size_t i = 0; i < values; ++i)
+            equal += least[i] == other.least[i];
+        return static_cast<double>(equal) / values;
+    }
+
+    //Key of a band, different for equal values in different bands.
+    inline std::uint64_t band(std::size_t index) const noexcept {
+        std::uint64_t result = index;
+        for (std::size_t i = index * rows; i < (index + 1) * rows; ++i)
+            result = genealogy_mix_hash(result ^ least[i]);
+        return result;
+    }
+
+    inline bool operator==(genealogy_minhash const &) const = default;
+
+private:
+    std::array<std::uint64_t, values> least;
+};
+
+#endif
@@ -0,0 +1,410 @@
+#ifndef _VIRUS_GENEALOGY_SNAPSHOT_
+#define _VIRUS_GENEALOGY_SNAPSHOT_
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_codec.h"
+#include "virus_genealogy_crc32c.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Snapshot format: a header, a directory and blocks, each block holding ids,
+//parents and creation stamps of block_size consecutive viruses. The
+//directory lets every block be decoded independently, so loading scales
+//with threads.
+//
+//  "VGSNAP03" u32 mode, u32 block size, u64 viruses, u64 stem, u32 blocks
+//  per block: u64 offset, u64 size of ids, u64 size of parents, u64 size of
+//  stamps, u32 CRC32C of the block
+//  u32 CRC32C of the header and directory
+//  per block: ids as put_id, then per virus a varint count of parents and
+//  varint indexes of parents, then per virus a varint creation stamp - or
+//  none at all, if the topology has none
+//
+//Version 02 lacks stamps, version 01 checksums as well, both are still read.
+struct genealogy_snapshot_format {
+    static constexpr char magic[8] = {'V', 'G', 'S', 'N', 'A', 'P', '0', '3'};
+    static constexpr char magic_v2[8] = {'V', 'G', 'S', 'N', 'A', 'P', '0', '2'};
+    static constexpr char magic_v1[8] = {'V', 'G', 'S', 'N', 'A', 'P', '0', '1'};
+    static constexpr std::size_t header_size = 8 + 4 + 4 + 8 + 8 + 4;
+    static constexpr std::size_t directory_entry = 4 * 8 + 4;
+    static constexpr std::size_t directory_entry_v2 = 3 * 8 + 4;
+    static constexpr std::size_t directory_entry_v1 = 3 * 8;
+    static constexpr std::size_t head_checksum = 4;
+
+    [[noreturn]] static inline void corrupt() {
+        throw std::runtime_error("Corrupt genealogy snapshot");
+    }
+
+    //Where the first block starts.
+    static inline std::size_t head_size(std::size_t blocks) noexcept {
+        return header_size + blocks * directory_entry + head_checksum;
+    }
+};
+
+//Size, sizes of the ids and parents parts and checksum of an encoded block.
+struct snapshot_block_info {
+    std::size_t size;
+    std::size_t ids_size;
+    std::size_t parents_size;
+    std::uint32_t crc;
+};
+
+template<typename Id>
+inline std::pair<std::string, snapshot_block_info>
+encode_snapshot_block(genealogy_topology<Id> const &topology,
+                      std::size_t block, std::size_t block_size) {
+    auto from = block * block_size;
+    auto to = std::min(topology.ids.size(), from + block_size);
+    std::string bytes;
+
+    for (auto i = from; i < to; ++i)
+        genealogy_bytes::put_id(bytes, topology.ids[i]);
+    auto ids_size = bytes.size();
+
+    for (auto i = from; i < to; ++i) {
+        auto first = topology.parent_offsets[i];
+        auto last = topology.parent_offsets[i + 1];
+        genealogy_bytes::put_varint(bytes, last - first);
+        for (auto j = first; j < last; ++j)
+            genealogy_bytes::put_varint(bytes, topology.parent_indexes[j]);
+    }
+    auto parents_size = bytes.size() - ids_size;
+
+    if (!topology.created.empty())
+        for (auto i = from; i < to; ++i)
+            genealogy_bytes::put_varint(bytes, topology.created[i]);
+
+    snapshot_block_info info{bytes.size(), ids_size, parents_size,
+                             genealogy_crc32c::compute(bytes.data(),
+                                                       bytes.size())};
+    return {std::move(bytes), info};
+}
+
+inline std::size_t snapshot_blocks(std::size_t viruses,
+                                   std::size_t block_size) noexcept {
+    return (viruses + block_size - 1) / block_size;
+}
+
+//Header and directory, which are followed by the blocks in order.
+template<typename Id>
+inline std::string
+encode_snapshot_head(genealogy_topology<Id> const &topology,
+                     std::size_t block_size,
+                     std::vector<snapshot_block_info> const &blocks) {
+    using format = genealogy_snapshot_format;
+
+    std::string head(format::magic, sizeof(format::magic));
+    genealogy_bytes::put_u32(head, static_cast<std::uint32_t>(topology.mode));
+    genealogy_bytes::put_u32(head, static_cast<std::uint32_t>(block_size));
+    genealogy_bytes::put_u64(head, topology.ids.size());
+    genealogy_bytes::put_u64(head, topology.stem);
+    genealogy_bytes::put_u32(head, static_cast<std::uint32_t>(blocks.size()));
+
+    auto offset = format::head_size(blocks.size());
+    for (auto &block : blocks) {
+        genealogy_bytes::put_u64(head, offset);
+        genealogy_bytes::put_u64(head, block.ids_size);
+        genealogy_bytes::put_u64(head, block.parents_size);
+        genealogy_bytes::put_u64(head,
+                                 block.size - block.ids_size -
+                                 block.parents_size);
+        genealogy_bytes::put_u32(head, block.crc);
+        offset += block.size;
+    }
+    genealogy_bytes::put_u32(head,
+                             genealogy_crc32c::compute(head.data(),
+                                                       head.size()));
+
+    return head;
+}
+
+template<typename Id>
+inline std::string
+encode_snapshot(genealogy_topology<Id> const &topology,
+                std::size_t block_size = 65536) {
+    std::string payload;
+    std::vector<snapshot_block_info> blocks;
+    for (std::size_t block = 0;
+         block < snapshot_blocks(topology.ids.size(), block_size); ++block) {
+        auto [bytes, info] = encode_snapshot_block(topology, block, block_size);
+        blocks.push_back(info);
+        payload += bytes;
+    }
+
+    return encode_snapshot_head(topology, block_size, blocks) + payload;
+}
+
+//Ids, parents and creation stamps of a block, the last empty in versions
+//before 03.
+struct snapshot_block_parts {
+    std::string_view ids;
+    std::string_view parents;
+    std::string_view created;
+};
+
+//Parsed header of a snapshot. Checks the header checksum and that every
+//block lies within data, but not the blocks themselves.
+struct snapshot_head {
+    genealogy_mode mode;
+    std::size_t block_size;
+    std::size_t viruses;
+    std::size_t stem;
+    std::size_t blocks;
+    unsigned version;
+    std::string_view data;
+    std::string_view directory;
+
+    inline explicit snapshot_head(std::string_view snapshot) : data(snapshot) {
+        using format = genealogy_snapshot_format;
+
+        if (data.size() < format::header_size)
+            format::corrupt();
+        if (std::memcmp(data.data(), format::magic, sizeof(format::magic)) == 0)
+            version = 3;
+        else if (std::memcmp(data.data(), format::magic_v2,
+                             sizeof(format::magic_v2)) == 0)
+            version = 2;
+        else if (std::memcmp(data.data(), format::magic_v1,
+                             sizeof(format::magic_v1)) == 0)
+            version = 1;
+        else
+            format::corrupt();
+
+        auto in = data.substr(sizeof(format::magic));
+        auto raw_mode = genealogy_bytes::get_u32(in);
+        if (raw_mode > static_cast<std::uint32_t>(genealogy_mode::tree))
+            format::corrupt();
+        mode = static_cast<genealogy_mode>(raw_mode);
+
+        block_size = genealogy_bytes::get_u32(in);
+        viruses = genealogy_bytes::get_u64(in);
+        stem = genealogy_bytes::get_u64(in);
+        blocks = genealogy_bytes::get_u32(in);
+        auto entry = directory_entry();
+        auto tail = version > 1 ? format::head_checksum : 0;
+        if (block_size == 0 || stem >= viruses ||
+            blocks != snapshot_blocks(viruses, block_size) ||
+            in.size() < blocks * entry + tail)
+            format::corrupt();
+        directory = in.substr(0, blocks * entry);
+
+        if (version > 1) {
+            auto size = format::header_size + directory.size();
+            auto stored = in.substr(directory.size());
+            if (genealogy_bytes::get_u32(stored) !=
+                genealogy_crc32c::compute(data.data(), size))
+                format::corrupt();
+        }
+    }
+
+    inline std::size_t directory_entry() const noexcept {
+        using format = genealogy_snapshot_format;
+
+        return version == 3 ? format::directory_entry
+                            : version == 2 ? format::directory_entry_v2
+                                           : format::directory_entry_v1;
+    }
+
+    inline snapshot_block_parts block(std::size_t index) const {
+        using format = genealogy_snapshot_format;
+
+        auto entry = directory.substr(index * directory_entry());
+        auto offset = genealogy_bytes::get_u64(entry);
+        auto ids_size = genealogy_bytes::get_u64(entry);
+        auto parents_size = genealogy_bytes::get_u64(entry);
+        auto created_size = version == 3 ? genealogy_bytes::get_u64(entry) : 0;
+        if (offset > data.size() || data.size() - offset < ids_size ||
+            data.size() - offset - ids_size < parents_size ||
+            data.size() - offset - ids_size - parents_size < created_size)
+            format::corrupt();
+
+        if (version > 1 &&
+            genealogy_bytes::get_u32(entry) !=
+            genealogy_crc32c::compute(data.data() + offset,
+                                      ids_size + parents_size + created_size))
+            format::corrupt();
+
+        return {data.substr(offset, ids_size),
+                data.substr(offset + ids_size, parents_size),
+                data.substr(offset + ids_size + parents_size, created_size)};
+    }
+};
+
+//Checks every checksum of a snapshot on up to threads threads without
+//decoding anything, which goes about as fast as memory can be read.
+//Snapshots of version 01 have none, for them only the layout is checked.
+inline bool verify_snapshot(std::string_view data, unsigned threads = 1) {
+    try {
+        snapshot_head head(data);
+        genealogy_parallel_for(head.blocks, threads, [&](std::size_t block) {
+            head.block(block);
+        });
+        return true;
+    }
+    catch (std::runtime_error const &) {
+        return false;
+    }
+}
+
+//Decodes blocks on up to threads threads, then stitches their parents
+//together, again in parallel. Every block is checked against its checksum
+//right before it is decoded.
+template<typename Id>
+inline genealogy_topology<Id>
+decode_snapshot(std::string_view data, unsigned threads = 1) {
+    using format = genealogy_snapshot_format;
+
+    snapshot_head head(data);
+    auto n = head.viruses;
+    auto block_size = head.block_size;
+    genealogy_topology<Id> result;
+    result.mode = head.mode;
+    result.stem = head.stem;
+
+    struct decoded {
+        std::vector<Id> ids;
+        std::vector<std::size_t> counts;
+        std::vector<std::size_t> indexes;
+        std::vector<std::uint64_t> created;
+    };
+    std::vector<decoded> parts(head.blocks);
+
+    genealogy_parallel_for(head.blocks, threads, [&](std::size_t block) {
+        auto [ids, parents, created] = head.block(block);
+        auto count = std::min(n, (block + 1) * block_size) - block * block_size;
+        auto &part = parts[block];
+
+        part.ids.reserve(count);
+        part.counts.reserve(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            part.ids.push_back(genealogy_bytes::get_id<Id>(ids));
+
+            auto parent_count = genealogy_bytes::get_varint(parents);
+            if (parent_count > parents.size())
+                format::corrupt();
+            part.counts.push_back(parent_count);
+            for (std::size_t j = 0; j < parent_count; ++j)
+                part.indexes.push_back(genealogy_bytes::get_varint(parents));
+        }
+        if (!created.empty()) {
+            part.created.reserve(count);
+            for (std::size_t i = 0; i < count; ++i)
+                part.created.push_back(genealogy_bytes::get_varint(created));
+        }
+        if (!ids.empty() || !parents.empty() || !created.empty())
+            format::corrupt();
+    });
+
+    //Either every block has stamps or none.
+    auto stamped = !parts.empty() && !parts.front().created.empty();
+    for (auto &part : parts)
+        if (part.created.empty() == stamped)
+            format::corrupt();
+
+    std::vector<std::size_t> index_starts{0};
+    result.ids.reserve(n);
+    result.parent_offsets.reserve(n + 1);
+    if (stamped)
+        result.created.reserve(n);
+    for (auto &part : parts) {
+        for (std::size_t i = 0; i < part.ids.size(); ++i) {
+            result.ids.push_back(std::move(part.ids[i]));
+            result.parent_offsets.push_back(result.parent_offsets.back() +
+                                            part.counts[i]);
+        }
+        result.created.insert(result.created.end(), part.created.begin(),
+                              part.created.end());
+        index_starts.push_back(index_starts.back() + part.indexes.size());
+    }
+
+    result.parent_indexes.resize(index_starts.back());
+    genealogy_parallel_for(head.blocks, threads, [&](std::size_t block) {
+        std::copy(parts[block].indexes.begin(), parts[block].indexes.end(),
+                  result.parent_indexes.begin() + index_starts[block]);
+    });
+
+    return result;
+}
+
+template<typename Virus, typename Allocator>
+inline void save_snapshot(VirusGenealogy<Virus, Allocator> const &genealogy,
+                          std::string const &path) {
+    auto data = encode_snapshot(genealogy.topology());
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(data.data(), data.size());
+    out.flush();
+    if (!out)
+        throw std::runtime_error("Cannot write genealogy snapshot");
+}
+
+//Reads and decodes a snapshot, the result is meant to be handed to the
+//VirusGenealogy constructor along with the same number of threads.
+template<typename Id>
+inline genealogy_topology<Id> load_snapshot(std::string const &path,
+                                            unsigned threads = 1) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+        throw std::runtime_error("Cannot read genealogy snapshot");
+
+    std::string data(static_cast<std::size_t>(in.tellg()), '\0');
+    in.seekg(0);
+    in.read(data.data(), data.size());
+    if (!in)
+        throw std::runtime_error("Cannot read genealogy snapshot");
+
+    return decode_snapshot<Id>(data, threads);
+}
+
+//Verifies a snapshot file in place, mapping it instead of reading it into
+//a buffer first. False as well when the file cannot be read.
+inline bool verify_snapshot_file(std::string const &path,
+                                 unsigned threads = 1) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat status;
+    if (fstat(fd, &status) < 0) {
+        ::close(fd);
+        return false;
+    }
+    auto size = static_cast<std::size_t>(status.st_size);
+    if (size == 0) {
+        ::close(fd);
+        return false;
+    }
+
+    auto mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    bool result;
+    try {
+        result = verify_snapshot(
+                std::string_view(static_cast<const char *>(mapped), size),
+                threads);
+    }
+    catch (...) {
+        munmap(mapped, size);
+        throw;
+    }
+    munmap(mapped, size);
+    return result;
+}
+
+#endif
@@ -0,0 +1,430 @@
+#ifndef _VIRUS_GENEALOGY_TIERED_
+#define _VIRUS_GENEALOGY_TIERED_
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_codec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//VirusGenealogy which keeps only its recently changed part in memory.
+//evict_unchanged_for() moves subtrees nobody touched for the given time into
+//a compressed file, any access to an evicted virus - exists, operator[],
+//iterating children of its parent, mutations - faults its whole subtree back.
+//
+//Only subtrees in which every virus but the root has a single parent are
+//evicted, so a cold virus never has a hot child. Faulted in viruses keep
+//their creation stamps. Faulting in may fail on I/O, so only the basic
+//guarantee is given by operations touching the cold tier.
+//
+//The cold file is scratch space, not persistence: it is emptied on
+//construction and only ever appended to, segments faulted back in are not
+//reclaimed, so it grows with every eviction for the life of the object.
+template<typename Virus, typename Clock = std::chrono::system_clock>
+class TieredVirusGenealogy {
+private:
+    using children_iterator_t =
+            typename VirusGenealogy<Virus>::children_iterator;
+
+    mutable VirusGenealogy<Virus> hot;
+    mutable std::fstream cold;
+    //Time of the last change of every hot virus, in seconds.
+    mutable std::map<typename Virus::id_type, std::int64_t> changed_at;
+    //Offset of the segment holding each cold virus.
+    mutable std::map<typename Virus::id_type, std::uint64_t> cold_segment;
+    //Roots of cold subtrees by their hot parents.
+    mutable std::multimap<typename Virus::id_type,
+                          typename Virus::id_type> cold_roots;
+
+    struct segment {
+        std::vector<typename Virus::id_type> ids;
+        std::vector<std::int64_t> changed;
+        std::vector<std::uint64_t> created;
+        //Index of the parent in ids, ignored for the root.
+        std::vector<std::uint64_t> parent;
+        std::uint64_t root;
+        std::vector<typename Virus::id_type> root_parents;
+    };
+
+    static inline std::int64_t now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+                Clock::now().time_since_epoch()).count();
+    }
+
+    inline void touch(typename Virus::id_type const &id) const {
+        changed_at[id] = now();
+    }
+
+    //Ids are sorted and front coded against their predecessor.
+    static inline std::string encode(segment const &cut) {
+        std::string payload, previous;
+        genealogy_bytes::put_varint(payload, cut.ids.size());
+        genealogy_bytes::put_varint(payload, cut.root);
+
+        for (std::size_t i = 0; i < cut.ids.size(); ++i) {
+            std::string bytes;
+            genealogy_id_codec<typename Virus::id_type>::encode(cut.ids[i],
+                                                               bytes);
+            std::size_t shared = 0;
+            while (shared < bytes.size() && shared < previous.size() &&
+                   bytes[shared] == previous[shared])
+                ++shared;
+
+            genealogy_bytes::put_varint(payload, shared);
+            genealogy_bytes::put_varint(payload, bytes.size() - shared);
+            payload.append(bytes, shared, std::string::npos);
+            genealogy_bytes::put_varint(payload, cut.changed[i]);
+            genealogy_bytes::put_varint(payload, cut.created[i]);
+            if (i != cut.root)
+                genealogy_bytes::put_varint(payload, cut.parent[i]);
+            previous = std::move(bytes);
+        }
+
+        genealogy_bytes::put_varint(payload, cut.root_parents.size());
+        for (auto &parent : cut.root_parents)
+            genealogy_bytes::put_id(payload, parent);
+
+        return payload;
+    }
+
+    static inline segment decode(std::string_view payload) {
+        segment cut;
+        auto count = genealogy_bytes::get_varint(payload);
+        cut.root = genealogy_bytes::get_varint(payload);
+        cut.parent.resize(count);
+
+        std::string previous;
+        for (std::size_t i = 0; i < count; ++i) {
+            auto shared = genealogy_bytes::get_varint(payload);
+            auto suffix = genealogy_bytes::get_varint(payload);
+            if (shared > previous.size() || suffix > payload.size())
+                throw std::runtime_error("Corrupt cold segment");
+
+            previous.resize(shared);
+            previous.append(payload.substr(0, suffix));
+            payload.remove_prefix(suffix);
+
+            cut.ids.push_back(
+                    genealogy_id_codec<typename Virus::id_type>::decode(
+                            previous));
+            cut.changed.push_back(genealogy_bytes::get_varint(payload));
+            cut.created.push_back(genealogy_bytes::get_varint(payload));
+            if (i != cut.root)
+                cut.parent[i] = genealogy_bytes::get_varint(payload);
+        }
+
+        auto parents = genealogy_bytes::get_varint(payload);
+        for (std::size_t i = 0; i < parents; ++i)
+            cut.root_parents.push_back(
+                    genealogy_bytes::get_id<typename Virus::id_type>(payload));
+
+        return cut;
+    }
+
+    inline segment read_segment(std::uint64_t offset) const {
+        std::string size_bytes(4, '\0');
+        cold.seekg(offset);
+        cold.read(size_bytes.data(), 4);
+
+        std::string_view size_view(size_bytes);
+        std::string payload(genealogy_bytes::get_u32(size_view), '\0');
+        cold.read(payload.data(), payload.size());
+        if (!cold)
+            throw std::runtime_error("Cannot read cold segment");
+
+        return decode(payload);
+    }
+
+    inline void fault_in(typename Virus::id_type const &id) const {
+        auto cut = read_segment(cold_segment.at(id));
+
+        for (auto &parent : cut.root_parents)
+            if (cold_segment.contains(parent))
+                fault_in(parent);
+
+        std::vector<std::vector<std::size_t>> children(cut.ids.size());
+        for (std::size_t i = 0; i < cut.ids.size(); ++i)
+            if (i != cut.root)
+                children[cut.parent[i]].push_back(i);
+
+        hot.create(cut.ids[cut.root], cut.root_parents,
+                   cut.created[cut.root]);
+        std::vector<std::size_t> to_create{cut.root};
+        while (!to_create.empty()) {
+            auto i = to_create.back();
+            to_create.pop_back();
+            if (i != cut.root)
+                hot.create(cut.ids[i], cut.ids[cut.parent[i]],
+                           cut.created[i]);
+
+            changed_at[cut.ids[i]] = cut.changed[i];
+            cold_segment.erase(cut.ids[i]);
+            to_create.insert(to_create.end(), children[i].begin(),
+                             children[i].end());
+        }
+
+        for (auto &parent : cut.root_parents) {
+            auto [from, to] = cold_roots.equal_range(parent);
+            for (auto it = from; it != to; ++it)
+                if (it->second == cut.ids[cut.root]) {
+                    cold_roots.erase(it);
+                    break;
+                }
+        }
+    }
+
+    //Returns whether the virus exists at all.
+    inline bool make_hot(typename Virus::id_type const &id) const {
+        if (cold_segment.contains(id))
+            fault_in(id);
+
+        return hot.exists(id);
+    }
+
+    inline void make_children_hot(typename Virus::id_type const &id) const {
+        while (true) {
+            auto it = cold_roots.find(id);
+            if (it == cold_roots.end())
+                return;
+            fault_in(it->second);
+        }
+    }
+
+    inline void evict(typename Virus::id_type const &root) {
+        segment cut;
+        std::map<typename Virus::id_type, std::size_t> position;
+        std::vector<typename Virus::id_type> to_visit{root};
+        while (!to_visit.empty()) {
+            auto current = to_visit.back();
+            to_visit.pop_back();
+            position[current] = 0;
+            for (auto &child : hot.get_children(current))
+                to_visit.push_back(child);
+        }
+
+        for (auto &[id, at] : position) {
+            at = cut.ids.size();
+            cut.ids.push_back(id);
+            cut.changed.push_back(changed_at.at(id));
+            cut.created.push_back(hot.created_at(id));
+        }
+
+        cut.root = position.at(root);
+        cut.parent.resize(cut.ids.size());
+        for (std::size_t i = 0; i < cut.ids.size(); ++i)
+            if (i != cut.root)
+                cut.parent[i] = position.at(hot.get_parents(cut.ids[i]).front());
+        cut.root_parents = hot.get_parents(root);
+
+        auto payload = encode(cut);
+        std::string size_bytes;
+        genealogy_bytes::put_u32(size_bytes, payload.size());
+
+        cold.seekp(0, std::ios::end);
+        std::uint64_t offset = cold.tellp();
+        cold.write(size_bytes.data(), size_bytes.size());
+        cold.write(payload.data(), payload.size());
+        cold.flush();
+        if (!cold)
+            throw std::runtime_error("Cannot write cold segment");
+
+        hot.remove(root);
+        for (auto &id : cut.ids) {
+            changed_at.erase(id);
+            cold_segment[id] = offset;
+        }
+        for (auto &parent : cut.root_parents)
+            cold_roots.insert({parent, root});
+    }
+
+public:
+    using children_iterator = children_iterator_t;
+
+    inline TieredVirusGenealogy(std::string const &cold_path,
+                                typename Virus::id_type const &stem_id)
+            : hot(stem_id),
+              cold(cold_path, std::ios::in | std::ios::out |
+                              std::ios::trunc | std::ios::binary) {
+        if (!cold)
+            throw std::runtime_error("Cannot open cold tier file");
+
+        touch(stem_id);
+    }
+
+    TieredVirusGenealogy(const TieredVirusGenealogy &) = delete;
+
+    TieredVirusGenealogy &operator=(const TieredVirusGenealogy &) = delete;
+
+    inline std::size_t hot_size() const noexcept {
+        return changed_at.size();
+    }
+
+    inline std::size_t cold_size() const noexcept {
+        return cold_segment.size();
+    }
+
+    //Evicts maximal subtrees without a change for at least age. Returns the
+    //number of evicted viruses.
+    inline std::size_t evict_unchanged_for(std::chrono::seconds age) {
+        auto cutoff = now() - age.count();
+        auto stem_id = hot.get_stem_id();
+
+        //A virus can go if it is old and all its children can go with it.
+        std::map<typename Virus::id_type, bool> evictable;
+        std::vector<std::pair<typename Virus::id_type, bool>> to_visit{
+                {stem_id, false}};
+        while (!to_visit.empty()) {
+            auto [current, expanded] = to_visit.back();
+            to_visit.pop_back();
+            auto children = hot.get_children(current);
+
+            if (!expanded) {
+                if (evictable.contains(current))
+                    continue;
+                evictable[current] = false;
+                to_visit.push_back({current, true});
+                for (auto &child : children)
+                    if (!evictable.contains(child))
+                        to_visit.push_back({child, false});
+                continue;
+            }
+
+            bool result = current != stem_id &&
+                          changed_at.at(current) <= cutoff &&
+                          !cold_roots.contains(current);
+            for (auto &child : children)
+                result = result && evictable.at(child) &&
+                         hot.get_parents(child).size() == 1;
+            evictable[current] = result;
+        }
+
+        std::vector<typename Virus::id_type> roots;
+        for (auto &[id, can_go] : evictable) {
+            if (!can_go)
+                continue;
+            auto parents = hot.get_parents(id);
+            if (parents.size() != 1 || !evictable.at(parents.front()))
+                roots.push_back(id);
+        }
+
+        auto before = cold_segment.size();
+        for (auto &root : roots)
+            evict(root);
+
+        return cold_segment.size() - before;
+    }
+
+    inline typename Virus::id_type get_stem_id() const {
+        return hot.get_stem_id();
+    }
+
+    inline bool exists(typename Virus::id_type const &id) const {
+        return make_hot(id);
+    }
+
+    inline const Virus &operator[](typename Virus::id_type const &id) const {
+        make_hot(id);
+        return hot[id];
+    }
+
+    inline std::uint64_t created_at(typename Virus::id_type const &id) const {
+        make_hot(id);
+        return hot.created_at(id);
+    }
+
+    inline std::vector<typename Virus::id_type>
+    get_parents(typename Virus::id_type const &id) const {
+        make_hot(id);
+        return hot.get_parents(id);
+    }
+
+    inline std::vector<typename Virus::id_type>
+    get_children(typename Virus::id_type const &id) const {
+        make_hot(id);
+        make_children_hot(id);
+        return hot.get_children(id);
+    }
+
+    inline children_iterator
+    get_children_begin(typename Virus::id_type const &id) const {
+        make_hot(id);
+        make_children_hot(id);
+        return hot.get_children_begin(id);
+    }
+
+    inline children_iterator
+    get_children_end(typename Virus::id_type const &id) const {
+        make_hot(id);
+        make_children_hot(id);
+        return hot.get_children_end(id);
+    }
+
+    inline void create(typename Virus::id_type const &id,
+                       typename Virus::id_type const &parent_id) {
+        create(id, std::vector<typename Virus::id_type>{parent_id});
+    }
+
+    inline void create(typename Virus::id_type const &id,
+                       std::vector<typename Virus::id_type> const &parent_ids) {
+        if (cold_segment.contains(id))
+            throw VirusAlreadyCreated();
+
+        for (auto &parent_id : parent_ids)
+            make_hot(parent_id);
+
+        hot.create(id, parent_ids);
+        if (!hot.exists(id))
+            return;
+
+        touch(id);
+        for (auto &parent_id : parent_ids)
+            touch(parent_id);
+    }
+
+    inline void connect(typename Virus::id_type const &child_id,
+                        typename Virus::id_type const &parent_id) {
+        make_hot(child_id);
+        make_hot(parent_id);
+        hot.connect(child_id, parent_id);
+        touch(child_id);
+        touch(parent_id);
+    }
+
+    inline void remove(typename Virus::id_type const &id) {
+        if (!make_hot(id))
+            throw VirusNotFound();
+
+        //Everything which may go or lose a parent has to be in memory.
+        std::set<typename Virus::id_type> affected{id};
+        std::vector<typename Virus::id_type> to_visit{id};
+        while (!to_visit.empty()) {
+            auto current = to_visit.back();
+            to_visit.pop_back();
+            make_children_hot(current);
+            for (auto &child : hot.get_children(current))
+                if (affected.insert(child).second)
+                    to_visit.push_back(child);
+        }
+
+        auto parents = hot.get_parents(id);
+        hot.remove(id);
+
+        for (auto &virus : affected)
+            if (hot.exists(virus))
+                touch(virus);
+            else
+                changed_at.erase(virus);
+
+        for (auto &parent : parents)
+            touch(parent);
+    }
+};
+
+#endif
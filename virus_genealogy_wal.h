@@ -0,0 +1,554 @@
+#ifndef _VIRUS_GENEALOGY_WAL_
+#define _VIRUS_GENEALOGY_WAL_
+
+#include "virus_genealogy.h"
+#include "virus_genealogy_async_io.h"
+#include "virus_genealogy_codec.h"
+#include "virus_genealogy_crc32c.h"
+#include "virus_genealogy_snapshot.h"
+
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+enum class genealogy_mutation : unsigned char {
+    create = 1,
+    connect = 2,
+    remove = 3,
+    weigh = 4
+};
+
+//One logged mutation. ids holds the virus followed by its parents for
+//create, the child and the parent for connect and weigh and the virus for
+//remove. created is the creation stamp of the virus a create made, weight
+//the one weigh gave the edge.
+//
+//In the log a record is a varint size followed by the mutation byte, a
+//varint count of ids, the ids, if there is one the varint stamp or for
+//weigh the u64 bits of the weight and a u32 CRC32C of all of it but the
+//size. The high bit of the mutation byte marks
+//the checksum, records without it are still read.
+template<typename Id>
+struct genealogy_wal_record {
+    static constexpr unsigned char checksummed = 0x80;
+
+    genealogy_mutation mutation;
+    std::vector<Id> ids;
+    std::optional<std::uint64_t> created = std::nullopt;
+    double weight = 0;
+
+    inline std::string encode() const {
+        std::string payload(
+                1, static_cast<char>(static_cast<unsigned char>(mutation) |
+                                     checksummed));
+        genealogy_bytes::put_varint(payload, ids.size());
+        for (auto &id : ids)
+            genealogy_bytes::put_id(payload, id);
+        if (mutation == genealogy_mutation::weigh)
+            genealogy_bytes::put_u64(payload,
+                                     std::bit_cast<std::uint64_t>(weight));
+        else if (created)
+            genealogy_bytes::put_varint(payload, *created);
+        genealogy_bytes::put_u32(payload,
+                                 genealogy_crc32c::compute(payload.data(),
+                                                           payload.size()));
+
+        std::string result;
+        genealogy_bytes::put_varint(result, payload.size());
+        return result + payload;
+    }
+
+    //Consumes one record from the front of in. A record not completely
+    //written is left in place and nullopt is returned: one cut short at the
+    //end, one still zero - writes complete in any order, so a later record
+    //may be in the file while the gap before it is not filled yet - and one
+    //failing its checksum, written only in part so far or torn by a crash.
+    static inline std::optional<genealogy_wal_record>
+    decode(std::string_view &in) {
+        auto rest = in;
+        std::uint64_t size;
+        try {
+            size = genealogy_bytes::get_varint(rest);
+        }
+        catch (std::runtime_error &) {
+            return std::nullopt;
+        }
+        if (size == 0 || rest.size() < size || rest[0] == 0)
+            return std::nullopt;
+
+        auto payload = rest.substr(0, size);
+        auto mutation = static_cast<unsigned char>(payload[0]);
+        if (mutation & checksummed) {
+            if (size <= 4)
+                return std::nullopt;
+            auto stored = payload.substr(size - 4);
+            payload.remove_suffix(4);
+            if (genealogy_bytes::get_u32(stored) !=
+                genealogy_crc32c::compute(payload.data(), payload.size()))
+                return std::nullopt;
+            mutation &= ~checksummed;
+        }
+        if (mutation < 1 || mutation > 4)
+            throw std::runtime_error("Corrupt genealogy log");
+
+        genealogy_wal_record record{
+                static_cast<genealogy_mutation>(mutation), {}};
+        payload.remove_prefix(1);
+        auto count = genealogy_bytes::get_varint(payload);
+        for (std::uint64_t i = 0; i < count; ++i)
+            record.ids.push_back(genealogy_bytes::get_id<Id>(payload));
+        if (record.mutation == genealogy_mutation::weigh)
+            record.weight = std::bit_cast<double>(
+                    genealogy_bytes::get_u64(payload));
+        else if (!payload.empty())
+            record.created = genealogy_bytes::get_varint(payload);
+
+        in = rest.substr(size);
+        return record;
+    }
+
+    //A create is stamped as logged, records without a stamp as if created
+    //now.
+    template<typename Genealogy>
+    inline void apply(Genealogy &genealogy) const {
+        switch (mutation) {
+            case genealogy_mutation::create: {
+                auto &id = ids.at(0);
+                std::vector<Id> parents(ids.begin() + 1, ids.end());
+                if (created)
+                    genealogy.create(id, parents, *created);
+                else
+                    genealogy.create(id, parents);
+                break;
+            }
+            case genealogy_mutation::connect:
+                genealogy.connect(ids.at(0), ids.at(1));
+                break;
+            case genealogy_mutation::remove:
+                genealogy.remove(ids.at(0));
+                break;
+            case genealogy_mutation::weigh:
+                genealogy.set_edge_weight(ids.at(0), ids.at(1), weight);
+                break;
+        }
+    }
+};
+
+//Applies all complete records of the log to the genealogy, up to the first
+//one which is not. Returns the number of bytes consumed.
+template<typename Genealogy>
+inline std::size_t replay_wal(Genealogy &genealogy, std::string const &path) {
+    using id_t = typename std::remove_cvref_t<
+            decltype(genealogy.get_stem_id())>;
+
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot read genealogy log");
+
+    std::string data((std::istreambuf_iterator<char>(in)),
+                     std::istreambuf_iterator<char>());
+    std::string_view rest(data);
+    while (auto record = genealogy_wal_record<id_t>::decode(rest))
+        record->apply(genealogy);
+
+    return data.size() - rest.size();
+}
+
+//Appends records to a log segment through genealogy_async_io. Appending
+//only encodes and queues, errors of the writes come out of sync().
+template<typename Id>
+class genealogy_wal_writer {
+private:
+    genealogy_async_io &io;
+    int fd;
+    std::uint64_t offset = 0;
+    std::deque<std::future<void>> pending;
+    //Syncs which may still be running. Each one finishes after the writes
+    //appended before it, so waiting for them covers writes handed to the
+    //futures sync() returned, even if those are dropped unread.
+    std::deque<std::shared_future<void>> syncs;
+    //First failure among writes collected before the next sync().
+    std::exception_ptr failed;
+
+    inline void collect_finished() {
+        while (!pending.empty() &&
+               pending.front().wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready) {
+            try {
+                pending.front().get();
+            }
+            catch (...) {
+                if (!failed)
+                    failed = std::current_exception();
+            }
+            pending.pop_front();
+        }
+    }
+
+public:
+    inline genealogy_wal_writer(std::string const &path,
+                                genealogy_async_io &io)
+            : io(io) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "open");
+    }
+
+    genealogy_wal_writer(const genealogy_wal_writer &) = delete;
+
+    genealogy_wal_writer &operator=(const genealogy_wal_writer &) = delete;
+
+    inline ~genealogy_wal_writer() {
+        for (auto &write : pending)
+            write.wait();
+        for (auto &flushed : syncs)
+            flushed.wait();
+        ::close(fd);
+    }
+
+    inline void append(genealogy_wal_record<Id> const &record) {
+        collect_finished();
+        auto bytes = record.encode();
+        auto size = bytes.size();
+        pending.push_back(io.write(fd, offset, std::move(bytes)));
+        offset += size;
+    }
+
+    //The returned future is ready once everything appended so far is on
+    //disk, and rethrows the first failed write.
+    inline std::future<void> sync() {
+        while (!syncs.empty() &&
+               syncs.front().wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready)
+            syncs.pop_front();
+
+        auto flushed = io.sync(fd).share();
+        syncs.push_back(flushed);
+        auto writes = std::move(pending);
+        pending.clear();
+
+        return std::async(std::launch::deferred,
+                          [writes = std::move(writes), flushed,
+                           error = std::exchange(failed, nullptr)]() mutable {
+            for (auto &write : writes)
+                try {
+                    write.get();
+                }
+                catch (...) {
+                    if (!error)
+                        error = std::current_exception();
+                }
+            flushed.get();
+            if (error)
+                std::rethrow_exception(error);
+        });
+    }
+};
+
+//Saves a snapshot without holding up the caller for more than copying the
+//topology. Blocks are encoded on a background thread and each one is queued
+//for writing as soon as it is ready, so encoding overlaps with the disk. The
+//snapshot is written aside and renamed into place once synced.
+//
+//Like every std::async future, the returned one waits for the snapshot
+//when destroyed.
+template<typename Virus, typename Allocator>
+inline std::future<void>
+save_snapshot_async(VirusGenealogy<Virus, Allocator> const &genealogy,
+                    std::string const &path, genealogy_async_io &io,
+                    std::size_t block_size = 65536) {
+    auto topology = std::make_shared<
+            const genealogy_topology<typename Virus::id_type>>(
+            genealogy.topology());
+
+    return std::async(std::launch::async, [topology, path, &io, block_size] {
+        auto temporary = path + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "open");
+
+        std::vector<std::future<void>> writes;
+        std::exception_ptr error;
+        try {
+            auto blocks = snapshot_blocks(topology->ids.size(), block_size);
+            std::vector<snapshot_block_info> infos;
+            std::uint64_t offset = genealogy_snapshot_format::head_size(blocks);
+
+            for (std::size_t block = 0; block < blocks; ++block) {
+                auto [bytes, info] =
+                        encode_snapshot_block(*topology, block, block_size);
+                infos.push_back(info);
+                auto at = offset;
+                offset += bytes.size();
+                writes.push_back(io.write(fd, at, std::move(bytes)));
+            }
+            writes.push_back(io.write(
+                    fd, 0, encode_snapshot_head(*topology, block_size, infos)));
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+
+        //The descriptor has to outlive every queued write.
+        for (auto &write : writes)
+            try {
+                write.get();
+            }
+            catch (...) {
+                if (!error)
+                    error = std::current_exception();
+            }
+
+        try {
+            if (!error)
+                io.sync(fd).get();
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        ::close(fd);
+
+        if (!error && std::rename(temporary.c_str(), path.c_str()) != 0)
+            error = std::make_exception_ptr(std::system_error(
+                    errno, std::generic_category(), "rename"));
+        if (error)
+            std::rethrow_exception(error);
+    });
+}
+
+//VirusGenealogy which logs every mutation to a write-ahead log. Mutations
+//only queue their record, writing happens on the I/O thread, and sync()
+//tells when they are durable. checkpoint() starts a snapshot in the
+//background and continues the log in a new segment - recovery loads the
+//last snapshot and replays the segment started with it.
+//
+//Mutations keep the guarantees of VirusGenealogy, but a failure to queue the
+//record after a successful mutation leaves it unlogged.
+template<typename Virus>
+class DurableVirusGenealogy {
+private:
+    using record_t = genealogy_wal_record<typename Virus::id_type>;
+    using writer_t = genealogy_wal_writer<typename Virus::id_type>;
+
+    genealogy_async_io &io;
+    VirusGenealogy<Virus> genealogy;
+    std::unique_ptr<writer_t> wal;
+
+public:
+    using children_iterator = typename VirusGenealogy<Virus>::children_iterator;
+
+    inline DurableVirusGenealogy(typename Virus::id_type const &stem_id,
+                                 std::string const &wal_path,
+                                 genealogy_async_io &io,
+                                 genealogy_mode mode = genealogy_mode::dag)
+            : io(io), genealogy(stem_id, mode),
+              wal(std::make_unique<writer_t>(wal_path, io)) {}
+
+    //Recovers from a snapshot and the log segments written after it, then
+    //logs to a fresh segment. Each segment is cut off after its last
+    //complete record - one torn by a crash was never synced, nor was
+    //anything after it.
+    inline DurableVirusGenealogy(
+            genealogy_topology<typename Virus::id_type> const &snapshot,
+            std::vector<std::string> const &replayed,
+            std::string const &wal_path, genealogy_async_io &io,
+            unsigned threads = 1)
+            : io(io), genealogy(snapshot, threads) {
+        for (auto &segment : replayed)
+            if (::truncate(segment.c_str(), static_cast<off_t>(
+                    replay_wal(genealogy, segment))) < 0)
+                throw std::system_error(errno, std::generic_category(),
+                                        "truncate");
+        wal = std::make_unique<writer_t>(wal_path, io);
+    }
+
+    DurableVirusGenealogy(const DurableVirusGenealogy &) = delete;
+
+    DurableVirusGenealogy &operator=(const DurableVirusGenealogy &) = delete;
+
+    inline const VirusGenealogy<Virus> &get_genealogy() const noexcept {
+        return genealogy;
+    }
+
+    inline typename Virus::id_type get_stem_id() const {
+        return genealogy.get_stem_id();
+    }
+
+    inline bool exists(typename Virus::id_type const &id) const {
+        return genealogy.exists(id);
+    }
+
+    inline const Virus &operator[](typename Virus::id_type const &id) const {
+        return genealogy[id];
+    }
+
+    inline std::vector<typename Virus::id_type>
+    get_parents(typename Virus::id_type const &id) const {
+        return genealogy.get_parents(id);
+    }
+
+    inline std::vector<typename Virus::id_type>
+    get_children(typename Virus::id_type const &id) const {
+        return genealogy.get_children(id);
+    }
+
+    inline std::size_t size() const noexcept {
+        return genealogy.size();
+    }
+
+    inline std::size_t edge_count() const noexcept {
+        return genealogy.edge_count();
+    }
+
+    inline std::size_t parent_count(typename Virus::id_type const &id) const {
+        return genealogy.parent_count(id);
+    }
+
+    inline std::size_t child_count(typename Virus::id_type const &id) const {
+        return genealogy.child_count(id);
+    }
+
+    inline std::vector<std::pair<typename Virus::id_type, std::size_t>>
+    top_by_children(std::size_t k) const {
+        return genealogy.top_by_children(k);
+    }
+
+    inline auto leaves() const noexcept {
+        return genealogy.leaves();
+    }
+
+    inline std::uint64_t created_at(typename Virus::id_type const &id) const {
+        return genealogy.created_at(id);
+    }
+
+    inline std::vector<typename Virus::id_type>
+    created_between(std::uint64_t from, std::uint64_t to) const {
+        return genealogy.created_between(from, to);
+    }
+
+    inline std::vector<typename Virus::id_type> newest(std::size_t k) const {
+        return genealogy.newest(k);
+    }
+
+    inline bool has_edge(typename Virus::id_type const &child_id,
+                         typename Virus::id_type const &parent_id) const {
+        return genealogy.has_edge(child_id, parent_id);
+    }
+
+    inline std::vector<typename Virus::id_type>
+    children_page(typename Virus::id_type const &id,
+                  std::optional<typename Virus::id_type> const &cursor,
+                  std::size_t limit) const {
+        return genealogy.children_page(id, cursor, limit);
+    }
+
+    inline children_iterator
+    get_children_begin(typename Virus::id_type const &id) const {
+        return genealogy.get_children_begin(id);
+    }
+
+    inline children_iterator
+    get_children_end(typename Virus::id_type const &id) const {
+        return genealogy.get_children_end(id);
+    }
+
+    inline void create(typename Virus::id_type const &id,
+                       typename Virus::id_type const &parent_id) {
+        genealogy.create(id, parent_id);
+        wal->append(record_t{genealogy_mutation::create, {id, parent_id},
+                             genealogy.created_at(id)});
+    }
+
+    inline void create(typename Virus::id_type const &id,
+                       std::vector<typename Virus::id_type> const &parent_ids) {
+        genealogy.create(id, parent_ids);
+        //Without parents nothing was created.
+        if (parent_ids.empty())
+            return;
+
+        record_t record{genealogy_mutation::create, {id},
+                        genealogy.created_at(id)};
+        record.ids.insert(record.ids.end(), parent_ids.begin(),
+                          parent_ids.end());
+        wal->append(record);
+    }
+
+    inline void connect(typename Virus::id_type const &child_id,
+                        typename Virus::id_type const &parent_id) {
+        genealogy.connect(child_id, parent_id);
+        wal->append(record_t{genealogy_mutation::connect,
+                             {child_id, parent_id}});
+    }
+
+    inline void remove(typename Virus::id_type const &id) {
+        genealogy.remove(id);
+        wal->append(record_t{genealogy_mutation::remove, {id}});
+    }
+
+    inline void set_edge_weight(typename Virus::id_type const &child_id,
+                                typename Virus::id_type const &parent_id,
+                                double weight) {
+        genealogy.set_edge_weight(child_id, parent_id, weight);
+        record_t record{genealogy_mutation::weigh, {child_id, parent_id}};
+        record.weight = weight;
+        wal->append(record);
+    }
+
+    inline double edge_weight(typename Virus::id_type const &child_id,
+                              typename Virus::id_type const &parent_id) const {
+        return genealogy.edge_weight(child_id, parent_id);
+    }
+
+    inline std::pair<std::vector<typename Virus::id_type>, double>
+    weighted_lineage(typename Virus::id_type const &id) const {
+        return genealogy.weighted_lineage(id);
+    }
+
+    inline std::future<void> sync() {
+        return wal->sync();
+    }
+
+    //The returned future is ready once the snapshot and the end of the
+    //previous segment are durable. Only encoding and writing happen in the
+    //background: the topology is copied on the calling thread first, which
+    //stalls mutations for O(n + edges) and briefly takes as much memory
+    //again as the ids and edges. Snapshots hold no edge weights, so the
+    //next segment starts with a record for each one.
+    inline std::future<void> checkpoint(std::string const &snapshot_path,
+                                        std::string const &next_wal_path) {
+        auto next = std::make_unique<writer_t>(next_wal_path, io);
+        for (auto &[child, parent, weight] : genealogy.edge_weights()) {
+            record_t record{genealogy_mutation::weigh, {child, parent}};
+            record.weight = weight;
+            next->append(record);
+        }
+        auto snapshot = save_snapshot_async(genealogy, snapshot_path, io);
+        std::swap(wal, next);
+
+        return std::async(std::launch::async,
+                          [previous = std::move(next),
+                           snapshot = std::move(snapshot)]() mutable {
+            previous->sync().get();
+            snapshot.get();
+        });
+    }
+};
+
+#endif